@@ -447,6 +447,227 @@ pass_message_blocks(void)
 	}
 }
 
+/*
+ * Return true if port i faces the negotiation's initiator,
+ * i.e. it is the input of an output concentrator or one of
+ * the inputs of an input concentrator.
+ */
+STATIC bool
+is_up_port(int i)
+{
+	if (multiple_inputs)
+		return i != STDOUT_FILENO;
+	else
+		return i == STDIN_FILENO;
+}
+
+/* Return true if the block carries the negotiation's outcome. */
+static bool
+is_final(struct dgsh_negotiation *mb)
+{
+	return mb->state == PS_RUN || mb->state == PS_DRAW_EXIT ||
+		(mb->state == PS_ERROR && mb->is_error_confirmed);
+}
+
+/* Free a block other than chosen_mb, on which free_mb() partly works. */
+static void
+discard_block(struct dgsh_negotiation *mb)
+{
+	struct dgsh_negotiation *saved = chosen_mb;
+
+	chosen_mb = mb;
+	free_mb(mb);
+	chosen_mb = saved;
+}
+
+/*
+ * Write the message block mb, as dispatched by the node with
+ * index oi from its fd direction ofd, to all ports on the
+ * up or the down side of the concentrator.
+ */
+static void
+broadcast_block(struct dgsh_negotiation *mb, bool up, int oi, int ofd)
+{
+	int i;
+
+	mb->origin_index = oi;
+	mb->origin_fd_direction = ofd;
+	mb->is_origin_conc = true;
+	mb->conc_pid = pid;
+	chosen_mb = mb;
+	for (i = 0; i < nfd; i++) {
+		if (i == STDERR_FILENO || (noinput && i == STDIN_FILENO) ||
+				is_up_port(i) != up)
+			continue;
+		DPRINTF(4, "%s(): fd %d set for writing to tool with pid %d",
+				__func__, i, pi[i].pid);
+		if (write_message_block(i) == OP_ERROR)
+			mb->state = PS_ERROR;
+	}
+}
+
+/*
+ * Read a message block from each port on the up or the down side
+ * of the concentrator, and record the process talking to the port.
+ * Blocks still under negotiation are merged into *mb, which is
+ * set to the first block if NULL.  Return in *oi and *ofd
+ * the origin of the block read from port key_fd.
+ * The blocks are merged in port order, whatever the order of their
+ * arrival, so that the nodes and edges of the branches get the same
+ * numbering as on the ring, on which the solution depends.
+ */
+static void
+collect_blocks(struct dgsh_negotiation **mb, bool up, int key_fd,
+		int *oi, int *ofd)
+{
+	fd_set readfds;
+	int i, nfds, pending = 0;
+	bool error = false;
+	struct dgsh_negotiation **rb;
+
+	if ((rb = calloc(nfd, sizeof(struct dgsh_negotiation *))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < nfd; i++) {
+		pi[i].seen = false;
+		if (i == STDERR_FILENO || (noinput && i == STDIN_FILENO) ||
+				is_up_port(i) != up)
+			continue;
+		pending++;
+	}
+
+	while (pending > 0) {
+		FD_ZERO(&readfds);
+		nfds = 0;
+		for (i = 0; i < nfd; i++) {
+			if (i == STDERR_FILENO ||
+					(noinput && i == STDIN_FILENO) ||
+					is_up_port(i) != up || pi[i].seen)
+				continue;
+			FD_SET(i, &readfds);
+			nfds = max(i + 1, nfds);
+		}
+	again:
+		if (select(nfds, &readfds, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				goto again;
+			err(1, "select");
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (!FD_ISSET(i, &readfds))
+				continue;
+			pi[i].seen = true;
+			pending--;
+			if (read_message_block(i, &rb[i]) == OP_ERROR) {
+				if (rb[i])
+					discard_block(rb[i]);
+				rb[i] = NULL;
+				error = true;
+				continue;
+			}
+
+			if (rb[i]->is_origin_conc)
+				pi[i].pid = rb[i]->conc_pid;
+			else
+				pi[i].pid = get_origin_pid(rb[i]);
+			DPRINTF(4, "%s(): read block in state %s via fd %d from pid %d",
+					__func__, state_name(rb[i]->state), i,
+					pi[i].pid);
+		}
+	}
+
+	for (i = 0; i < nfd; i++) {
+		if (rb[i] == NULL)
+			continue;
+		if (i == key_fd) {
+			*oi = rb[i]->origin_index;
+			*ofd = rb[i]->origin_fd_direction;
+		}
+		if (*mb == NULL)
+			*mb = rb[i];
+		else if (is_final(*mb) || is_final(rb[i]))
+			discard_block(rb[i]);	/* Same solution */
+		else {
+			if (merge_message_block(*mb, rb[i]) == OP_ERROR)
+				(*mb)->state = PS_ERROR;
+			else if (i == key_fd)	/* Renumbered */
+				*oi = (*mb)->origin_index;
+			discard_block(rb[i]);
+		}
+	}
+	free(rb);
+
+	if (error) {
+		if (*mb == NULL) {
+			construct_message_block("dgsh-conc", pid);
+			*mb = chosen_mb;
+		}
+		(*mb)->state = PS_ERROR;
+	}
+}
+
+/*
+ * Pass around the message blocks on a tree rather than a ring.
+ * A block arriving from the initiator's side is sent to all other
+ * ports at once; the blocks they return are merged and sent back
+ * towards the initiator.  Independent branches of the graph thus
+ * state their requirements and receive the solution concurrently.
+ */
+STATIC int
+pass_message_blocks_tree(void)
+{
+	struct dgsh_negotiation *mb = NULL;
+	int oi = -1, ofd = STDOUT_FILENO;	/* Origin of blocks sent down */
+	int roi = -1, rofd = STDIN_FILENO;	/* ... sent up */
+	/* Ports whose block origin we pass on, as pass_message_blocks() */
+	int key_up = STDIN_FILENO;
+	int key_down = multiple_inputs ? STDOUT_FILENO : nfd - 1;
+
+	if (noinput) {
+#ifdef TIME
+		clock_gettime(CLOCK_MONOTONIC, &tstart);
+#endif
+		construct_message_block("dgsh-conc", pid);
+		mb = chosen_mb;
+	}
+
+	for (;;) {
+		if (!noinput)
+			collect_blocks(&mb, true, key_up, &oi, &ofd);
+		broadcast_block(mb, false, oi, ofd);
+		collect_blocks(&mb, false, key_down, &roi, &rofd);
+		chosen_mb = mb;
+		if (noinput) {
+			if (is_final(mb))
+				break;
+			if (mb->state == PS_NEGOTIATION) {
+				DPRINTF(1, "%s(): Gathered I/O requirements.", __func__);
+				int state = solve_graph();
+				if (state == OP_ERROR) {
+					mb->state = PS_ERROR;
+					mb->is_error_confirmed = true;
+				} else if (state == OP_DRAW_EXIT)
+					mb->state = PS_DRAW_EXIT;
+				else {
+					DPRINTF(1, "%s(): Computed solution", __func__);
+					mb->state = PS_RUN;
+				}
+			} else
+				mb->is_error_confirmed = true;
+			continue;
+		}
+		set_io_channels(mb);
+		broadcast_block(mb, true, roi, rofd);
+		if (is_final(mb))
+			break;
+		discard_block(mb);
+		mb = NULL;
+	}
+	DPRINTF(4, "%s(): conc leaves negotiation", __func__);
+	chosen_mb = mb;
+	return mb->state;
+}
+
 
 
 /*
@@ -467,18 +688,16 @@ scatter_input_fds(struct dgsh_negotiation *mb)
 	bool ignore = false;
 	DPRINTF(4, "%s(): fds to read: %d", __func__, n_to_read);
 
-	for (i = 0; i < n_to_read; i++)
-		read_fds[i] = read_fd(STDIN_FILENO);
+	read_fd_array(STDIN_FILENO, read_fds, n_to_read);
 
 	for (i = STDOUT_FILENO; i != STDIN_FILENO; i = next_fd(i, &ignore)) {
 		int n_to_write = get_expected_fds_n(mb, pi[i].pid);
 		DPRINTF(4, "%s(): fds to write for p[%d].pid %d: %d",
 				__func__, i, pi[i].pid, n_to_write);
-		for (j = write_index; j < write_index + n_to_write; j++) {
-			write_fd(i, read_fds[j]);
+		write_fd_array(i, read_fds + write_index, n_to_write);
+		for (j = write_index; j < write_index + n_to_write; j++)
 			DPRINTF(4, "%s(): Write fd: %d to output channel: %d",
 					__func__, read_fds[j], i);
-		}
 		write_index += n_to_write;
 	}
 	assert(write_index == n_to_read);
@@ -506,17 +725,15 @@ gather_input_fds(struct dgsh_negotiation *mb)
 		int n_to_read = get_provided_fds_n(mb, pi[i].pid);
 		DPRINTF(4, "%s(): fds to read for p[%d].pid %d: %d",
 				__func__, i, pi[i].pid, n_to_read);
-		for (j = read_index; j < read_index + n_to_read; j++) {
-			read_fds[j] = read_fd(i);
+		read_fd_array(i, read_fds + read_index, n_to_read);
+		for (j = read_index; j < read_index + n_to_read; j++)
 			DPRINTF(4, "%s(): Read fd: %d from input channel: %d",
 					__func__, read_fds[j], i);
-		}
 		read_index += n_to_read;
 	}
 	assert(read_index == n_to_write);
 
-	for (i = 0; i < n_to_write; i++)
-		write_fd(STDOUT_FILENO, read_fds[i]);
+	write_fd_array(STDOUT_FILENO, read_fds, n_to_write);
 
 }
 
@@ -529,6 +746,7 @@ main(int argc, char *argv[])
 	int exit;
 	char *debug_level = NULL;
 	char *timeout;
+	char *mode;
 
 	program_name = argv[0];
 	pid = getpid();
@@ -579,7 +797,11 @@ main(int argc, char *argv[])
 	pi = (struct portinfo *)calloc(nfd, sizeof(struct portinfo));
 
 	chosen_mb = NULL;
-	exit = pass_message_blocks();
+	if ((mode = getenv("DGSH_NEGOTIATION")) != NULL &&
+			strcmp(mode, "tree") == 0)
+		exit = pass_message_blocks_tree();
+	else
+		exit = pass_message_blocks();
 	if (exit == PS_RUN) {
 		if (noinput)
 			DPRINTF(1, "%s(): Communicated the solution", __func__);
@@ -16,25 +16,39 @@
  */
 
 #ifdef __linux__
-#define _XOPEN_SOURCE 500	// pread pwrite
+#define _GNU_SOURCE	// pread pwrite tee splice fallocate
 #endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#else
 #include <sys/select.h>
+#endif
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dgsh.h"
 #include "dgsh-debug.h"
+#include "lz.h"
+#include "memscan.h"
+#include "uring.h"
 #include "minmax.h"
 
 #if defined(DEBUG_DATA)
@@ -63,8 +77,11 @@ struct pool_buffer {
 		s_none,		/* Stored nowhere */
 		s_memory,	/* Stored in memory */
 		s_memory_backed,/* Stored in memory and backed to temporary file */
+		s_compressed,	/* Stored compressed in memory */
 		s_file		/* Stored in temporary file */
 	} s; 			/* Where it is stored */
+	bool busy;		/* Asynchronous file I/O is in progress */
+	size_t csize;		/* Compressed size; 0 if stored uncompressed */
 };
 
 /*
@@ -81,9 +98,50 @@ struct buffer_pool {
 	/* Paging information */
 	int buffers_paged_out, buffers_paged_in, pages_freed;
 
+	int buffers_reused;		/* Allocations served from the free list */
+
+	/* Compression information */
+	int buffers_compressed, buffers_decompressed;
+	unsigned long compressed_bytes;	/* Memory used by compressed buffers */
+	unsigned long compressed_in, compressed_out;	/* Total bytes */
+
+	int buffers_writing;		/* Asynchronous page outs whose memory will be freed */
+
 	int page_out_ptr;		/* Pointer to first buffer to page out */
 	int page_file_fd;		/* File descriptor of temporary file used for paging buffer pool */
+	off_t page_file_size;		/* Size of the memory-mapped temporary file */
+	struct uring *uring;		/* Asynchronous temporary file I/O */
 	int free_pool_begin;		/* Start of freed area */
+
+	/*
+	 * Ring buffer alternative to the buffers vector (-r).
+	 * The same memory is mapped twice back-to-back, so data
+	 * up to ring_size bytes long is always contiguous.
+	 * Buffers are then notional buffer_size parts of the ring.
+	 */
+	char *ring;			/* Memory of the (first) ring mapping */
+	size_t ring_size;		/* Size of each ring mapping */
+	int ring_fd;			/* File descriptor of the mapped memory */
+	off_t ring_tail;		/* Page-aligned start of data still in use */
+
+	/*
+	 * Mapping of a regular file source, which is used in place
+	 * of the buffers, for the file itself stores the data.
+	 */
+	int map_fd;			/* Mapped file descriptor; -1 if none */
+	char *map;			/* Memory of the file mapping */
+	off_t map_size;			/* Size of the file mapping */
+	off_t map_start;		/* File offset of the source's data */
+	off_t map_tail;			/* Page-aligned start of data still in use */
+
+	/*
+	 * The pool of a source read ahead of becoming active and that
+	 * of its active predecessor count each other's memory against
+	 * the memory limit.  The read-ahead pool also leaves half of
+	 * the limit to the active one, so that it can always progress.
+	 */
+	struct buffer_pool *peer;	/* Pool sharing the memory limit */
+	bool read_ahead;		/* True for the read-ahead pool */
 };
 
 
@@ -99,12 +157,27 @@ new_buffer_pool(void)
 	bp->pool_size = 0;
 	bp->page_out_ptr = 0;
 	bp->page_file_fd = -1;
+	bp->page_file_size = 0;
+	bp->uring = NULL;
+	bp->buffers_writing = 0;
 	bp->free_pool_begin = 0;
+	bp->ring = NULL;
+	bp->ring_size = 0;
+	bp->ring_fd = -1;
+	bp->ring_tail = 0;
+	bp->map_fd = -1;
+	bp->map = NULL;
+	bp->map_size = bp->map_start = bp->map_tail = 0;
+	bp->peer = NULL;
+	bp->read_ahead = false;
 
 	bp->allocated_pool_end = 0;
 
 	bp->buffers_allocated = bp->buffers_freed = bp->max_buffers_allocated =
 	bp->buffers_paged_out = bp->buffers_paged_in = bp->pages_freed = 0;
+	bp->buffers_reused = 0;
+	bp->buffers_compressed = bp->buffers_decompressed = 0;
+	bp->compressed_bytes = bp->compressed_in = bp->compressed_out = 0;
 
 	return bp;
 }
@@ -118,12 +191,40 @@ struct io_buffer {
 	size_t size;	/* Buffer size */
 };
 
-/* Maximum amount of memory to allocate. (Set through -S) */
+/* Maximum amount of memory to allocate. (Set through -m) */
 static unsigned long max_mem = 256 * 1024 * 1204;
 
 /* Scatter the output across the files, rather than copying it. */
 static bool opt_scatter = false;
 
+/* Size scattered chunks according to each sink's measured drain rate */
+static bool opt_weighted = false;
+
+/* Weight of a new sample in a sink's drain rate moving average */
+#define RATE_ALPHA 0.25
+
+/* Data a sink must consume for measuring its drain rate, unless it is a pipe */
+#define RATE_WINDOW (64 * 1024)
+
+/*
+ * Route each scattered record to a sink chosen by a hash of its key,
+ * which is a delimited field (-k, -d) or a byte range (-c).
+ */
+static bool opt_partition = false;
+static int key_field = 0;		/* Key field number; 0 for a byte range */
+static char key_delim = '\t';		/* Key field delimiter */
+static size_t key_begin = 0, key_end = 0;	/* Key byte range; 0 end for end of record */
+
+/*
+ * Scatter chunks of the specified number of records to the sinks in
+ * strict round-robin order, or gather them back from multiple sources
+ * in the same order (Set through -R)
+ */
+static int ordered_chunk = 0;
+
+/* Sources whose chunks are gathered in order */
+static struct source_info *gather_sources = NULL;
+
 /*
  * When set, permute the inputs to the specified outputs
  * Ordinals and number of the destination outputs
@@ -131,18 +232,76 @@ static bool opt_scatter = false;
 static int *permute_dest = NULL;
 static int permute_n = 0;
 
+/* Handling of data held back for a sink that falls behind (Set through -O) */
+enum sink_policy {
+	sp_block,	/* Keep all data until the sink writes them */
+	sp_spill,	/* Move the data beyond the cap to the sink's own file */
+	sp_drop,	/* Drop the oldest records beyond the cap */
+};
+
+/* Policies specified for outputs */
+struct output_policy {
+	int output;		/* Output ordinal, from 0 */
+	enum sink_policy policy;
+	size_t cap;		/* Memory cap; 0 for the buffer size */
+};
+static struct output_policy *output_policies = NULL;
+static int output_policies_n = 0;
+
 /* Use a temporary file for overflowing buffered data */
 static bool use_tmp_file = false;
 
+/* Allocate buffer memory from huge pages */
+static bool opt_huge_pages = false;
+
+/* Size of the huge pages used for -H */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Map the temporary file into memory and let the kernel page it */
+static bool opt_mmap_spill = false;
+
+/* Compress buffers that exceed the memory limit */
+static bool opt_compress = false;
+
+/* Perform temporary file I/O asynchronously through io_uring */
+static bool opt_uring = false;
+
+/* Maximum number of asynchronous temporary file requests in flight */
+#define URING_ENTRIES 64
+
+/* Number of buffers to read ahead of the slowest sink */
+#define PREFETCH_BUFFERS 4
+
+/* Store buffered data in a mirrored ring buffer */
+static bool opt_ring = false;
+
+/* Sources still without a ring, and memory taken by the created rings */
+static int rings_pending = 0;
+static unsigned long ring_memory = 0;
+
+/* Copy data between pipes through tee(2) without reading it */
+static bool opt_zero_copy = false;
+
+/* Map buffer pool pages into sink pipes through vmsplice(2) */
+static bool opt_vmsplice = false;
+
+/* Write regular input files to the sinks from a mapping of the file */
+static bool opt_map = false;
+
+/* Interval for checking the release of mapped pages when memory is full */
+#define VMSPLICE_POLL_MS 10
+
+/* Copy data through a reader thread and a writer thread per sink */
+static bool opt_threads = false;
+
 /* User-specified temporary directory */
 static char *opt_tmp_dir = NULL;
 
 /*
  * Split scattered data on blocks of specified size; otherwise on line boundaries
- * Currently there is no support for this option; a -l option should be added.
+ * (Set through -l)
  */
-
-static bool block_len = 0;
+static size_t block_len = 0;
 
 /* Set to true when we reach EOF on input */
 static bool reached_eof = false;
@@ -150,6 +309,56 @@ static bool reached_eof = false;
 /* Record terminator */
 static char rt = '\n';
 
+/* Periodically write statistics to this file (Set through -S) */
+static char *stats_path = NULL;
+
+/* Interval between statistics updates (ms) */
+#define STATS_INTERVAL_MS 1000
+
+/* Time during which a source or sink could not perform I/O */
+struct stall {
+	bool stalled;		/* True if currently stalled */
+	struct timespec begin;	/* Start of the current stall */
+	double time;		/* Duration of the past stalls (s) */
+};
+
+/* Return the difference between two times in seconds */
+static double
+time_diff(const struct timespec *end, const struct timespec *begin)
+{
+	return (end->tv_sec - begin->tv_sec) + (end->tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/* Mark the start of a stall, unless one is in progress */
+static void
+stall_begin(struct stall *st)
+{
+	if (st->stalled)
+		return;
+	st->stalled = true;
+	clock_gettime(CLOCK_MONOTONIC, &st->begin);
+}
+
+/* Mark the end of a stall, if one is in progress */
+static void
+stall_end(struct stall *st)
+{
+	struct timespec now;
+
+	if (!st->stalled)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	st->time += time_diff(&now, &st->begin);
+	st->stalled = false;
+}
+
+/* Return the total stall time up to now */
+static double
+stall_time(const struct stall *st, const struct timespec *now)
+{
+	return st->time + (st->stalled ? time_diff(now, &st->begin) : 0);
+}
+
 /* Linked list of files we write to */
 struct sink_info {
 	struct sink_info *next;	/* Next list element */
@@ -159,8 +368,45 @@ struct sink_info {
 	off_t pos_to_write;	/* Position up to which to write */
 	bool active;		/* True if this sink is still active */
 	struct source_info *ifp;/* Input file we read from */
+	pthread_t thread;	/* Writer thread (-P) */
 	bool chain_last;	/* True if last element in a group; Writing  (copy or scatter)
 				   should not continue to next element */
+	bool ready;		/* True if the fd may accept data without blocking */
+	bool wanted;		/* True if we want to write in the current state */
+	bool selected;		/* True if both ready and wanted */
+	bool vmsplice;		/* True if pool pages are mapped into the (pipe) fd */
+	bool pipe;		/* True if the fd is a pipe */
+	off_t rate_pos;		/* Data consumed at the start of the rate window; -1 before */
+	struct timespec rate_time;	/* Start time of the rate window */
+	off_t rate_window;	/* Data to consume for measuring the rate */
+	double rate;		/* Drain rate moving average (bytes/s); 0 if unknown */
+	int records;		/* Records of the gathered chunk located so far */
+	/*
+	 * Records partitioned to this sink (-k, -c).  In this mode the
+	 * pos_ values refer to the sink's own stream of records.
+	 */
+	char *stage;		/* Copies of the records */
+	size_t stage_size;	/* Allocated stage size */
+	size_t stage_len;	/* Bytes stored in the stage */
+	off_t stage_base;	/* Stream position of the stage's first byte */
+	enum sink_policy policy;	/* Handling of data when falling behind */
+	size_t cap;		/* Data the policy allows the sink to hold back */
+	/*
+	 * Data written before those at pos_written: the remainder of a
+	 * record whose successors were dropped, or spilled data.
+	 */
+	char *stash;
+	size_t stash_size;	/* Allocated stash size */
+	size_t stash_len;	/* Bytes stored in the stash */
+	size_t stash_written;	/* Stashed bytes written */
+	bool at_record;		/* True if the written data end with a complete record */
+	off_t dropped;		/* Bytes dropped */
+	int spill_fd;		/* Spill file descriptor; -1 if none */
+	off_t spill_base;	/* Stream position of the spill file's first byte */
+	off_t spill_end;	/* Position up to which the data are in the spill file */
+	off_t bytes_written;	/* Total bytes written */
+	struct stall stall;	/* Time blocked with data to write */
+	int heap_index;		/* Position in the sink heap; -1 if not there */
 };
 
 /* Construct a new sink_info object */
@@ -174,6 +420,27 @@ new_sink_info(const char *name)
 	ofp->name = name ? strdup(name) : NULL;
 	ofp->active = true;
 	ofp->pos_written = ofp->pos_to_write = 0;
+	ofp->ready = ofp->wanted = ofp->selected = false;
+	ofp->vmsplice = false;
+	ofp->pipe = false;
+	ofp->rate_pos = -1;
+	ofp->rate_window = RATE_WINDOW;
+	ofp->rate = 0;
+	ofp->records = 0;
+	ofp->stage = NULL;
+	ofp->stage_size = ofp->stage_len = 0;
+	ofp->stage_base = 0;
+	ofp->policy = sp_block;
+	ofp->cap = 0;
+	ofp->stash = NULL;
+	ofp->stash_size = ofp->stash_len = ofp->stash_written = 0;
+	ofp->at_record = true;
+	ofp->dropped = 0;
+	ofp->spill_fd = -1;
+	ofp->spill_base = ofp->spill_end = 0;
+	ofp->bytes_written = 0;
+	memset(&ofp->stall, 0, sizeof(ofp->stall));
+	ofp->heap_index = -1;
 	ofp->next = NULL;
 	return ofp;
 }
@@ -192,6 +459,15 @@ struct source_info {
 	bool is_read;			/* True if an active sink reads it */
 	bool chain_last;		/* True if reading should stop at this element rather
 					   than continue to the next element */
+	bool ready;			/* True if the fd may provide data without blocking */
+	bool wanted;			/* True if we want to read in the current state */
+	bool selected;			/* True if both ready and wanted */
+	off_t gather_pos;		/* Position up to which an ordered gather has output data */
+	bool full;			/* True if gathered or read ahead data wait
+					   for buffer memory */
+	bool prefetch;			/* True if read ahead of becoming active */
+	off_t bytes_read;		/* Total bytes read */
+	struct stall stall;		/* Time not read for lack of buffer memory */
 };
 
 /* Return the name of a source or sink */
@@ -219,6 +495,12 @@ new_source_info(const char *name)
 	ifp->bp = new_buffer_pool();
 	ifp->source_pos_read = 0;
 	ifp->reached_eof = false;
+	ifp->ready = ifp->wanted = ifp->selected = false;
+	ifp->gather_pos = 0;
+	ifp->full = false;
+	ifp->prefetch = false;
+	ifp->bytes_read = 0;
+	memset(&ifp->stall, 0, sizeof(ifp->stall));
 	ifp->next = NULL;
 	return ifp;
 }
@@ -259,66 +541,400 @@ enum state {
 	write_ob,		/* Write data, before reading */
 };
 
+/*
+ * Buffer memory that has been freed, kept for reuse in order
+ * to avoid allocation and page fault churn when streaming.
+ */
+#define FREE_BUFFERS_MAX 8
+static void *free_buffers[FREE_BUFFERS_MAX];
+static int free_buffers_n = 0;
+
+/* Return the number of bytes used for storing the pool's allocated buffers */
+static unsigned long
+memory_pool_used(struct buffer_pool *bp)
+{
+	return (bp->buffers_allocated - bp->buffers_freed) * buffer_size +
+		bp->compressed_bytes;
+}
+
 /*
  * Return the total number of bytes required for storing all buffers
- * up to the specified memory pool
+ * up to the specified memory pool.
+ * New buffers are first taken from the free ones,
+ * whose memory is also counted, as is that of a pool sharing the limit.
  */
 static unsigned long
 memory_pool_size(struct buffer_pool *bp, int pool)
 {
-	return ((bp->buffers_allocated - bp->buffers_freed) + (pool - bp->allocated_pool_end + 1)) * buffer_size;
+	return memory_pool_used(bp) +
+		MAX(pool - bp->allocated_pool_end + 1, free_buffers_n) * buffer_size +
+		(bp->peer ? memory_pool_used(bp->peer) : 0) +
+		(bp->read_ahead ? max_mem / 2 : 0);
+}
+
+/*
+ * Allocate huge page backed buffer memory.
+ * Explicit huge pages are used if available; otherwise the
+ * memory is aligned for transparent huge pages.
+ */
+static void *
+huge_page_alloc(void)
+{
+	size_t len = buffer_size + HUGE_PAGE_SIZE;
+	char *base, *p;
+
+#ifdef MAP_HUGETLB
+	if (buffer_size % HUGE_PAGE_SIZE == 0 &&
+	    (p = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+		return p;
+#endif
+	/* Map more memory and trim it to an aligned region. */
+	if ((base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return NULL;
+	p = (char *)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+	if (p > base)
+		(void)munmap(base, p - base);
+	if (p + buffer_size < base + len)
+		(void)munmap(p + buffer_size, base + len - (p + buffer_size));
+#ifdef MADV_HUGEPAGE
+	(void)madvise(p, buffer_size, MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
+/*
+ * Return memory for a pool buffer, reusing freed memory if possible.
+ * Return NULL if no memory is available.
+ */
+static void *
+buffer_get(struct buffer_pool *bp)
+{
+	if (free_buffers_n > 0) {
+		bp->buffers_reused++;
+		return free_buffers[--free_buffers_n];
+	}
+	if (opt_huge_pages)
+		return huge_page_alloc();
+	return malloc(buffer_size);
 }
 
-/* Write half of the allocated buffer pool to the temporary file */
+/* Release the memory of a pool buffer to the system */
 static void
-page_out(struct buffer_pool *bp)
+buffer_release_memory(void *p)
 {
-	if (bp->page_file_fd == -1) {
-		char *template;
+	if (!opt_huge_pages)
+		free(p);
+	else if (munmap(p, buffer_size) == -1)
+		err(1, "Unable to unmap buffer memory");
+}
 
-		/*
-		 * Create a temporary file that will be deleted on exit.
-		 * The location follows tempnam rules (argument, TMPDIR,
-		 * P_tmpdir, /tmp), while the creation through mkstemp
-		 * avoids race conditions.
-		 */
-		if ((template = tempnam(opt_tmp_dir, "sg-")) == NULL)
-			err(1, "Unable to obtain temporary file name");
-		if ((template = realloc(template, strlen(template) + 7)) == NULL)
-			err(1, "Error obtaining temporary file name space");
-		strcat(template, "XXXXXX");
-		if ((bp->page_file_fd = mkstemp(template)) == -1)
-			err(1, "Unable to create temporary file %s", template);
+/* Free the memory of a pool buffer, keeping it for reuse if possible. */
+static void
+buffer_put(void *p)
+{
+	if (free_buffers_n < FREE_BUFFERS_MAX)
+		free_buffers[free_buffers_n++] = p;
+	else
+		buffer_release_memory(p);
+}
+
+/*
+ * Release the free buffers that are not needed for allocating
+ * the pool's buffers up to the specified one,
+ * while the pool's memory exceeds the memory limit.
+ */
+static void
+buffer_trim(struct buffer_pool *bp, int pool)
+{
+	while (free_buffers_n > MAX(pool - bp->allocated_pool_end + 1, 0) &&
+	    memory_pool_size(bp, pool) > max_mem)
+		buffer_release_memory(free_buffers[--free_buffers_n]);
+}
+
+/* Space for compressing buffers and reading compressed ones from the temporary file */
+static char *compress_buffer;
+
+/*
+ * Replace the specified in-memory buffer with its compressed form.
+ * Return false if its data do not compress by at least 1/8.
+ */
+static bool
+buffer_compress(struct buffer_pool *bp, int pool)
+{
+	struct pool_buffer *b = &bp->buffers[pool];
+	size_t csize;
+	void *p;
+
+	if (compress_buffer == NULL && (compress_buffer = malloc(buffer_size)) == NULL)
+		return false;
+	if ((csize = lz_compress(b->p, buffer_size, compress_buffer, buffer_size - buffer_size / 8)) == 0)
+		return false;
+	if ((p = malloc(csize)) == NULL)
+		return false;
+	memcpy(p, compress_buffer, csize);
+	buffer_put(b->p);
+	b->p = p;
+	b->csize = csize;
+	b->s = s_compressed;
+	bp->buffers_freed++;
+	bp->buffers_compressed++;
+	bp->compressed_bytes += csize;
+	bp->compressed_in += buffer_size;
+	bp->compressed_out += csize;
+	DPRINTF(4, "Compressed buffer %d to %zu bytes", pool, csize);
+	return true;
+}
+
+/* Decompress the specified compressed data into the buffer's memory */
+static void
+buffer_decompress(struct pool_buffer *b, const void *data, size_t csize)
+{
+	if (lz_decompress(data, csize, b->p, buffer_size) != (size_t)buffer_size)
+		errx(1, "Corrupted compressed buffer");
+}
+
+/* Create and return the descriptor of a temporary file */
+static int
+tmp_file_open(void)
+{
+	char *template;
+	int fd;
+
+	/*
+	 * Create a temporary file that will be deleted on exit.
+	 * The location follows tempnam rules (argument, TMPDIR,
+	 * P_tmpdir, /tmp), while the creation through mkstemp
+	 * avoids race conditions.
+	 */
+	if ((template = tempnam(opt_tmp_dir, "sg-")) == NULL)
+		err(1, "Unable to obtain temporary file name");
+	if ((template = realloc(template, strlen(template) + 7)) == NULL)
+		err(1, "Error obtaining temporary file name space");
+	strcat(template, "XXXXXX");
+	if ((fd = mkstemp(template)) == -1)
+		err(1, "Unable to create temporary file %s", template);
+	/* The open descriptor keeps the file's data */
+	if (unlink(template) == -1)
+		warn("Unable to remove temporary file %s", template);
+	free(template);
+	return fd;
+}
+
+/* Create the temporary file backing the specified buffer pool */
+static void
+tmp_file_create(struct buffer_pool *bp)
+{
+	bp->page_file_fd = tmp_file_open();
+
+	if (opt_uring && (bp->uring = uring_open(URING_ENTRIES)) == NULL)
+		warnx("Asynchronous I/O is not available; using synchronous I/O");
+}
+
+/*
+ * Process completed asynchronous temporary file requests.
+ * When wait is set, block until at least one completes.
+ * A written buffer's memory is freed, and only then accounted as such,
+ * unless it has been paged in again while the write was in progress.
+ */
+static void
+async_reap(struct buffer_pool *bp, bool wait)
+{
+	unsigned long long pool;
+	struct pool_buffer *b;
+	int res;
+
+	while (uring_reap(bp->uring, wait, &pool, &res)) {
+		wait = false;
+		b = &bp->buffers[pool];
+		if (res < 0) {
+			errno = -res;
+			err(1, "Asynchronous I/O on temporary file failed");
+		}
+		if (res != buffer_size)
+			errx(1, "Short asynchronous I/O on temporary file");
+		b->busy = false;
+		if (b->s == s_file) {
+			buffer_put(b->p);
+			bp->buffers_freed++;
+			bp->buffers_writing--;
+		}
+		DPRINTF(4, "Completed asynchronous I/O of buffer %llu", pool);
+	}
+	if (wait)
+		errx(1, "Unable to obtain asynchronous I/O completion");
+}
+
+/* Wait for any asynchronous I/O on the specified pool buffer to complete */
+static void
+async_wait(struct buffer_pool *bp, int pool)
+{
+	while (bp->buffers[pool].busy)
+		async_reap(bp, true);
+}
+
+/*
+ * Queue the writing of a buffer to the temporary file.
+ * Its memory is freed when the write completes.
+ */
+static void
+async_page_out(struct buffer_pool *bp, int pool)
+{
+	struct pool_buffer *b = &bp->buffers[pool];
+
+	while (!uring_write(bp->uring, bp->page_file_fd, b->p, buffer_size,
+	    (off_t)pool * buffer_size, pool))
+		async_reap(bp, true);
+	b->busy = true;
+	bp->buffers_writing++;
+}
+
+/*
+ * Wait until the memory of the buffers being written out asynchronously
+ * brings the pool's memory including the specified pool member
+ * within the memory limit.
+ */
+static void
+async_page_out_wait(struct buffer_pool *bp, int pool)
+{
+	for (;;) {
+		buffer_trim(bp, pool);
+		if (bp->buffers_writing == 0 || memory_pool_size(bp, pool) <= max_mem)
+			return;
+		async_reap(bp, true);
 	}
+}
+
+/*
+ * Ask the kernel to reclaim the memory of a buffer mapped
+ * from the temporary file.  Dirty pages are written back
+ * to the file asynchronously.
+ */
+static void
+buffer_page_out_mapped(struct pool_buffer *b)
+{
+#ifdef MADV_PAGEOUT
+	if (madvise(b->p, buffer_size, MADV_PAGEOUT) == 0)
+		return;
+#endif
+	(void)madvise(b->p, buffer_size, MADV_DONTNEED);
+}
+
+/*
+ * Write half of the allocated buffer pool to the temporary file,
+ * or compress it, considering the buffers before the specified end.
+ */
+static void
+page_out(struct buffer_pool *bp, int end)
+{
+	int visited;
+
+	if (bp->page_file_fd == -1 && use_tmp_file)
+		tmp_file_create(bp);
 
 	/*
 	 * Page-out memory buffers from the pool, round-robin fashion,
 	 * starting from the oldest buffers.
 	 * This is good enough for the simple common case where one output fd is blocked.
+	 * Two rounds allow buffers to be compressed and then written out.
 	 */
-	while (memory_pool_size(bp, bp->allocated_pool_end - 1) > max_mem / 2) {
+	for (visited = 0; visited < 2 * end && memory_pool_used(bp) -
+	    (unsigned long)bp->buffers_writing * buffer_size > max_mem / 2; visited++) {
+		if (bp->page_out_ptr >= end)
+			bp->page_out_ptr = 0;
 		switch (bp->buffers[bp->page_out_ptr].s) {
 		case s_memory:
+			if (opt_compress && buffer_compress(bp, bp->page_out_ptr))
+				break;
+			if (!use_tmp_file)
+				break;
+			if (bp->uring) {
+				async_page_out(bp, bp->page_out_ptr);
+				bp->buffers[bp->page_out_ptr].s = s_file;
+				bp->buffers_paged_out++;
+				DPRINTF(4, "Queued page out of buffer %d", bp->page_out_ptr);
+				break;
+			}
+			if (opt_mmap_spill) {
+				buffer_page_out_mapped(&bp->buffers[bp->page_out_ptr]);
+				bp->buffers[bp->page_out_ptr].s = s_file;
+				bp->buffers_freed++;
+				bp->buffers_paged_out++;
+				DPRINTF(4, "Paged out mapped buffer %d", bp->page_out_ptr);
+				break;
+			}
 			if (pwrite(bp->page_file_fd, bp->buffers[bp->page_out_ptr].p, buffer_size, (off_t)bp->page_out_ptr * buffer_size) != buffer_size)
 				err(1, "Write to temporary file failed");
 			/* FALLTHROUGH */
 		case s_memory_backed:
+			async_wait(bp, bp->page_out_ptr);
 			DPRINTF(4, "Page out buffer %d %p", bp->page_out_ptr, bp->buffers[bp->page_out_ptr].p);
 			bp->buffers[bp->page_out_ptr].s = s_file;
-			free(bp->buffers[bp->page_out_ptr].p);
+			if (opt_mmap_spill)
+				buffer_page_out_mapped(&bp->buffers[bp->page_out_ptr]);
+			else
+				buffer_put(bp->buffers[bp->page_out_ptr].p);
 			bp->buffers_freed++;
 			bp->buffers_paged_out++;
 			DPRINTF(4, "Paged out buffer %d %p", bp->page_out_ptr, bp->buffers[bp->page_out_ptr].p);
 			break;
+		case s_compressed:
+			if (!use_tmp_file)
+				break;
+			if (pwrite(bp->page_file_fd, bp->buffers[bp->page_out_ptr].p, bp->buffers[bp->page_out_ptr].csize, (off_t)bp->page_out_ptr * buffer_size) != (ssize_t)bp->buffers[bp->page_out_ptr].csize)
+				err(1, "Write to temporary file failed");
+			free(bp->buffers[bp->page_out_ptr].p);
+			bp->compressed_bytes -= bp->buffers[bp->page_out_ptr].csize;
+			bp->buffers[bp->page_out_ptr].s = s_file;
+			bp->buffers_paged_out++;
+			DPRINTF(4, "Paged out compressed buffer %d", bp->page_out_ptr);
+			break;
 		case s_file:
 		case s_none:
 			break;
 		default:
 			assert(false);
 		}
-		if (++bp->page_out_ptr == bp->allocated_pool_end)
-			bp->page_out_ptr = 0;
+		bp->page_out_ptr++;
+	}
+}
+
+/*
+ * Map the temporary file's region for the specified pool member
+ * into memory, growing the (sparse) file as needed.
+ * Return NULL if the mapping fails.
+ */
+static void *
+map_pool_buffer(struct buffer_pool *bp, int pool)
+{
+	off_t offset = (off_t)pool * buffer_size;
+	void *p;
+
+	if (bp->page_file_fd == -1)
+		tmp_file_create(bp);
+	if (offset + buffer_size > bp->page_file_size) {
+		off_t size = MAX(bp->page_file_size * 2, offset + buffer_size);
+
+		if (ftruncate(bp->page_file_fd, size) == -1)
+			err(1, "Unable to extend temporary file");
+		bp->page_file_size = size;
 	}
+	if ((p = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    bp->page_file_fd, offset)) == MAP_FAILED)
+		return NULL;
+	(void)madvise(p, buffer_size, MADV_SEQUENTIAL);
+	return p;
+}
+
+/* Release the memory of the specified pool member */
+static void
+buffer_release(struct buffer_pool *bp, int pool)
+{
+	if (!opt_mmap_spill)
+		buffer_put(bp->buffers[pool].p);
+	else if (munmap(bp->buffers[pool].p, buffer_size) == -1)
+		err(1, "Unable to unmap buffer %d", pool);
 }
 
 /*
@@ -330,12 +946,17 @@ allocate_pool_buffer(struct buffer_pool *bp, int pool)
 {
 	struct pool_buffer *b = &bp->buffers[pool];
 
-	if ((b->p = malloc(buffer_size)) == NULL) {
+	if (opt_mmap_spill)
+		b->p = map_pool_buffer(bp, pool);
+	else
+		b->p = buffer_get(bp);
+	if (b->p == NULL) {
 		DPRINTF(4, "Unable to allocate %d bytes for buffer %ld", buffer_size, b - bp->buffers);
 		bp->max_buffers_allocated = MAX(bp->buffers_allocated - bp->buffers_freed, bp->max_buffers_allocated);
 		return false;
 	}
 	b->s = s_memory;
+	b->busy = false;
 	DPRINTF(4, "Allocated buffer %ld to %p", b - bp->buffers, b->p);
 	bp->buffers_allocated++;
 	bp->max_buffers_allocated = MAX(bp->buffers_allocated - bp->buffers_freed, bp->max_buffers_allocated);
@@ -350,18 +971,64 @@ static void
 page_in(struct buffer_pool *bp, int pool)
 {
 	struct pool_buffer *b = &bp->buffers[pool];
+	void *data;
 
 	switch (b->s) {
 	case s_memory_backed:
+		/* The buffer may be getting read ahead */
+		if (b->busy)
+			async_wait(bp, pool);
+		break;
 	case s_memory:
 		break;
+	case s_compressed:
+		buffer_trim(bp, bp->allocated_pool_end);
+		if (memory_pool_size(bp, bp->allocated_pool_end - 1) > max_mem)
+			page_out(bp, bp->allocated_pool_end - 1);
+		/* Allocation replaces the compressed data pointer. */
+		data = b->p;
+		if (!allocate_pool_buffer(bp, pool))
+			err(1, "Out of memory decompressing buffer");
+		buffer_decompress(b, data, b->csize);
+		free(data);
+		bp->compressed_bytes -= b->csize;
+		b->csize = 0;
+		bp->buffers_decompressed++;
+		DPRINTF(4, "Decompressed buffer %d", pool);
+		break;
 	case s_file:
+		if (b->busy) {
+			/* Still being written out; keep its memory. */
+			bp->buffers_writing--;
+			bp->buffers_paged_in++;
+			b->s = s_memory_backed;
+			DPRINTF(4, "Reclaim buffer %d being paged out", pool);
+			break;
+		}
 		/* Good time to ensure that there will be page-in memory available */
-		if (memory_pool_size(bp, bp->allocated_pool_end - 1) > max_mem)
-			page_out(bp);
+		buffer_trim(bp, bp->allocated_pool_end);
+		if (memory_pool_size(bp, bp->allocated_pool_end - 1) > max_mem) {
+			page_out(bp, bp->allocated_pool_end - 1);
+			async_page_out_wait(bp, bp->allocated_pool_end - 1);
+		}
+		if (opt_mmap_spill) {
+			/* The mapping remains; the kernel reads the data back. */
+			(void)madvise(b->p, buffer_size, MADV_WILLNEED);
+			bp->buffers_allocated++;
+			bp->buffers_paged_in++;
+			b->s = s_memory_backed;
+			DPRINTF(4, "Page in mapped buffer %d", pool);
+			break;
+		}
 		if (!allocate_pool_buffer(bp, pool))
 			err(1, "Out of memory paging-in buffer");
-		if (pread(bp->page_file_fd, b->p, buffer_size, (off_t)pool * buffer_size) != buffer_size)
+		if (b->csize) {
+			/* The file holds the buffer's compressed data. */
+			if (pread(bp->page_file_fd, compress_buffer, b->csize, (off_t)pool * buffer_size) != (ssize_t)b->csize)
+				err(1, "Read from temporary file failed");
+			buffer_decompress(b, compress_buffer, b->csize);
+			bp->buffers_decompressed++;
+		} else if (pread(bp->page_file_fd, b->p, buffer_size, (off_t)pool * buffer_size) != buffer_size)
 			err(1, "Read from temporary file failed");
 		bp->buffers_paged_in++;
 		b->s = s_memory_backed;
@@ -394,10 +1061,12 @@ memory_allocate(struct buffer_pool *bp, int pool)
 
 	DPRINTF(4, "Buffers allocated: %d Freed: %d", bp->buffers_allocated, bp->buffers_freed);
 	/* Check soft memory limit through allocated plus requested memory. */
+	buffer_trim(bp, pool);
 	if (memory_pool_size(bp, pool) > max_mem) {
-		if (use_tmp_file)
-			page_out(bp);
-		else
+		if (use_tmp_file || opt_compress)
+			page_out(bp, bp->allocated_pool_end);
+		async_page_out_wait(bp, pool);
+		if (!use_tmp_file && memory_pool_size(bp, pool) > max_mem)
 			return false;
 	}
 
@@ -419,11 +1088,13 @@ memory_allocate(struct buffer_pool *bp, int pool)
 	}
 
 	/* Allocate buffer memory [allocated_pool_end, pool]. */
-	for (i = bp->allocated_pool_end; i <= pool; i++)
+	for (i = bp->allocated_pool_end; i <= pool; i++) {
 		if (!allocate_pool_buffer(bp, i)) {
 			bp->allocated_pool_end = i;
 			return false;
 		}
+		bp->buffers[i].csize = 0;
+	}
 	bp->allocated_pool_end = pool + 1;
 	return true;
 }
@@ -439,7 +1110,8 @@ buffer_file_free(struct buffer_pool *bp, int pool)
 #ifdef FALLOC_FL_PUNCH_HOLE
 	static bool warned = false;
 
-	if (fallocate(tmp_fd, FALLOC_FL_PUNCH_HOLE, pool * buffer_size, buffer_size) < 0 &&
+	if (fallocate(bp->page_file_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    (off_t)pool * buffer_size, buffer_size) < 0 &&
 	    !warned) {
 		warn("Failed to free temporary buffer space");
 		warned = true;
@@ -448,57 +1120,257 @@ buffer_file_free(struct buffer_pool *bp, int pool)
 	bp->pages_freed++;
 }
 
+#ifdef __linux__
 /*
- * Ensure that pool buffers from [0,pos) are free.
+ * Create the pool's ring buffer, sized to hold an equal share of the
+ * buffer memory not taken by other sources' rings,
+ * plus a page, because memory is only freed in page units.
+ * The memory of a memfd is mapped twice into adjacent address ranges,
+ * reserved through an initial inaccessible mapping.
  */
 static void
-memory_free(struct buffer_pool *bp, off_t pos)
+ring_create(struct buffer_pool *bp)
 {
-	int pool_end = pos / buffer_size;
-	int i;
-
-	DPRINTF(4, "memory_free: pool=%p pos = %ld, begin=%d end=%d",
-		bp, (long)pos, bp->free_pool_begin, pool_end);
-	for (i = bp->free_pool_begin; i < pool_end; i++) {
-		switch (bp->buffers[i].s) {
-		case s_memory:
-			free(bp->buffers[i].p);
-			bp->buffers_freed++;
-			break;
-		case s_file:
-			buffer_file_free(bp, i);
-			break;
-		case s_memory_backed:
-			buffer_file_free(bp, i);
-			free(bp->buffers[i].p);
-			bp->buffers_freed++;
-			break;
-		case s_none:
-			break;
-		default:
-			assert(false);
-			break;
-		}
-		bp->buffers[i].s = s_none;
-		DPRINTF(4, "Freed buffer %d %p (pos = %ld, begin=%d end=%d)",
-			i, bp->buffers[i].p, (long)pos, bp->free_pool_begin, pool_end);
-		#ifdef DEBUG
-		bp->buffers[i].p = NULL;
-		#endif
-	}
-	bp->free_pool_begin = pool_end;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	unsigned long share = max_mem > ring_memory ?
+		(max_mem - ring_memory) / MAX(rings_pending, 1) : 0;
+	size_t size = MAX(share / buffer_size, 1) * buffer_size;
+	char *base;
+
+	ring_memory += size;
+	if (rings_pending > 0)
+		rings_pending--;
+
+	size = (size + page_size - 1) / page_size * page_size + page_size;
+	if ((bp->ring_fd = memfd_create("dgsh-tee", MFD_CLOEXEC)) == -1)
+		err(1, "Unable to create ring buffer memory");
+	if (ftruncate(bp->ring_fd, size) == -1)
+		err(1, "Unable to size ring buffer memory");
+	if ((base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		err(1, "Unable to reserve ring buffer address space");
+	if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, bp->ring_fd, 0) == MAP_FAILED ||
+	    mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, bp->ring_fd, 0) == MAP_FAILED)
+		err(1, "Unable to map ring buffer memory");
+	bp->ring = base;
+	bp->ring_size = size;
+	DPRINTF(3, "Created ring buffer of %zu bytes at %p", size, base);
 }
 
 /*
- * Set the buffer to write to for reading from a file from
- * position onward, ensuring that sufficient memory is allocated.
- * Return false if no memory is available.
+ * Release the memory of the ring's pages in the page-aligned
+ * region [start, end).
  */
-static bool
-source_buffer(struct source_info *ifp, /* OUT */ struct io_buffer *b)
+static void
+ring_release(struct buffer_pool *bp, off_t start, off_t end)
 {
-	int pool = ifp->source_pos_read / buffer_size;
-	size_t pool_offset = ifp->source_pos_read % buffer_size;
+	static bool warned = false;
+	off_t offset;
+	size_t len;
+
+	while (start < end) {
+		offset = start % bp->ring_size;
+		len = MIN(end - start, bp->ring_size - offset);
+		if (fallocate(bp->ring_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		    offset, len) < 0 && !warned) {
+			warn("Failed to free ring buffer memory");
+			warned = true;
+		}
+		start += len;
+	}
+}
+#else
+static void
+ring_create(struct buffer_pool *bp)
+{
+	errx(1, "Ring buffers are not supported on this system");
+}
+
+static void
+ring_release(struct buffer_pool *bp, off_t start, off_t end)
+{
+}
+#endif
+
+/*
+ * Map the file of a mapped source pool up to its current size.
+ * Return false if the file has not grown since it was last mapped.
+ */
+static bool
+map_file(struct buffer_pool *bp)
+{
+	struct stat sb;
+	void *p;
+
+	if (fstat(bp->map_fd, &sb) == -1)
+		err(2, "fstat");
+	if (sb.st_size <= bp->map_size)
+		return false;
+	if ((p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, bp->map_fd, 0)) == MAP_FAILED)
+		return false;
+	(void)madvise(p, sb.st_size, MADV_SEQUENTIAL);
+	if (bp->map && munmap(bp->map, bp->map_size) == -1)
+		err(1, "Unable to unmap input file");
+	bp->map = p;
+	bp->map_size = sb.st_size;
+	DPRINTF(3, "Mapped %ld bytes of input file", (long)sb.st_size);
+	return true;
+}
+
+/* The sources, for identifying accesses to their mapped files */
+static struct source_info *map_sources;
+
+/*
+ * Terminate with a diagnostic, rather than a bus error, when
+ * mapped data beyond the end of a file that was truncated
+ * after mapping it are accessed.
+ */
+static void
+map_sigbus(int sig, siginfo_t *si, void *context)
+{
+	static const char msg[] = "dgsh-tee: Input file truncated while being read\n";
+	struct source_info *ifp;
+	struct buffer_pool *bp;
+
+	for (ifp = map_sources; ifp; ifp = ifp->next) {
+		bp = ifp->bp;
+		if (bp->map_fd != -1 && (char *)si->si_addr >= bp->map &&
+		    (char *)si->si_addr < bp->map + bp->map_size) {
+			(void)write(STDERR_FILENO, msg, sizeof(msg) - 1);
+			_exit(2);
+		}
+	}
+	/* Not ours: fail as usual when the access is retried. */
+	signal(SIGBUS, SIG_DFL);
+}
+
+/*
+ * Serve the data of the specified source from a mapping of its file,
+ * if it is a non-empty regular file that can be mapped.
+ * Files that can't, such as those of /proc, are read as usual.
+ */
+static void
+map_setup(struct source_info *ifp)
+{
+	struct buffer_pool *bp = ifp->bp;
+	struct stat sb;
+	off_t start;
+
+	if (fstat(ifp->fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    (start = lseek(ifp->fd, 0, SEEK_CUR)) == -1 || sb.st_size <= start)
+		return;
+	bp->map_fd = ifp->fd;
+	bp->map_start = start;
+	if (!map_file(bp))
+		bp->map_fd = -1;
+}
+
+/*
+ * Ensure that pool buffers from [0,pos) are free.
+ */
+static void
+memory_free(struct buffer_pool *bp, off_t pos)
+{
+	int pool_end = pos / buffer_size;
+	int i;
+
+	if (bp->map_fd != -1) {
+		off_t tail = bp->map_start + pos;
+
+		/* The file keeps the data; drop only our page references. */
+		tail -= tail % sysconf(_SC_PAGESIZE);
+		if (tail > bp->map_tail) {
+			(void)madvise(bp->map + bp->map_tail, tail - bp->map_tail, MADV_DONTNEED);
+			bp->map_tail = tail;
+		}
+		return;
+	}
+
+	if (bp->ring) {
+		off_t tail = pos - pos % sysconf(_SC_PAGESIZE);
+
+		if (tail > bp->ring_tail) {
+			ring_release(bp, bp->ring_tail, tail);
+			bp->ring_tail = tail;
+		}
+		/* Account for the notional buffers that were freed. */
+		pool_end = MIN(pool_end, bp->allocated_pool_end);
+		if (pool_end > bp->free_pool_begin) {
+			bp->buffers_freed += pool_end - bp->free_pool_begin;
+			bp->free_pool_begin = pool_end;
+		}
+		return;
+	}
+
+	DPRINTF(4, "memory_free: pool=%p pos = %ld, begin=%d end=%d",
+		bp, (long)pos, bp->free_pool_begin, pool_end);
+	for (i = bp->free_pool_begin; i < pool_end; i++) {
+		async_wait(bp, i);
+		switch (bp->buffers[i].s) {
+		case s_memory:
+			if (opt_mmap_spill)
+				buffer_file_free(bp, i);
+			buffer_release(bp, i);
+			bp->buffers_freed++;
+			break;
+		case s_file:
+			buffer_file_free(bp, i);
+			if (opt_mmap_spill)
+				buffer_release(bp, i);
+			break;
+		case s_memory_backed:
+			buffer_file_free(bp, i);
+			buffer_release(bp, i);
+			bp->buffers_freed++;
+			break;
+		case s_compressed:
+			free(bp->buffers[i].p);
+			bp->compressed_bytes -= bp->buffers[i].csize;
+			break;
+		case s_none:
+			break;
+		default:
+			assert(false);
+			break;
+		}
+		bp->buffers[i].s = s_none;
+		DPRINTF(4, "Freed buffer %d %p (pos = %ld, begin=%d end=%d)",
+			i, bp->buffers[i].p, (long)pos, bp->free_pool_begin, pool_end);
+		#ifdef DEBUG
+		bp->buffers[i].p = NULL;
+		#endif
+	}
+	bp->free_pool_begin = pool_end;
+}
+
+/*
+ * Set the buffer to write to for reading from a file from
+ * position onward, ensuring that sufficient memory is allocated.
+ * Return false if no memory is available.
+ */
+static bool
+source_buffer(struct source_info *ifp, /* OUT */ struct io_buffer *b)
+{
+	int pool = ifp->source_pos_read / buffer_size;
+	size_t pool_offset = ifp->source_pos_read % buffer_size;
+	struct buffer_pool *bp = ifp->bp;
+
+	if (opt_ring) {
+		size_t space;
+
+		if (bp->ring == NULL)
+			ring_create(bp);
+		/* Data in use starts from the ring's tail. */
+		if ((space = bp->ring_size - (ifp->source_pos_read - bp->ring_tail)) == 0)
+			return false;
+		if (pool >= bp->allocated_pool_end) {
+			bp->allocated_pool_end = pool + 1;
+			bp->buffers_allocated++;
+			bp->max_buffers_allocated = MAX(bp->buffers_allocated - bp->buffers_freed, bp->max_buffers_allocated);
+		}
+		b->p = bp->ring + ifp->source_pos_read % bp->ring_size;
+		b->size = MIN(buffer_size - pool_offset, space);
+		return true;
+	}
 
 	if (!memory_allocate(ifp->bp, pool))
 		return false;
@@ -511,28 +1383,40 @@ source_buffer(struct source_info *ifp, /* OUT */ struct io_buffer *b)
 }
 
 /*
- * Return a buffer to read from for writing to a file from a position onward
- * When processing lines, b.size can be 0
+ * Queue the reading of paged-out buffers that follow the
+ * specified position, which is that of the slowest sink,
+ * as long as memory is available.
  */
-static struct io_buffer
-sink_buffer(struct sink_info *ofp)
+static void
+prefetch(struct buffer_pool *bp, off_t pos)
 {
-	struct io_buffer b;
-	int pool = ofp->pos_written / buffer_size;
-	size_t pool_offset = ofp->pos_written % buffer_size;
-	size_t source_bytes = ofp->pos_to_write - ofp->pos_written;
+	int pool, end;
+	struct pool_buffer *b;
 
-	b.size = MIN(buffer_size - pool_offset, source_bytes);
-	if (b.size == 0)
-		b.p = NULL;
-	else {
-		if (ofp->ifp->bp->page_file_fd != -1)
-			page_in(ofp->ifp->bp, pool);
-		b.p = ofp->ifp->bp->buffers[pool].p + pool_offset;
+	if (bp->uring == NULL)
+		return;
+	async_reap(bp, false);
+	end = MIN(pos / buffer_size + PREFETCH_BUFFERS, bp->allocated_pool_end);
+	for (pool = pos / buffer_size; pool < end; pool++) {
+		b = &bp->buffers[pool];
+		if (b->s != s_file || b->busy)
+			continue;
+		if (memory_pool_size(bp, bp->allocated_pool_end) > max_mem)
+			break;
+		if (!allocate_pool_buffer(bp, pool))
+			break;
+		if (!uring_read(bp->uring, bp->page_file_fd, b->p, buffer_size,
+		    (off_t)pool * buffer_size, pool)) {
+			buffer_put(b->p);
+			b->s = s_file;
+			bp->buffers_freed++;
+			break;
+		}
+		b->s = s_memory_backed;
+		b->busy = true;
+		bp->buffers_paged_in++;
+		DPRINTF(4, "Queued page in of buffer %d", pool);
 	}
-	DPRINTF(4, "Sink buffer(%ld-%ld) returns pool %d(%p) o=%ld l=%ld a=%p for input fd: %s",
-		(long)ofp->pos_written, (long)ofp->pos_to_write, pool, b.size ? ofp->ifp->bp->buffers[pool].p : NULL, (long)pool_offset, (long)b.size, b.p, fp_name(ofp->ifp));
-	return b;
 }
 
 /*
@@ -544,7 +1428,11 @@ sink_pointer(struct buffer_pool *bp, off_t pos_written)
 	int pool = pos_written / buffer_size;
 	size_t pool_offset = pos_written % buffer_size;
 
-	if (bp->page_file_fd != -1)
+	if (bp->ring)
+		return bp->ring + pos_written % bp->ring_size;
+	if (bp->map_fd != -1)
+		return bp->map + bp->map_start + pos_written;
+	if (bp->page_file_fd != -1 || opt_compress)
 		page_in(bp, pool);
 	return bp->buffers[pool].p + pool_offset;
 }
@@ -558,11 +1446,246 @@ sink_buffer_length(off_t start, off_t end)
 	size_t pool_offset = start % buffer_size;
 	size_t source_bytes = end - start;
 
+	/* Ring buffer data is always contiguous */
+	if (opt_ring)
+		return source_bytes;
+
 	DPRINTF(4, "sink_buffer_length(%ld, %ld) = %ld",
 		(long)start, (long)end,  (long)MIN(buffer_size - pool_offset, source_bytes));
 	return MIN(buffer_size - pool_offset, source_bytes);
 }
 
+/*
+ * Return the position of the first record terminator in the pool
+ * region [start, end), or -1 if there is none.
+ */
+static off_t
+pool_find_rt(struct buffer_pool *bp, off_t start, off_t end)
+{
+	const char *p, *found;
+	size_t len;
+	off_t pos;
+
+	for (pos = start; pos < end; pos += len) {
+		len = sink_buffer_length(pos, end);
+		p = sink_pointer(bp, pos);
+		if ((found = memscan_forward(p, rt, len)) != NULL)
+			return pos + (found - p);
+	}
+	return -1;
+}
+
+/*
+ * Return the position of the last record terminator in the pool
+ * region [start, end), or -1 if there is none.
+ */
+static off_t
+pool_rfind_rt(struct buffer_pool *bp, off_t start, off_t end)
+{
+	const char *p, *found;
+	off_t pos, region_start;
+
+	for (pos = end; pos > start; pos = region_start) {
+		/* Scan from the beginning of the pool buffer containing pos - 1 */
+		if (opt_ring)
+			region_start = start;
+		else
+			region_start = MAX(start, pos - 1 - (pos - 1) % buffer_size);
+		p = sink_pointer(bp, region_start);
+		if ((found = memscan_backward(p, rt, pos - region_start)) != NULL)
+			return region_start + (found - p);
+	}
+	return -1;
+}
+
+/* Maximum number of pool buffers to write out with a single system call */
+#define SINK_IOV_MAX 64
+
+/*
+ * Set iov to the consecutive pool buffers to read from for writing
+ * to a file from a position onward, and iovcnt to their number.
+ * Return the total number of bytes to write.
+ * When processing lines, this can be 0
+ */
+static size_t
+sink_iovec(struct sink_info *ofp, struct iovec *iov, int *iovcnt)
+{
+	struct buffer_pool *bp = ofp->ifp->bp;
+	/* Paging in a buffer can free the previous ones, unless they are mapped. */
+	int max_iov = (bp->page_file_fd == -1 && !opt_compress) || opt_mmap_spill ? SINK_IOV_MAX : 1;
+	size_t len, total = 0;
+	off_t pos;
+	int n;
+
+	if (opt_partition) {
+		iov[0].iov_base = ofp->stage + (ofp->pos_written - ofp->stage_base);
+		iov[0].iov_len = ofp->pos_to_write - ofp->pos_written;
+		*iovcnt = iov[0].iov_len ? 1 : 0;
+		return iov[0].iov_len;
+	}
+
+	n = 0;
+	if (ofp->stash_len) {
+		iov[0].iov_base = ofp->stash + ofp->stash_written;
+		iov[0].iov_len = total = ofp->stash_len - ofp->stash_written;
+		n++;
+	}
+	/* Spilled data are written through the stash. */
+	if (ofp->pos_written < ofp->spill_end) {
+		*iovcnt = n;
+		return total;
+	}
+
+	for (pos = ofp->pos_written; pos < ofp->pos_to_write && n < max_iov; pos += len, n++) {
+		len = sink_buffer_length(pos, ofp->pos_to_write);
+		iov[n].iov_base = sink_pointer(bp, pos);
+		iov[n].iov_len = len;
+		total += len;
+	}
+	*iovcnt = n;
+	DPRINTF(4, "Sink iovec(%ld-%ld) returns %d buffers l=%ld for input fd: %s",
+		(long)ofp->pos_written, (long)ofp->pos_to_write, n, (long)total, fp_name(ofp->ifp));
+	return total;
+}
+
+
+/*
+ * The sources and sinks selected for I/O by the last wait,
+ * so that I/O need not visit the others.
+ */
+static struct source_info **selected_sources;
+static struct sink_info **selected_sinks;
+static int selected_sources_n, selected_sinks_n;
+
+/*
+ * A min-heap of the active sinks, keyed on the position up to which
+ * they no longer need the source's data.  When data from a single
+ * source are copied, its top gives the position up to which buffers
+ * can be freed, without visiting every sink.  Each sink's index in
+ * the heap allows its key to be updated in O(log n) time.
+ * Data are then only assigned to the sinks selected for writing
+ * and to those with a policy for lagging behind,
+ * and sinks are retired as they complete their writes,
+ * so that an I/O operation never visits all sinks.
+ * The heap is not used when scattering, when gathering, or when
+ * mapping pages into pipes, where the sinks' data needs are not
+ * expressed by their positions.
+ */
+static struct sink_info **sink_heap = NULL;
+static int sink_heap_n = 0;
+static bool use_sink_heap = false;
+
+/* The sinks with a policy for lagging behind, when using the heap */
+static struct sink_info **policy_sinks = NULL;
+static int policy_sinks_n = 0;
+
+/* Return the position up to which the sink is to write */
+static off_t
+sink_data_end(struct sink_info *ofp)
+{
+	/* Sinks copied to with the heap are assigned their data when written. */
+	return use_sink_heap ? ofp->ifp->source_pos_read : ofp->pos_to_write;
+}
+
+/* Return the position up to which a sink no longer needs data */
+static off_t
+sink_heap_key(struct sink_info *ofp)
+{
+	return MAX(ofp->pos_written, ofp->spill_end);
+}
+
+/* Place the sink at heap position i */
+static void
+sink_heap_set(int i, struct sink_info *ofp)
+{
+	sink_heap[i] = ofp;
+	ofp->heap_index = i;
+}
+
+/* Move the sink at heap position i up to restore the heap order */
+static void
+sink_heap_sift_up(int i)
+{
+	struct sink_info *ofp = sink_heap[i];
+	off_t key = sink_heap_key(ofp);
+
+	while (i > 0 && sink_heap_key(sink_heap[(i - 1) / 2]) > key) {
+		sink_heap_set(i, sink_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	sink_heap_set(i, ofp);
+}
+
+/* Move the sink at heap position i down to restore the heap order */
+static void
+sink_heap_sift_down(int i)
+{
+	struct sink_info *ofp = sink_heap[i];
+	off_t key = sink_heap_key(ofp);
+	int child;
+
+	while ((child = 2 * i + 1) < sink_heap_n) {
+		if (child + 1 < sink_heap_n &&
+		    sink_heap_key(sink_heap[child + 1]) < sink_heap_key(sink_heap[child]))
+			child++;
+		if (sink_heap_key(sink_heap[child]) >= key)
+			break;
+		sink_heap_set(i, sink_heap[child]);
+		i = child;
+	}
+	sink_heap_set(i, ofp);
+}
+
+/* Restore the heap order after the key of the specified sink changed */
+static void
+sink_heap_update(struct sink_info *ofp)
+{
+	if (ofp->heap_index == -1)
+		return;
+	sink_heap_sift_up(ofp->heap_index);
+	sink_heap_sift_down(ofp->heap_index);
+}
+
+/* Remove the specified sink from the heap */
+static void
+sink_heap_remove(struct sink_info *ofp)
+{
+	int i = ofp->heap_index;
+
+	if (i == -1)
+		return;
+	ofp->heap_index = -1;
+	if (i == --sink_heap_n)
+		return;
+	sink_heap_set(i, sink_heap[sink_heap_n]);
+	sink_heap_update(sink_heap[i]);
+}
+
+/* (Re)build the heap from the active sinks */
+static void
+sink_heap_build(struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+	int i, n = 0;
+
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		n++;
+	if (sink_heap == NULL &&
+	    ((sink_heap = malloc(n * sizeof(struct sink_info *))) == NULL ||
+	    (policy_sinks = malloc(n * sizeof(struct sink_info *))) == NULL))
+		err(1, NULL);
+	sink_heap_n = policy_sinks_n = 0;
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		if (ofp->active)
+			sink_heap_set(sink_heap_n++, ofp);
+		else
+			ofp->heap_index = -1;
+		if (ofp->policy != sp_block)
+			policy_sinks[policy_sinks_n++] = ofp;
+	}
+	for (i = sink_heap_n / 2 - 1; i >= 0; i--)
+		sink_heap_sift_down(i);
+}
 
 /* The result of the following read operation. */
 enum read_result {
@@ -572,6 +1695,37 @@ enum read_result {
 	read_eof,	/* EOF (0 bytes read) */
 };
 
+/*
+ * Make the next part of a mapped source's file available to the sinks,
+ * mapping any data appended to the file since it was last mapped.
+ */
+static enum read_result
+source_map_read(struct source_info *ifp)
+{
+	struct buffer_pool *bp = ifp->bp;
+	off_t pos = bp->map_start + ifp->source_pos_read;
+	off_t end;
+	struct stat sb;
+	size_t n;
+
+	if (fstat(bp->map_fd, &sb) == -1)
+		err(2, "fstat");
+	if (pos >= bp->map_size && sb.st_size > bp->map_size)
+		(void)map_file(bp);
+	/* A file truncated since it was mapped ends at its new size, as when reading it. */
+	end = MIN(sb.st_size, bp->map_size);
+	if (pos >= end) {
+		/* Leave the file offset as reading would. */
+		(void)lseek(bp->map_fd, pos, SEEK_SET);
+		return read_eof;
+	}
+	n = MIN(end - pos, buffer_size - ifp->source_pos_read % buffer_size);
+	ifp->source_pos_read += n;
+	ifp->bytes_read += n;
+	DPRINTF(4, "Mapped %zu bytes from %s", n, fp_name(ifp));
+	return read_ok;
+}
+
 /*
  * Read from the source into the memory buffer
  * Return the number of bytes read, or -1 on end of file.
@@ -582,8 +1736,11 @@ source_read(struct source_info *ifp)
 	int n;
 	struct io_buffer b;
 
+	if (ifp->bp->map_fd != -1)
+		return source_map_read(ifp);
 	if (!source_buffer(ifp, &b)) {
 		DPRINTF(4, "Memory full");
+		stall_begin(&ifp->stall);
 		/* Provide some time for the output to drain. */
 		return read_oom;
 	}
@@ -591,11 +1748,15 @@ source_read(struct source_info *ifp)
 		switch (errno) {
 		case EAGAIN:
 			DPRINTF(4, "EAGAIN on %s", fp_name(ifp));
+			/* Wait for the next readiness notification. */
+			ifp->ready = false;
 			return read_again;
 		default:
 			err(3, "Read from %s", fp_name(ifp));
 		}
+	stall_end(&ifp->stall);
 	ifp->source_pos_read += n;
+	ifp->bytes_read += n;
 	DPRINTF(4, "Read %d out of %zu bytes from %s data=[%.*s]", n, b.size, fp_name(ifp),
 		(int)n * DATA_DUMP, (char *)b.p);
 	/* Return -1 on EOF */
@@ -603,70 +1764,881 @@ source_read(struct source_info *ifp)
 }
 
 /*
- * Allocate available read data to empty sinks that can be written to,
- * by adjusting their ifp, pos_written, and pos_to_write pointers.
+ * Start reading ahead the chained source following the specified
+ * active one, so that the sinks need not wait for its data when
+ * they reach it.
+ * The kernel reads ahead regular files, up to the memory limit;
+ * other files, such as pipes, are read into the source's own buffers,
+ * whose memory is charged against the limit of the active source.
  */
 static void
-allocate_data_to_sinks(fd_set *sink_fds, struct sink_info *files)
+source_prefetch(struct source_info *active)
 {
-	struct sink_info *ofp;
-	int available_sinks = 0;
-	off_t pos_assigned = 0;
-	size_t available_data, data_per_sink;
-	size_t data_to_assign = 0;
-	bool use_reliable = false;
-
-	/* Easy case: distribute to all files. */
-	if (!opt_scatter) {
-		for (ofp = files; ofp; ofp = ofp->next) {
-			/* Advance to next input file, if required */
-			if (ofp->pos_written == ofp->ifp->source_pos_read &&
-			    ofp->ifp->reached_eof &&
-			    !ofp->ifp->chain_last) {
-				DPRINTF(4, "%s(): advance to input file %s\n",
-						__func__, fp_name(ofp->ifp));
-				ofp->ifp = ofp->ifp->next;
-				ofp->ifp->active = true;
-				ofp->pos_written = 0;
-			}
-			ofp->pos_to_write = ofp->ifp->source_pos_read;
-		}
+	struct source_info *ifp = active->next;
+	struct stat sb;
+	off_t pos;
+
+	if (fstat(ifp->fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		if ((pos = lseek(ifp->fd, 0, SEEK_CUR)) == -1)
+			pos = 0;
+		(void)posix_fadvise(ifp->fd, pos, max_mem, POSIX_FADV_WILLNEED);
+		DPRINTF(3, "Read ahead %s from %ld", fp_name(ifp), (long)pos);
 		return;
 	}
+	ifp->prefetch = true;
+	/* Rings are already sized to a share of the limit. */
+	if (opt_ring)
+		return;
+	ifp->bp->read_ahead = true;
+	ifp->bp->peer = active->bp;
+	active->bp->peer = ifp->bp;
+}
 
-	/*
-	 * Difficult case: fair scattering across available sinks
-	 * Thankfully here we only have a single input file
-	 */
-
-	/* Determine amount of fresh data to write and number of available sinks. */
-	for (ofp = files; ofp; ofp = ofp->next) {
-		pos_assigned = MAX(pos_assigned, ofp->pos_to_write);
-		if (ofp->pos_written == ofp->pos_to_write && FD_ISSET(ofp->fd, sink_fds))
-			available_sinks++;
+/*
+ * Make the specified chained source the one read, and read ahead its
+ * successor.  A source that has already been read to its end
+ * passes the activation on to its successor.
+ */
+static void
+source_activate(struct source_info *ifp)
+{
+	for (;;) {
+		ifp->active = true;
+		ifp->full = false;
+		if (ifp->bp->read_ahead) {
+			ifp->bp->read_ahead = false;
+			ifp->bp->peer->peer = NULL;
+			ifp->bp->peer = NULL;
+		}
+		if (ifp->chain_last)
+			return;
+		if (!ifp->reached_eof) {
+			source_prefetch(ifp);
+			return;
+		}
+		ifp->active = false;
+		ifp = ifp->next;
 	}
+}
 
-	/*
-	 * Ensure we operate in a continuous memory region by clamping
-	 * the length of the available data to terminate at the end of
-	 * the buffer.
-	 */
-	available_data = sink_buffer_length(pos_assigned, files->ifp->source_pos_read);
+#ifdef __linux__
+/* Sink for the data discarded from the source after it has been teed */
+static int null_fd = -1;
 
-	if (available_sinks == 0)
-		return;
+/* Return true if the specified file descriptor refers to a pipe */
+static bool
+is_pipe(int fd)
+{
+	struct stat sb;
 
-	/* Assign data to sinks. */
+	if (fstat(fd, &sb) == -1)
+		err(2, "fstat");
+	return S_ISFIFO(sb.st_mode);
+}
+
+/*
+ * Return true if zero-copy broadcasting can be used for the specified
+ * sources and sinks: data from a single pipe is copied to pipes.
+ */
+static bool
+zero_copy_setup(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+
+	if (opt_scatter || permute_n || ifiles->next || !is_pipe(ifiles->fd))
+		return false;
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if (!is_pipe(ofp->fd))
+			return false;
+	if ((null_fd = open("/dev/null", O_WRONLY)) == -1)
+		return false;
+	return true;
+}
+
+/*
+ * Restart the positions of a source whose data has been written to
+ * all its sinks from zero, freeing all its buffers.
+ */
+static void
+source_rebase(struct source_info *ifp, struct sink_info *ofiles)
+{
+	struct buffer_pool *bp = ifp->bp;
+	struct sink_info *ofp;
+
+	memory_free(bp, (off_t)bp->allocated_pool_end * buffer_size);
+	bp->free_pool_begin = bp->allocated_pool_end = bp->page_out_ptr = 0;
+	bp->ring_tail = 0;
+	ifp->source_pos_read = 0;
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		ofp->pos_written = ofp->pos_to_write = 0;
+}
+
+/*
+ * Copy the data available in the source pipe to all sink pipes
+ * through tee(2), and then discard it from the source.
+ * Data that only some sinks accepted is read into the buffer pool
+ * for the lagging ones.
+ * If some sinks still have buffered data to write, or if no sink can
+ * accept data, read the source into the buffer pool as usual.
+ */
+static enum read_result
+zero_copy_read(struct source_info *ifp, struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+	struct io_buffer b;
+	ssize_t n, lo = -1, hi = 0;
+	size_t len;
+	int avail;
+
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if (ofp->active && ofp->pos_written != ifp->source_pos_read)
+			return source_read(ifp);
+	if (ioctl(ifp->fd, FIONREAD, &avail) == -1 || avail == 0)
+		return source_read(ifp);
+
+	/* Lagging sinks may need to have all the data buffered. */
+	len = MIN((size_t)avail, max_mem / buffer_size * buffer_size);
+	source_rebase(ifp, ofiles);
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		if (!ofp->active)
+			continue;
+		if ((n = tee(ifp->fd, ofp->fd, len, SPLICE_F_NONBLOCK)) == -1)
+			switch (errno) {
+			case EPIPE:
+				ofp->active = false;
+				(void)close(ofp->fd);
+				DPRINTF(4, "EPIPE for %s", fp_name(ofp));
+				continue;
+			case EAGAIN:
+				DPRINTF(4, "EAGAIN for %s", fp_name(ofp));
+				stall_begin(&ofp->stall);
+				ofp->ready = false;
+				n = 0;
+				break;
+			default:
+				err(2, "Error duplicating data to %s", fp_name(ofp));
+			}
+		DPRINTF(4, "Teed %ld out of %zu bytes to %s", (long)n, len, fp_name(ofp));
+		if (n > 0)
+			stall_end(&ofp->stall);
+		ofp->bytes_written += n;
+		ofp->pos_written = n;
+		lo = lo == -1 ? n : MIN(lo, n);
+		hi = MAX(hi, n);
+	}
+	/* The following discarding shifts all positions equally. */
+	if (use_sink_heap)
+		sink_heap_build(ofiles);
+	if (hi == 0)
+		return source_read(ifp);
+
+	/* Discard the data that all sinks have received. */
+	for (; lo > 0; lo -= n, hi -= n) {
+		if ((n = splice(ifp->fd, NULL, null_fd, NULL, lo, 0)) <= 0)
+			err(3, "Splice from %s", fp_name(ifp));
+		ifp->bytes_read += n;
+		for (ofp = ofiles; ofp; ofp = ofp->next)
+			ofp->pos_written -= n;
+	}
+
+	/* Buffer the data that only some sinks have received. */
+	while (ifp->source_pos_read < hi) {
+		if (!source_buffer(ifp, &b))
+			errx(1, "Out of memory buffering teed data");
+		if ((n = read(ifp->fd, b.p, MIN(b.size, hi - ifp->source_pos_read))) <= 0)
+			err(3, "Read from %s", fp_name(ifp));
+		ifp->source_pos_read += n;
+		ifp->bytes_read += n;
+	}
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		ofp->pos_to_write = ifp->source_pos_read;
+	return read_ok;
+}
+
+/*
+ * Setup the sinks that can have pool pages mapped into them:
+ * pipes that receive in sequence the data of a single source.
+ * Return true if there is at least one such sink.
+ */
+static bool
+vmsplice_setup(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	struct source_info *ifp;
+	struct sink_info *ofp;
+	bool found = false;
+
+	/*
+	 * Pages are only mapped, so the kernel keeps referring to them,
+	 * until the sink's reader consumes them.  This cannot be tracked
+	 * when paging out buffers, when scattering data, or when
+	 * the sink reads from chained sources.
+	 */
+	if (use_tmp_file || opt_compress || opt_scatter || opt_zero_copy)
+		return false;
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		if (!ifp->chain_last)
+			return false;
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if ((ofp->vmsplice = ofp->pipe = is_pipe(ofp->fd)))
+			found = true;
+	return found;
+}
+
+/*
+ * Map the pool pages of the specified buffers into a sink's pipe.
+ * Return the number of bytes mapped or -1 on error.
+ */
+static ssize_t
+sink_vmsplice(struct sink_info *ofp, struct iovec *iov, int iovcnt)
+{
+	return vmsplice(ofp->fd, iov, iovcnt, SPLICE_F_NONBLOCK);
+}
+
+/*
+ * Return the amount of data written to a sink's pipe
+ * that its reader has not yet consumed.
+ */
+static int
+sink_pending(struct sink_info *ofp)
+{
+	int pending;
+
+	if (!ofp->pipe)
+		return 0;
+	if (ioctl(ofp->fd, FIONREAD, &pending) == -1)
+		err(2, "Error obtaining pending data size of %s", fp_name(ofp));
+	return pending;
+}
+
+/*
+ * Return the position up to which the data written to a sink
+ * has been consumed by its reader.
+ * Data mapped into a pipe refers to the pool's pages until it is read.
+ */
+static off_t
+sink_pos_consumed(struct sink_info *ofp)
+{
+	if (!ofp->vmsplice)
+		return ofp->pos_written;
+	return ofp->pos_written - sink_pending(ofp);
+}
+
+/*
+ * Setup the measurement of the sinks' drain rates.
+ * Data written to a pipe can wait in it, so a pipe's rate is measured
+ * over a window twice as large as its capacity.
+ */
+static void
+rate_setup(struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+	int size;
+
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if ((ofp->pipe = is_pipe(ofp->fd)) &&
+		    (size = fcntl(ofp->fd, F_GETPIPE_SZ)) > 0)
+			ofp->rate_window = 2 * (off_t)size;
+}
+#else
+static bool
+zero_copy_setup(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	return false;
+}
+
+static enum read_result
+zero_copy_read(struct source_info *ifp, struct sink_info *ofiles)
+{
+	return source_read(ifp);
+}
+
+static bool
+vmsplice_setup(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	return false;
+}
+
+static ssize_t
+sink_vmsplice(struct sink_info *ofp, struct iovec *iov, int iovcnt)
+{
+	return writev(ofp->fd, iov, iovcnt);
+}
+
+static int
+sink_pending(struct sink_info *ofp)
+{
+	return 0;
+}
+
+static off_t
+sink_pos_consumed(struct sink_info *ofp)
+{
+	return ofp->pos_written;
+}
+
+static void
+rate_setup(struct sink_info *ofiles)
+{
+}
+#endif
+
+/*
+ * Update a sink's drain rate after it has written data, from the data
+ * its reader consumed since the start of the current window.
+ * A rate is only obtained once the consumed data fill the window,
+ * so that the speed at which a pipe accepts data into its buffer
+ * is not mistaken for the speed of its reader.
+ */
+static void
+sink_rate_update(struct sink_info *ofp)
+{
+	struct timespec now;
+	double elapsed, rate;
+	off_t consumed;
+
+	/* Consumed data can't fill the window before the written ones do. */
+	if (ofp->rate_pos != -1 && ofp->bytes_written - ofp->rate_pos < ofp->rate_window)
+		return;
+	consumed = ofp->bytes_written - sink_pending(ofp);
+	if (ofp->rate_pos != -1 && consumed - ofp->rate_pos < ofp->rate_window)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ofp->rate_pos != -1 && (elapsed = time_diff(&now, &ofp->rate_time)) > 0) {
+		rate = (consumed - ofp->rate_pos) / elapsed;
+		if (ofp->rate == 0)
+			ofp->rate = rate;
+		else
+			ofp->rate = RATE_ALPHA * rate + (1 - RATE_ALPHA) * ofp->rate;
+		DPRINTF(4, "Sink %s drain rate %g bytes/s", fp_name(ofp), ofp->rate);
+	}
+	ofp->rate_pos = consumed;
+	ofp->rate_time = now;
+}
+
+/*
+ * Return the rate to use for weighting a sink's share of scattered data.
+ * Sinks without a measured rate are assumed to be average.
+ */
+static double
+sink_rate(struct sink_info *ofp, double mean)
+{
+	return ofp->rate > 0 ? ofp->rate : mean;
+}
+
+/*
+ * Return the sum of the drain rates of all active sinks.
+ * Set mean to their average measured rate (1 if none has been measured).
+ */
+static double
+sinks_total_rate(struct sink_info *files, double *mean)
+{
+	struct sink_info *ofp;
+	double known = 0, total = 0;
+	int nknown = 0;
+
+	for (ofp = files; ofp; ofp = ofp->next)
+		if (ofp->active && ofp->rate > 0) {
+			known += ofp->rate;
+			nknown++;
+		}
+	*mean = nknown ? known / nknown : 1;
+	for (ofp = files; ofp; ofp = ofp->next)
+		if (ofp->active)
+			total += sink_rate(ofp, *mean);
+	return total;
+}
+
+/* Position up to which the input has been partitioned to the sinks */
+static off_t partition_pos = 0;
+
+/*
+ * Return a pointer to the contiguous data of the pool region [start, end),
+ * copying the data into a scratch buffer if it spans buffers.
+ */
+static const char *
+pool_region(struct buffer_pool *bp, off_t start, off_t end)
+{
+	static char *scratch;
+	static size_t scratch_size;
+	size_t len;
+	off_t pos;
+
+	if ((off_t)sink_buffer_length(start, end) == end - start)
+		return sink_pointer(bp, start);
+	if ((size_t)(end - start) > scratch_size) {
+		scratch_size = end - start;
+		if ((scratch = realloc(scratch, scratch_size)) == NULL)
+			err(1, "Unable to allocate record memory");
+	}
+	for (pos = start; pos < end; pos += len) {
+		len = sink_buffer_length(pos, end);
+		memcpy(scratch + (pos - start), sink_pointer(bp, pos), len);
+	}
+	return scratch;
+}
+
+/* Return the partitioning key's hash for the n-byte record at p */
+static unsigned
+record_key_hash(const char *p, size_t n)
+{
+	const char *end = p + n, *key_end_p;
+	unsigned h = 2166136261U;	/* FNV-1a */
+	int field;
+
+	if (key_field) {
+		for (field = 1; field < key_field && p; field++)
+			if ((p = memchr(p, key_delim, end - p)) != NULL)
+				p++;
+		if (p == NULL)
+			p = end;
+		if ((key_end_p = memchr(p, key_delim, end - p)) != NULL)
+			end = key_end_p;
+	} else {
+		if (key_end && key_end < n)
+			end = p + key_end;
+		p += MIN(key_begin, n);
+	}
+	for (; p < end; p++)
+		h = (h ^ (unsigned char)*p) * 16777619U;
+	return h;
+}
+
+/*
+ * Append the n-byte record at p to the specified sink's stage.
+ * Return false if the stage has no space for it.
+ */
+static bool
+sink_stage(struct sink_info *ofp, const char *p, size_t n)
+{
+	size_t pending = ofp->pos_to_write - ofp->pos_written;
+	size_t offset = ofp->pos_written - ofp->stage_base;
+
+	/* Keep at most a buffer's worth of data, unless a record is larger */
+	if (pending && pending + n > (size_t)buffer_size)
+		return false;
+	/* Discard the written data */
+	if (offset) {
+		memmove(ofp->stage, ofp->stage + offset, pending);
+		ofp->stage_len = pending;
+		ofp->stage_base = ofp->pos_written;
+	}
+	if (ofp->stage_len + n > ofp->stage_size) {
+		ofp->stage_size = MAX(ofp->stage_len + n, (size_t)buffer_size);
+		if ((ofp->stage = realloc(ofp->stage, ofp->stage_size)) == NULL)
+			err(1, "Unable to allocate partition memory");
+	}
+	memcpy(ofp->stage + ofp->stage_len, p, n);
+	ofp->stage_len += n;
+	ofp->pos_to_write += n;
+	return true;
+}
+
+/*
+ * Copy the input's complete records to the stages of the sinks
+ * selected by their key, until a sink's stage is full.
+ * At the end of input the last record can be incomplete.
+ */
+static void
+partition_records(struct sink_info *files)
+{
+	static struct sink_info **sinks;
+	static int nsinks;
+	static bool warned = false;
+	struct source_info *ifp = files->ifp;
+	struct sink_info *ofp;
+	const char *p;
+	size_t key_len;
+	off_t end;
+
+	if (sinks == NULL) {
+		for (ofp = files; ofp; ofp = ofp->next)
+			nsinks++;
+		if ((sinks = malloc(nsinks * sizeof(struct sink_info *))) == NULL)
+			err(1, NULL);
+		nsinks = 0;
+		for (ofp = files; ofp; ofp = ofp->next)
+			sinks[nsinks++] = ofp;
+	}
+
+	while (partition_pos < ifp->source_pos_read) {
+		if (block_len) {
+			end = MIN(partition_pos + (off_t)block_len, ifp->source_pos_read);
+			if (end - partition_pos < (off_t)block_len && !ifp->reached_eof)
+				break;
+		} else if ((end = pool_find_rt(ifp->bp, partition_pos, ifp->source_pos_read)) != -1)
+			end++;
+		else if (ifp->reached_eof)
+			end = ifp->source_pos_read;
+		else
+			break;
+		p = pool_region(ifp->bp, partition_pos, end);
+		key_len = end - partition_pos;
+		if (!block_len && p[key_len - 1] == rt)
+			key_len--;
+		ofp = sinks[record_key_hash(p, key_len) % nsinks];
+		/* Records for sinks that have terminated are dropped. */
+		if (!ofp->active) {
+			if (!warned) {
+				warnx("Dropping records for terminated output %s",
+				    fp_name(ofp));
+				warned = true;
+			}
+		} else if (!sink_stage(ofp, p, end - partition_pos))
+			break;
+		partition_pos = end;
+	}
+}
+
+/*
+ * Advance pos over up to n complete records of the source's data.
+ * At the end of input the last record can be incomplete.
+ * Return the number of records passed.
+ */
+static int
+records_skip(struct source_info *ifp, off_t *pos, int n)
+{
+	off_t end;
+	int i;
+
+	if (block_len) {
+		i = MIN(n, (ifp->source_pos_read - *pos) / (off_t)block_len);
+		*pos += i * block_len;
+	} else
+		for (i = 0; i < n && (end = pool_find_rt(ifp->bp, *pos, ifp->source_pos_read)) != -1; i++)
+			*pos = end + 1;
+	if (i < n && ifp->reached_eof && *pos < ifp->source_pos_read) {
+		*pos = ifp->source_pos_read;
+		i++;
+	}
+	return i;
+}
+
+/* Position up to which the input has been assigned in ordered chunks */
+static off_t ordered_pos = 0;
+
+/*
+ * Assign chunks of ordered_chunk records to the sinks in strict
+ * round-robin order, so that the output of the sinks' processing
+ * can be gathered back in the input's order.
+ * A sink receives its next chunk only after it has written the
+ * previous one, which bounds the data held for slow sinks.
+ */
+static void
+ordered_scatter(struct sink_info *files)
+{
+	static struct sink_info *next_sink;
+	static off_t scan_pos;
+	static int records;
+	struct source_info *ifp = files->ifp;
+	struct sink_info *ofp;
+
+	if (next_sink == NULL)
+		next_sink = files;
+	for (ofp = next_sink; ofp->pos_written == ofp->pos_to_write; ofp = next_sink) {
+		records += records_skip(ifp, &scan_pos, ordered_chunk - records);
+		/* Only the last chunk can be incomplete. */
+		if (records < ordered_chunk && (!ifp->reached_eof || scan_pos == ordered_pos))
+			return;
+		ofp->pos_written = ordered_pos;
+		ofp->pos_to_write = ordered_pos = scan_pos;
+		records = 0;
+		/* Dropping the chunk would break the gathered output. */
+		if (!ofp->active)
+			errx(1, "Output %s terminated before receiving all its ordered chunks",
+				fp_name(ofp));
+		DPRINTF(4, "ordered scatter to file[%s] pos_written=%ld pos_to_write=%ld",
+			fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write);
+		next_sink = ofp->next ? ofp->next : files;
+	}
+}
+
+/* Return true if all gathered sources have been output to their end */
+static bool
+gather_finished(void)
+{
+	struct source_info *ifp;
+
+	for (ifp = gather_sources; ifp; ifp = ifp->next)
+		if (!ifp->reached_eof || ifp->gather_pos < ifp->source_pos_read)
+			return false;
+	return true;
+}
+
+/*
+ * Have the sink write chunks of ordered_chunk records from each
+ * source in turn, reassembling data scattered in order.
+ * Once a source ends with an incomplete chunk, the others may
+ * only end as well; further records mean some were lost.
+ */
+static void
+ordered_gather(struct sink_info *ofp)
+{
+	static bool ended;	/* An incomplete chunk has been gathered */
+	struct source_info *ifp;
+
+	for (;;) {
+		ifp = ofp->ifp;
+		/* Data of the source being written must be read. */
+		ifp->full = false;
+		ofp->records += records_skip(ifp, &ofp->pos_to_write, ordered_chunk - ofp->records);
+		if (ended && ofp->records)
+			errx(1, "Input %s has records after an earlier input ended",
+				fp_name(ifp));
+		if (ofp->pos_written < ofp->pos_to_write ||
+		    (ofp->records < ordered_chunk && !ifp->reached_eof))
+			return;
+		ifp->gather_pos = ofp->pos_written;
+		if (ofp->records < ordered_chunk && gather_finished())
+			return;
+		if (ofp->records < ordered_chunk)
+			ended = true;
+		ofp->ifp = ifp->chain_last ? gather_sources : ifp->next;
+		ofp->pos_written = ofp->pos_to_write = ofp->ifp->gather_pos;
+		ofp->records = 0;
+		DPRINTF(4, "%s(): gather from input file %s pos=%ld",
+			__func__, fp_name(ofp->ifp), (long)ofp->pos_written);
+	}
+}
+
+/* Ensure the sink's stash has space for len more bytes */
+static void
+sink_stash_reserve(struct sink_info *ofp, size_t len)
+{
+	if (ofp->stash_len + len <= ofp->stash_size)
+		return;
+	ofp->stash_size = ofp->stash_len + len;
+	if ((ofp->stash = realloc(ofp->stash, ofp->stash_size)) == NULL)
+		err(1, "Unable to allocate stash memory");
+}
+
+/*
+ * Drop the oldest records a sink holds back beyond its cap,
+ * so that its buffers can be freed.  If the sink has written
+ * part of a record, the record's remainder is kept in its stash.
+ */
+static void
+sink_drop(struct sink_info *ofp)
+{
+	struct source_info *ifp = ofp->ifp;
+	off_t keep, rest;
+	const char *p;
+
+	if (ifp->source_pos_read - ofp->pos_written <= (off_t)ofp->cap)
+		return;
+	/* Find the start of the first record to keep and of the next one to write. */
+	keep = ifp->source_pos_read - ofp->cap;
+	if (block_len) {
+		keep = (keep + block_len - 1) / block_len * block_len;
+		rest = (ofp->pos_written + block_len - 1) / block_len * block_len;
+	} else {
+		if ((keep = pool_find_rt(ifp->bp, keep - 1, ifp->source_pos_read)) == -1)
+			return;
+		keep++;
+		if (ofp->at_record || ofp->stash_len)
+			rest = ofp->pos_written;
+		else if ((rest = pool_find_rt(ifp->bp, ofp->pos_written, ifp->source_pos_read)) != -1)
+			rest++;
+		else
+			return;
+	}
+	if (rest >= keep || keep > ifp->source_pos_read)
+		return;
+	if (rest > ofp->pos_written) {
+		p = pool_region(ifp->bp, ofp->pos_written, rest);
+		sink_stash_reserve(ofp, rest - ofp->pos_written);
+		memcpy(ofp->stash + ofp->stash_len, p, rest - ofp->pos_written);
+		ofp->stash_len += rest - ofp->pos_written;
+	}
+	ofp->dropped += keep - rest;
+	DPRINTF(3, "Dropped %ld bytes for %s", (long)(keep - rest), fp_name(ofp));
+	ofp->pos_written = keep;
+	sink_heap_update(ofp);
+}
+
+/*
+ * Move the data a sink holds back beyond its cap to its spill file,
+ * so that its buffers can be freed.
+ */
+static void
+sink_spill(struct sink_info *ofp)
+{
+	struct source_info *ifp = ofp->ifp;
+	off_t pos = MAX(ofp->pos_written, ofp->spill_end);
+	ssize_t n;
+
+	if (ifp->source_pos_read - pos <= (off_t)ofp->cap)
+		return;
+	if (ofp->spill_fd == -1)
+		ofp->spill_fd = tmp_file_open();
+	/* Reuse the file once its data have been written out. */
+	if (ofp->pos_written >= ofp->spill_end) {
+		ofp->spill_base = pos;
+		if (ftruncate(ofp->spill_fd, 0) == -1)
+			err(1, "Error truncating spill file for %s", fp_name(ofp));
+	}
+	for (; pos < ifp->source_pos_read; pos += n)
+		if ((n = pwrite(ofp->spill_fd, sink_pointer(ifp->bp, pos),
+		    sink_buffer_length(pos, ifp->source_pos_read), pos - ofp->spill_base)) == -1)
+			err(1, "Error writing to spill file for %s", fp_name(ofp));
+	DPRINTF(3, "Spilled %ld bytes for %s", (long)(pos - MAX(ofp->pos_written, ofp->spill_end)), fp_name(ofp));
+	ofp->spill_end = pos;
+	sink_heap_update(ofp);
+}
+
+/* Read the next spilled data of a sink into its stash */
+static void
+sink_unspill(struct sink_info *ofp)
+{
+	size_t len = MIN(ofp->spill_end - ofp->pos_written, buffer_size);
+	ssize_t n;
+
+	sink_stash_reserve(ofp, len);
+	if ((n = pread(ofp->spill_fd, ofp->stash, len, ofp->pos_written - ofp->spill_base)) <= 0)
+		err(1, "Error reading from spill file for %s", fp_name(ofp));
+	ofp->stash_len = n;
+	ofp->pos_written += n;
+}
+
+/*
+ * Account for n bytes written to a sink from the specified iovec,
+ * whose first element contains any stashed data.
+ */
+static void
+sink_advance(struct sink_info *ofp, const struct iovec *iov, size_t n)
+{
+	size_t stashed = MIN(n, ofp->stash_len - ofp->stash_written);
+	size_t last;
+
+	if (n == 0)
+		return;
+	stall_end(&ofp->stall);
+	ofp->bytes_written += n;
+	/* Records can only be dropped after a complete one has been written. */
+	if (ofp->policy == sp_drop) {
+		for (last = n - 1; last >= iov->iov_len; iov++)
+			last -= iov->iov_len;
+		ofp->at_record = ((const char *)iov->iov_base)[last] == rt;
+	}
+	ofp->stash_written += stashed;
+	if (ofp->stash_written == ofp->stash_len)
+		ofp->stash_written = ofp->stash_len = 0;
+	ofp->pos_written += n - stashed;
+	sink_heap_update(ofp);
+}
+
+/*
+ * Assign to a sink that copies its source all the data read,
+ * and apply its policy for lagging behind.
+ */
+static void
+sink_copy_assign(struct sink_info *ofp)
+{
+	/* Advance to next input file, if required */
+	if (ofp->pos_written == ofp->ifp->source_pos_read &&
+	    ofp->ifp->reached_eof &&
+	    !ofp->ifp->chain_last) {
+		DPRINTF(4, "%s(): advance to input file %s\n",
+				__func__, fp_name(ofp->ifp));
+		ofp->ifp = ofp->ifp->next;
+		ofp->ifp->active = true;
+		ofp->pos_written = 0;
+		ofp->spill_end = 0;
+	}
+	ofp->pos_to_write = ofp->ifp->source_pos_read;
+	if (ofp->policy == sp_drop)
+		sink_drop(ofp);
+	else if (ofp->policy == sp_spill)
+		sink_spill(ofp);
+}
+
+/*
+ * Allocate available read data to empty sinks that can be written to,
+ * by adjusting their ifp, pos_written, and pos_to_write pointers.
+ * With weighted scattering, each sink gets a part of the data that is
+ * proportional to its share of all sinks' drain rate.  Data left over
+ * are given to the sinks that become free first, so that fast sinks
+ * take on the work that slow ones cannot perform.
+ */
+static void
+allocate_data_to_sinks(struct sink_info *files)
+{
+	struct sink_info *ofp;
+	int i, available_sinks = 0;
+	off_t pos_assigned = 0;
+	size_t available_data, data_per_sink;
+	size_t data_to_assign = 0;
+	bool use_reliable = false;
+	double total_rate = 0, mean_rate = 0;
+
+	/* Easy case: distribute to all files. */
+	if (!opt_scatter) {
+		if (use_sink_heap) {
+			for (i = 0; i < selected_sinks_n; i++)
+				sink_copy_assign(selected_sinks[i]);
+			for (i = 0; i < policy_sinks_n; i++)
+				sink_copy_assign(policy_sinks[i]);
+			return;
+		}
+		for (ofp = files; ofp; ofp = ofp->next)
+			if (gather_sources)
+				ordered_gather(ofp);
+			else
+				sink_copy_assign(ofp);
+		return;
+	}
+
+	/*
+	 * Difficult case: fair scattering across available sinks
+	 * Thankfully here we only have a single input file
+	 */
+	if (opt_partition) {
+		partition_records(files);
+		return;
+	}
+
+	if (ordered_chunk) {
+		ordered_scatter(files);
+		return;
+	}
+
+	/* Determine amount of fresh data to write and number of available sinks. */
+	for (ofp = files; ofp; ofp = ofp->next) {
+		pos_assigned = MAX(pos_assigned, ofp->pos_to_write);
+		if (ofp->pos_written == ofp->pos_to_write && ofp->selected)
+			available_sinks++;
+	}
+
+	/*
+	 * Ensure we operate in a continuous memory region by clamping
+	 * the length of the available data to terminate at the end of
+	 * the buffer.
+	 * Blocks need no scanning, so they can span buffers.
+	 */
+	if (block_len)
+		available_data = files->ifp->source_pos_read - pos_assigned;
+	else
+		available_data = sink_buffer_length(pos_assigned, files->ifp->source_pos_read);
+
+	if (available_sinks == 0)
+		return;
+
+	if (opt_weighted)
+		total_rate = sinks_total_rate(files, &mean_rate);
+
+	/* Assign data to sinks. */
 	data_per_sink = available_data / available_sinks;
 	for (ofp = files; ofp; ofp = ofp->next) {
 		/* Move to next file if this has data to write, or isn't ready. */
-		if (ofp->pos_written != ofp->pos_to_write || !FD_ISSET(ofp->fd, sink_fds))
+		if (ofp->pos_written != ofp->pos_to_write || !ofp->selected)
 			continue;
 
 		DPRINTF(4, "pos_assigned=%ld source_pos_read=%ld available_data=%ld available_sinks=%d data_per_sink=%ld",
 			(long)pos_assigned, (long)ofp->ifp->source_pos_read, (long)available_data, available_sinks, (long)data_per_sink);
+		if (opt_weighted) {
+			data_per_sink = data_to_assign = available_data *
+				(sink_rate(ofp, mean_rate) / total_rate);
 		/* First file also gets the remainder bytes. */
-		if (data_to_assign == 0)
+		} else if (data_to_assign == 0)
 			data_to_assign = sink_buffer_length(pos_assigned,
 				pos_assigned + data_per_sink + available_data % available_sinks);
 		else
@@ -677,222 +2649,760 @@ allocate_data_to_sinks(fd_set *sink_fds, struct sink_info *files)
 		 */
 		ofp->pos_written = pos_assigned;		/* Initially nothing has been written. */
 		if (block_len == 0) {			/* Write whole lines */
+			off_t data_end = -1, threshold;
+
 			if (available_data > buffer_size / 2 && !use_reliable) {
 				/*
-				 * Efficient algorithm:
-				 * Assume that multiple lines appear in data_per_sink.
-				 * Go to a calculated boundary and scan backward to find
-				 * a new line.
+				 * Efficient algorithm:
+				 * Assume that multiple lines appear in data_per_sink.
+				 * Go to a calculated boundary and scan backward to find
+				 * a new line.
+				 */
+				data_end = pool_rfind_rt(ofp->ifp->bp, pos_assigned + 1,
+					pos_assigned + data_to_assign);
+				/*
+				 * If no newline was found with backward scanning
+				 * degenerate to the reliable algorithm. This will
+				 * scan further forward, and can defer writing the
+				 * last chunk, until more data is read.
+				 */
+				if (data_end == -1)
+					use_reliable = true;
+			}
+			if (data_end == -1) {
+				/*
+				 * Reliable algorithm:
+				 * Scan forward for the first new line that lies past
+				 * data_per_sink.  If there is none until the end of
+				 * available data, backtrack to the last new line
+				 * before that point.
 				 */
-				off_t data_end = pos_assigned + data_to_assign - 1;
+				threshold = MIN(pos_assigned + data_per_sink + 1,
+					ofp->ifp->source_pos_read);
+				data_end = pool_find_rt(ofp->ifp->bp, threshold,
+					ofp->ifp->source_pos_read);
+				if (data_end == -1)
+					data_end = pool_rfind_rt(ofp->ifp->bp, pos_assigned,
+						threshold);
+			}
+			if (data_end == -1) {
+				/* No newline found in buffer; defer writing. */
+				ofp->pos_to_write = pos_assigned;
+				DPRINTF(4, "scatter to file[%s] no newline from %ld to %ld",
+					fp_name(ofp), (long)pos_assigned,
+					(long)ofp->ifp->source_pos_read);
+				return;
+			}
+			pos_assigned = data_end + 1;
+		} else {				/* Write whole blocks */
+			off_t data_end = pos_assigned +
+				MAX(data_to_assign / block_len, 1) * block_len;
+
+			if (data_end > ofp->ifp->source_pos_read) {
+				/* The last block can be incomplete at the end of input. */
+				if (ofp->ifp->reached_eof)
+					data_end = ofp->ifp->source_pos_read;
+				if (data_end == pos_assigned || !ofp->ifp->reached_eof) {
+					/* No complete block available; defer writing. */
+					ofp->pos_to_write = pos_assigned;
+					return;
+				}
+			}
+			pos_assigned = data_end;
+		}
+		ofp->pos_to_write = pos_assigned;
+		DPRINTF(4, "scatter to file[%s] pos_written=%ld pos_to_write=%ld data=[%.*s]",
+			fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write,
+			(int)(ofp->pos_to_write - ofp->pos_written) * DATA_DUMP, sink_pointer(ofp->ifp->bp, ofp->pos_written));
+	}
+}
 
-				for (;;) {
-					if (data_end <= pos_assigned) {
-						/*
-						 * If no newline was found with backward scanning
-						 * degenerate to the efficient algorithm. This will
-						 * scan further forward, and can defer writing the
-						 * last chunk, until more data is read.
-						 */
-						use_reliable = true;
-						goto reliable;
-					}
-					if (*sink_pointer(ofp->ifp->bp, data_end) == rt) {
-						pos_assigned = data_end + 1;
+
+/* Close a sink that has no more data to write, to avoid deadlocks downstream */
+static void
+sink_retire(struct sink_info *ofp)
+{
+	DPRINTF(3, "Retiring file %s pos_written=pos_to_write=%ld source_pos_read=%ld",
+		fp_name(ofp), (long)ofp->pos_written, (long)ofp->ifp->source_pos_read);
+	if (close(ofp->fd) == -1)
+		err(2, "Error closing %s", fp_name(ofp));
+	ofp->active = false;
+	sink_heap_remove(ofp);
+}
+
+/*
+ * Write out from the memory buffer to the sinks where write will not block.
+ * Free memory no more needed even by the write pointer farthest behind.
+ * Return the number of bytes written.
+ */
+static size_t
+sink_write(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+	struct source_info *ifp;
+	size_t written = 0;
+	off_t scatter_end = 0;
+	int i;
+
+	allocate_data_to_sinks(ofiles);
+
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		/*
+		 * Gathered sources keep their data until it is output.
+		 * The one being output needs only the data after the
+		 * sink's position, so that a chunk can exceed the memory limit.
+		 */
+		ifp->read_min_pos = gather_sources && ifp != ofiles->ifp ?
+			ifp->gather_pos : ifp->source_pos_read;
+		ifp->is_read = false;
+	}
+	for (i = 0; i < selected_sinks_n; i++) {
+		ofp = selected_sinks[i];
+		DPRINTF(4, "\n%s(): try write to file %s", __func__, fp_name(ofp));
+		if (ofp->active) {
+			ssize_t n;
+			size_t size;
+			struct iovec iov[SINK_IOV_MAX];
+			int iovcnt;
+
+			if (ofp->stash_len == 0 && ofp->pos_written < ofp->spill_end)
+				sink_unspill(ofp);
+			size = sink_iovec(ofp, iov, &iovcnt);
+			DPRINTF(4, "\n%s(): sink buffers returned %d bytes to write",
+					__func__, (int)size);
+			if (size == 0)
+				/* Can happen when a line spans a buffer */
+				n = 0;
+			else {
+				if (ofp->vmsplice)
+					n = sink_vmsplice(ofp, iov, iovcnt);
+				else
+					n = writev(ofp->fd, iov, iovcnt);
+				if (n < 0)
+					switch (errno) {
+					/* EPIPE is acceptable, for the sink's reader can terminate early. */
+					case EPIPE:
+						if (ordered_chunk && opt_scatter)
+							errx(1, "Output %s terminated before writing its ordered chunk",
+								fp_name(ofp));
+						ofp->active = false;
+						sink_heap_remove(ofp);
+						(void)close(ofp->fd);
+						DPRINTF(4, "EPIPE for %s", fp_name(ofp));
+						break;
+					case EAGAIN:
+						DPRINTF(4, "EAGAIN for %s", fp_name(ofp));
+						stall_begin(&ofp->stall);
+						ofp->ready = false;
+						n = 0;
 						break;
+					case EFAULT:
+						/* Data served from a file that was later truncated. */
+						if (ofp->ifp->bp->map_fd != -1)
+							errx(2, "Input file %s truncated while being read",
+								fp_name(ofp->ifp));
+						/* FALLTHROUGH */
+					default:
+						err(2, "Error writing to %s", fp_name(ofp));
 					}
-					data_end--;
+				else {
+					sink_advance(ofp, iov, n);
+					written += n;
+					if (opt_weighted)
+						sink_rate_update(ofp);
+					if (use_sink_heap && reached_eof &&
+					    ofp->pos_written == ofp->pos_to_write && !ofp->stash_len)
+						sink_retire(ofp);
 				}
-			} else {
+			}
+			DPRINTF(4, "Wrote %d out of %zu bytes for file %s pos_written=%lu data=[%.*s]",
+				(int)n, size, fp_name(ofp), (unsigned long)ofp->pos_written,
+				size ? (int)MIN(n, iov[0].iov_len) * DATA_DUMP : 0,
+				size ? (char *)iov[0].iov_base : "");
+		}
+	}
+
+	if (use_sink_heap) {
+		/* The single source is read by the sinks in the heap. */
+		if (sink_heap_n)
+			ifiles->read_min_pos = sink_heap_key(sink_heap[0]);
+	} else {
+		for (ofp = ofiles; ofp; ofp = ofp->next) {
+			if (ofp->active) {
 				/*
-				 * Reliable algorithm:
-				 * Scan forward for new lines until at least
-				 * data_per_sink are covered, or we reach the end of available data.
-				 * Keep a record of the last encountered newline.
-				 * This is used to backtrack when we scan past the end of the
-				 * available data.
+				 * Scattered data is never assigned before the farthest
+				 * assigned position, so idle sinks need no buffers.
 				 */
-				off_t data_end, last_nl;
-
-			reliable:
-				last_nl = -1;
-				data_end = pos_assigned;
-				for (;;) {
-					if (data_end >= ofp->ifp->source_pos_read) {
-						if (last_nl != -1) {
-							pos_assigned = last_nl + 1;
-							break;
-						} else {
-							/* No newline found in buffer; defer writing. */
-							ofp->pos_to_write = pos_assigned;
-							DPRINTF(4, "scatter to file[%s] no newline from %ld to %ld",
-								fp_name(ofp), (long)pos_assigned, (long)data_end);
-							return;
-						}
-					}
+				if (!opt_partition &&
+				    (!opt_scatter || ofp->pos_written != ofp->pos_to_write))
+					ofp->ifp->read_min_pos = MIN(ofp->ifp->read_min_pos,
+						MAX(sink_pos_consumed(ofp), ofp->spill_end));
+				ofp->ifp->is_read = true;
+			}
+			scatter_end = MAX(scatter_end, ofp->pos_to_write);
+		}
+		/* Keep the data that hasn't yet been assigned to a sink. */
+		if (opt_partition)
+			ifiles->read_min_pos = MIN(ifiles->read_min_pos, partition_pos);
+		else if (opt_scatter)
+			ifiles->read_min_pos = MIN(ifiles->read_min_pos, scatter_end);
+	}
+
+	/* Free buffers all sinks have read */
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		memory_free(ifp->bp, ifp->read_min_pos);
+		prefetch(ifp->bp, ifp->read_min_pos);
+		/*
+		 * We are reading this source, so don't even think freeing
+		 * sources after this.
+		 */
+		if (ifp->is_read && !gather_sources)
+			break;
+	}
+
+	DPRINTF(4, "Wrote %zu total bytes", written);
+	return written;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage %s [-b size] [-c range] [-d delim] [-i file] [-CFfHIMPrsUVwZz] [-k field] [-l len] [-o file] [-m size] [-O n:policy[:size]] [-R records] [-S file] [-t char]\n"
+		"-a"		"\tOpen output file(s) for appending\n"
+		"-b size"	"\tSpecify the size of the buffer to use (used for stress testing)\n"
+		"-c range"	"\tPartition records to sinks by a hash of the specified bytes\n"
+		"-C"		"\tCompress buffered data that exceeds the memory limit\n"
+		"-d delim"	"\tSpecify the key field delimiter (tab default)\n"
+		"-F"		"\tOverflow buffered data into a memory-mapped temporary file\n"
+		"-f"		"\tOverflow buffered data into a temporary file\n"
+		"-H"		"\tAllocate buffers from huge pages\n"
+		"-I"		"\tInput-side buffering\n"
+		"-i file"	"\tGather input from specified file\n"
+		"-k field"	"\tPartition records to sinks by a hash of the specified field\n"
+		"-l len"	"\tScatter fixed-length records of the specified size\n"
+		"-m size[k|M|G]""\tSpecify the maximum buffer memory size\n"
+		"-M"		"\tProvide memory use statistics on termination\n"
+		"-O n:policy[:size]"	"\tHandle data for a lagging output n by blocking, spilling, or dropping them\n"
+		"-o file"	"\tScatter output to specified file\n"
+		"-P"		"\tCopy data through a reader and per-output writer threads\n"
+		"-p d1[,d2...]"	"\tPermute inputs to specified outputs\n"
+		"-R records"	"\tScatter or gather chunks of the specified records in order\n"
+		"-r"		"\tBuffer data in a mirrored ring buffer (Linux)\n"
+		"-S file"	"\tPeriodically write JSON I/O statistics to the specified file\n"
+		"-s"		"\tScatter the input across the files, rather than copying it to all\n"
+		"-T dir"	"\tSpecify directory for storing temporary file\n"
+		"-t char"	"\tProcess char-terminated records (newline default)\n"
+		"-U"		"\tOverflow into a temporary file through asynchronous I/O (Linux)\n"
+		"-V"		"\tMap buffered data into output pipes (Linux)\n"
+		"-w"		"\tScatter data in proportion to each sink's drain rate (implies -s)\n"
+		"-Z"		"\tWrite regular input files to the outputs from a memory mapping\n"
+		"-z"		"\tCopy data between pipes without reading it (Linux)\n",
+		name);
+	exit(1);
+}
+
+/*
+ * Set the specified file descriptor to operate in non-blocking
+ * mode.
+ * It seems that even if select returns for a specified file
+ * descriptor, performing I/O to it may block depending on the
+ * amount of data specified.
+ * See See http://pubs.opengroup.org/onlinepubs/009695399/functions/write.html#tag_03_866
+ */
+static void
+non_block(int fd, const char *name)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		err(2, "Error getting flags for %s", name);
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		err(2, "Error setting %s to non-blocking mode", name);
+}
+
+/* Set the specified file descriptor to blocking mode */
+static void
+blocking(int fd, const char *name)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		err(2, "Error getting flags for %s", name);
+	if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+		err(2, "Error setting %s to blocking mode", name);
+}
+
+/*
+ * Threaded copying.  The main thread reads the single source into its
+ * buffer pool and a writer thread per sink writes the data out with
+ * blocking system calls.  The source's read position and the sinks'
+ * written positions are published with release stores and loaded with
+ * acquire loads, so that no lock is needed for transferring the data.
+ * The lock and condition variables are only used for sleeping when
+ * there is nothing to do, and are only signalled when a thread sleeps.
+ */
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t data_cond = PTHREAD_COND_INITIALIZER;	/* New data read */
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;	/* New data written */
+static int data_waiters, space_waiters;	/* Threads sleeping on the above */
+/* Exclude the reader's reallocation of the pool buffer bank from writers */
+static pthread_rwlock_t bank_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Wake up the threads waiting on the specified condition, after
+ * publishing a position.  The fence pairs with the one in thread_wait():
+ * either the sleeper sees the new position or we see the sleeper.
+ */
+static void
+thread_notify(pthread_cond_t *cond, int *waiters)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&thread_lock);
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(&thread_lock);
+}
+
+/* Announce that the caller will sleep on a condition; thread_lock is held */
+static void
+thread_wait_begin(int *waiters)
+{
+	__atomic_add_fetch(waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Announce that the caller stopped sleeping; thread_lock is held */
+static void
+thread_wait_end(int *waiters)
+{
+	__atomic_sub_fetch(waiters, 1, __ATOMIC_RELAXED);
+}
+
+/* Write all the source's data to the sink passed as argument */
+static void *
+thread_write(void *arg)
+{
+	struct sink_info *ofp = arg;
+	struct source_info *ifp = ofp->ifp;
+	struct iovec iov[SINK_IOV_MAX];
+	int iovcnt;
+	ssize_t n;
+
+	for (;;) {
+		ofp->pos_to_write = __atomic_load_n(&ifp->source_pos_read, __ATOMIC_ACQUIRE);
+		if (ofp->pos_written == ofp->pos_to_write) {
+			pthread_mutex_lock(&thread_lock);
+			thread_wait_begin(&data_waiters);
+			while (ofp->pos_written == __atomic_load_n(&ifp->source_pos_read, __ATOMIC_ACQUIRE) &&
+			    !__atomic_load_n(&ifp->reached_eof, __ATOMIC_ACQUIRE))
+				pthread_cond_wait(&data_cond, &thread_lock);
+			thread_wait_end(&data_waiters);
+			pthread_mutex_unlock(&thread_lock);
+			if (ofp->pos_written == __atomic_load_n(&ifp->source_pos_read, __ATOMIC_ACQUIRE))
+				break;
+			continue;
+		}
+		pthread_rwlock_rdlock(&bank_lock);
+		sink_iovec(ofp, iov, &iovcnt);
+		pthread_rwlock_unlock(&bank_lock);
+		if ((n = writev(ofp->fd, iov, iovcnt)) < 0) {
+			/* EPIPE is acceptable, for the sink's reader can terminate early. */
+			if (errno != EPIPE)
+				err(2, "Error writing to %s", fp_name(ofp));
+			DPRINTF(4, "EPIPE for %s", fp_name(ofp));
+			__atomic_store_n(&ofp->active, false, __ATOMIC_RELEASE);
+			thread_notify(&space_cond, &space_waiters);
+			break;
+		}
+		__atomic_store_n(&ofp->pos_written, ofp->pos_written + n, __ATOMIC_RELEASE);
+		thread_notify(&space_cond, &space_waiters);
+	}
+	if (close(ofp->fd) == -1)
+		err(2, "Error closing %s", fp_name(ofp));
+	return NULL;
+}
+
+/* Return the position up to which all active sinks have written data */
+static off_t
+threads_written_pos(struct source_info *ifp, struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+	off_t pos = ifp->source_pos_read;
+
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if (__atomic_load_n(&ofp->active, __ATOMIC_ACQUIRE))
+			pos = MIN(pos, __atomic_load_n(&ofp->pos_written, __ATOMIC_ACQUIRE));
+	return pos;
+}
+
+/*
+ * Copy the single source to all sinks through threads.
+ * With input-side buffering fail rather than wait for memory.
+ */
+static void
+threads_copy(struct source_info *ifp, struct sink_info *ofiles, bool input_side)
+{
+	struct sink_info *ofp;
+	struct io_buffer b;
+	off_t written_pos;
+	ssize_t n;
+	bool got_buffer;
+
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		blocking(ofp->fd, fp_name(ofp));
+		if ((errno = pthread_create(&ofp->thread, NULL, thread_write, ofp)) != 0)
+			err(1, "Unable to create writer thread for %s", fp_name(ofp));
+	}
+	blocking(ifp->fd, fp_name(ifp));
+
+	for (;;) {
+		written_pos = threads_written_pos(ifp, ofiles);
+		pthread_rwlock_wrlock(&bank_lock);
+		memory_free(ifp->bp, written_pos);
+		got_buffer = source_buffer(ifp, &b);
+		pthread_rwlock_unlock(&bank_lock);
+		if (!got_buffer) {
+			if (input_side)
+				errx(1, "Out of memory with input-side buffering specified");
+			/* Wait for the sinks to drain data. */
+			pthread_mutex_lock(&thread_lock);
+			thread_wait_begin(&space_waiters);
+			while (threads_written_pos(ifp, ofiles) == written_pos)
+				pthread_cond_wait(&space_cond, &thread_lock);
+			thread_wait_end(&space_waiters);
+			pthread_mutex_unlock(&thread_lock);
+			continue;
+		}
+		if ((n = read(ifp->fd, b.p, b.size)) == -1)
+			err(3, "Read from %s", fp_name(ifp));
+		if (n == 0)
+			break;
+		__atomic_store_n(&ifp->source_pos_read, ifp->source_pos_read + n, __ATOMIC_RELEASE);
+		thread_notify(&data_cond, &data_waiters);
+	}
+	__atomic_store_n(&ifp->reached_eof, true, __ATOMIC_RELEASE);
+	thread_notify(&data_cond, &data_waiters);
+
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if ((errno = pthread_join(ofp->thread, NULL)) != 0)
+			err(1, "Unable to join writer thread for %s", fp_name(ofp));
+}
+
+
+/* Return true if we want to read from the specified source in the specified state */
+static bool
+source_wanted(struct source_info *ifp, enum state state)
+{
+	if (reached_eof)
+		return false;
+	switch (state) {
+	case read_ib:
+		return !ifp->reached_eof;
+	case read_ob:
+		return (ifp->active || ifp->prefetch) && !ifp->reached_eof && !ifp->full;
+	default:
+		return false;
+	}
+}
+
+/* Return true if we want to write to the specified sink in the specified state */
+static bool
+sink_wanted(struct sink_info *ofp, enum state state)
+{
+	if (!ofp->active)
+		return false;
+	switch (state) {
+	case read_ib:
+	case read_ob:
+	case drain_ob:
+		DPRINTF(4, "Check active file[%s] pos_written=%ld pos_to_write=%ld",
+			fp_name(ofp), (long)ofp->pos_written, (long)sink_data_end(ofp));
+		return ofp->pos_written < sink_data_end(ofp) || ofp->stash_len;
+	case drain_ib:
+	case write_ob:
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Show the file descriptors we want to wait for (or, if selected is true,
+ * those that are ready for I/O) in human-readable form
+ * If check is true, abort the program if no descriptor is shown
+ */
+static void
+show_wait_args(const char *msg, struct source_info *ifiles, struct sink_info *ofiles, enum state state, bool selected, bool check)
+{
+	#ifdef DEBUG
+	struct sink_info *ofp;
+	struct source_info *ifp;
+	int nbits = 0;
+
+	fprintf(stderr, "%s: ", msg);
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		if (selected ? ifp->selected : source_wanted(ifp, state)) {
+			fprintf(stderr, "%s ", fp_name(ifp));
+			nbits++;
+		}
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if (selected ? ofp->selected : sink_wanted(ofp, state)) {
+			fprintf(stderr, "%s ", fp_name(ofp));
+			nbits++;
+		}
+	fputc('\n', stderr);
+	if (check && nbits == 0)
+		abort();
+	#endif
+}
+
+/* Allocate the vectors of the selected sources and sinks */
+static void
+selection_init(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	struct source_info *ifp;
+	struct sink_info *ofp;
+	int nin = 0, nout = 0;
+
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		nin++;
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		nout++;
+	if ((selected_sources = malloc(nin * sizeof(struct source_info *))) == NULL ||
+	    (selected_sinks = malloc(nout * sizeof(struct sink_info *))) == NULL)
+		err(1, NULL);
+}
+
+/* Clear the selection of the last wait */
+static void
+selection_clear(void)
+{
+	int i;
+
+	for (i = 0; i < selected_sources_n; i++)
+		selected_sources[i]->selected = false;
+	for (i = 0; i < selected_sinks_n; i++)
+		selected_sinks[i]->selected = false;
+	selected_sources_n = selected_sinks_n = 0;
+}
 
-					if (*sink_pointer(ofp->ifp->bp, data_end) == rt) {
-						last_nl = data_end;
-						if (data_end - pos_assigned > data_per_sink) {
-							pos_assigned = data_end + 1;
-							break;
-						}
-					}
-					data_end++;
-				}
-			}
-		} else
-			pos_assigned += data_to_assign;
-		ofp->pos_to_write = pos_assigned;
-		DPRINTF(4, "scatter to file[%s] pos_written=%ld pos_to_write=%ld data=[%.*s]",
-			fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write,
-			(int)(ofp->pos_to_write - ofp->pos_written) * DATA_DUMP, sink_pointer(ofp->ifp->bp, ofp->pos_written));
-	}
+/* Select the specified source, if it is wanted and ready */
+static void
+source_select(struct source_info *ifp)
+{
+	if ((ifp->selected = ifp->wanted && ifp->ready))
+		selected_sources[selected_sources_n++] = ifp;
 }
 
+/* Select the specified sink, if it is wanted and ready */
+static void
+sink_select(struct sink_info *ofp)
+{
+	if ((ofp->selected = ofp->wanted && ofp->ready))
+		selected_sinks[selected_sinks_n++] = ofp;
+}
 
+#ifdef __linux__
 /*
- * Write out from the memory buffer to the sinks where write will not block.
- * Free memory no more needed even by the write pointer farthest behind.
- * Return the number of bytes written.
+ * Readiness is tracked through an edge-triggered epoll(7) instance.
+ * Each event carries a pointer to the wait_fd of the corresponding
+ * source or sink, whose ready field then remains set until an
+ * I/O operation on the descriptor returns EAGAIN.
+ * The sources and sinks that are marked as ready are kept in a list,
+ * so that each wakeup only examines those, rather than all descriptors,
+ * and the number of descriptors is not limited by FD_SETSIZE.
  */
-static size_t
-sink_write(struct source_info *ifiles, fd_set *sink_fds, struct sink_info *ofiles)
+static int epoll_fd = -1;
+
+/* Maximum number of events to obtain with a single epoll_wait(2) */
+#define MAX_EVENTS 64
+
+/* A source or sink monitored through epoll */
+struct wait_fd {
+	struct source_info *ifp;	/* Monitored source; NULL for a sink */
+	struct sink_info *ofp;		/* Monitored sink; NULL for a source */
+	bool *ready;			/* Its ready field */
+	bool listed;			/* True if it is in the ready list */
+};
+
+/* The monitored sources and sinks, and those that may be ready */
+static struct wait_fd *wait_fds;
+static struct wait_fd **ready_list;
+static int ready_n;
+
+/* Mark the specified source or sink as ready, listing it if needed */
+static void
+ready_add(struct wait_fd *wf)
+{
+	*wf->ready = true;
+	if (wf->listed)
+		return;
+	wf->listed = true;
+	ready_list[ready_n++] = wf;
+}
+
+/* Monitor the specified file descriptor for the specified events */
+static void
+epoll_add(struct wait_fd *wf, int fd, uint32_t events, const char *name)
+{
+	struct epoll_event ev;
+
+	ev.events = events | EPOLLET;
+	ev.data.ptr = wf;
+	*wf->ready = false;
+	wf->listed = false;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		/* Regular files and some devices are always ready. */
+		if (errno == EPERM)
+			ready_add(wf);
+		else
+			err(2, "Error monitoring %s", name);
+	}
+}
+
+/* Register the sources and sinks for readiness notifications */
+static void
+wait_init(struct source_info *ifiles, struct sink_info *ofiles, int max_fd)
 {
 	struct sink_info *ofp;
 	struct source_info *ifp;
-	size_t written = 0;
+	struct wait_fd *wf;
+	int n = 0;
 
-	for (ifp = ifiles; ifp; ifp = ifp->next) {
-		ifp->read_min_pos = ifp->source_pos_read;
-		ifp->is_read = false;
+	selection_init(ifiles, ofiles);
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		n++;
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		n++;
+	if ((wait_fds = calloc(n, sizeof(struct wait_fd))) == NULL ||
+	    (ready_list = malloc(n * sizeof(struct wait_fd *))) == NULL)
+		err(1, NULL);
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(2, "epoll_create1");
+	wf = wait_fds;
+	for (ifp = ifiles; ifp; ifp = ifp->next, wf++) {
+		wf->ifp = ifp;
+		wf->ready = &ifp->ready;
+		epoll_add(wf, ifp->fd, EPOLLIN, fp_name(ifp));
 	}
+	for (ofp = ofiles; ofp; ofp = ofp->next, wf++) {
+		wf->ofp = ofp;
+		wf->ready = &ofp->ready;
+		epoll_add(wf, ofp->fd, EPOLLOUT, fp_name(ofp));
+	}
+}
 
-	allocate_data_to_sinks(sink_fds, ofiles);
-	for (ofp = ofiles; ofp; ofp = ofp->next) {
-		DPRINTF(4, "\n%s(): try write to file %s", __func__, fp_name(ofp));
-		if (ofp->active && FD_ISSET(ofp->fd, sink_fds)) {
-			int n;
-			struct io_buffer b;
-
-			b = sink_buffer(ofp);
-			DPRINTF(4, "\n%s(): sink buffer returned %d bytes to write",
-					__func__, (int)b.size);
-			if (b.size == 0)
-				/* Can happen when a line spans a buffer */
-				n = 0;
-			else {
-				n = write(ofp->fd, b.p, b.size);
-				if (n < 0)
-					switch (errno) {
-					/* EPIPE is acceptable, for the sink's reader can terminate early. */
-					case EPIPE:
-						ofp->active = false;
-						(void)close(ofp->fd);
-						DPRINTF(4, "EPIPE for %s", fp_name(ofp));
-						break;
-					case EAGAIN:
-						DPRINTF(4, "EAGAIN for %s", fp_name(ofp));
-						n = 0;
-						break;
-					default:
-						err(2, "Error writing to %s", fp_name(ofp));
-					}
-				else {
-					ofp->pos_written += n;
-					written += n;
-				}
-			}
-			DPRINTF(4, "Wrote %d out of %zu bytes for file %s pos_written=%lu data=[%.*s]",
-				n, b.size, fp_name(ofp), (unsigned long)ofp->pos_written, (int)n * DATA_DUMP, (char *)b.p);
+/*
+ * Set the selected field of the listed sources and sinks that we want
+ * to access in the specified state and are ready for I/O.
+ * Those no longer ready, and those we will never access again,
+ * are removed from the list.
+ * Return the number of selected file descriptors.
+ */
+static int
+select_ready(enum state state)
+{
+	struct wait_fd *wf;
+	int i;
+
+	selection_clear();
+	for (i = 0; i < ready_n;) {
+		wf = ready_list[i];
+		if (!*wf->ready || (wf->ifp && wf->ifp->reached_eof) ||
+		    (wf->ofp && !wf->ofp->active)) {
+			wf->listed = false;
+			ready_list[i] = ready_list[--ready_n];
+			continue;
 		}
-		if (ofp->active) {
-			ofp->ifp->read_min_pos = MIN(ofp->ifp->read_min_pos, ofp->pos_written);
-			ofp->ifp->is_read = true;
+		if (wf->ifp) {
+			wf->ifp->wanted = source_wanted(wf->ifp, state);
+			source_select(wf->ifp);
+		} else {
+			wf->ofp->wanted = sink_wanted(wf->ofp, state);
+			sink_select(wf->ofp);
 		}
+		i++;
 	}
-
-	/* Free buffers all sinks have read */
-	for (ifp = ifiles; ifp; ifp = ifp->next) {
-		memory_free(ifp->bp, ifp->read_min_pos);
-		/*
-		 * We are reading this source, so don't even think freeing
-		 * sources after this.
-		 */
-		if (ifp->is_read)
-			break;
-	}
-
-	DPRINTF(4, "Wrote %zu total bytes", written);
-	return written;
+	return selected_sources_n + selected_sinks_n;
 }
 
+/*
+ * Block until at least one of the sources or sinks we want to access
+ * in the specified state is ready for I/O and set their selected field.
+ * If timeout is not -1, return after the specified number of
+ * milliseconds, even if no file descriptor is ready.
+ */
 static void
-usage(const char *name)
+wait_for_io(struct source_info *ifiles, struct sink_info *ofiles, int max_fd, enum state state, int timeout)
 {
-	fprintf(stderr, "Usage %s [-b size] [-i file] [-IMs] [-o file] [-m size] [-t char]\n"
-		"-a"		"\tOpen output file(s) for appending\n"
-		"-b size"	"\tSpecify the size of the buffer to use (used for stress testing)\n"
-		"-f"		"\tOverflow buffered data into a temporary file\n"
-		"-I"		"\tInput-side buffering\n"
-		"-i file"	"\tGather input from specified file\n"
-		"-m size[k|M|G]""\tSpecify the maximum buffer memory size\n"
-		"-M"		"\tProvide memory use statistics on termination\n"
-		"-o file"	"\tScatter output to specified file\n"
-		"-p d1[,d2...]"	"\tPermute inputs to specified outputs\n"
-		"-s"		"\tScatter the input across the files, rather than copying it to all\n"
-		"-T dir"	"\tSpecify directory for storing temporary file\n"
-		"-t char"	"\tProcess char-terminated records (newline default)\n",
-		name);
-	exit(1);
-}
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+	/* Only poll for more events, if we can already perform I/O. */
+	bool block = select_ready(state) == 0;
 
-/*
- * Set the specified file descriptor to operate in non-blocking
- * mode.
- * It seems that even if select returns for a specified file
- * descriptor, performing I/O to it may block depending on the
- * amount of data specified.
- * See See http://pubs.opengroup.org/onlinepubs/009695399/functions/write.html#tag_03_866
- */
+	for (;;) {
+		if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, block ? timeout : 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(3, "epoll_wait");
+		}
+		for (i = 0; i < n; i++)
+			ready_add(events[i].data.ptr);
+		/* Readiness of descriptors we don't currently want is retained. */
+		if (select_ready(state) > 0 || (n == 0 && block))
+			return;
+		block = true;
+	}
+}
+#else
+/* Verify that all file descriptors can be handled by select(2) */
 static void
-non_block(int fd, const char *name)
+wait_init(struct source_info *ifiles, struct sink_info *ofiles, int max_fd)
 {
-	int flags = fcntl(fd, F_GETFL, 0);
-	if (flags < 0)
-		err(2, "Error getting flags for %s", name);
-	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
-		err(2, "Error setting %s to non-blocking mode", name);
+	if (max_fd >= FD_SETSIZE)
+		errx(2, "File descriptor %d exceeds the select(2) limit of %d",
+			max_fd, FD_SETSIZE);
+	selection_init(ifiles, ofiles);
 }
 
 /*
- * Show the arguments passed to select(2) in human-readable form
- * If check is true, abort the program if no bit is on
+ * Block until at least one of the sources or sinks we want to access
+ * in the specified state is ready for I/O and set their selected field.
+ * If timeout is not -1, return after the specified number of
+ * milliseconds, even if no file descriptor is ready.
  */
 static void
-show_select_args(const char *msg, fd_set *source_fds, struct source_info *ifiles, fd_set *sink_fds, struct sink_info *ofiles, bool check)
+wait_for_io(struct source_info *ifiles, struct sink_info *ofiles, int max_fd, enum state state, int timeout)
 {
-	#ifdef DEBUG
+	fd_set source_fds;
+	fd_set sink_fds;
 	struct sink_info *ofp;
 	struct source_info *ifp;
-	int nbits = 0;
+	struct timeval tv;
 
-	fprintf(stderr, "%s: ", msg);
+	FD_ZERO(&source_fds);
+	FD_ZERO(&sink_fds);
 	for (ifp = ifiles; ifp; ifp = ifp->next)
-		if (FD_ISSET(ifp->fd, source_fds)) {
-			fprintf(stderr, "%s ", fp_name(ifp));
-			nbits++;
-		}
+		if ((ifp->wanted = source_wanted(ifp, state)))
+			FD_SET(ifp->fd, &source_fds);
 	for (ofp = ofiles; ofp; ofp = ofp->next)
-		if (FD_ISSET(ofp->fd, sink_fds)) {
-			fprintf(stderr, "%s ", fp_name(ofp));
-			nbits++;
-		}
-	fputc('\n', stderr);
-	if (check && nbits == 0)
-		abort();
-	#endif
+		if ((ofp->wanted = sink_wanted(ofp, state)))
+			FD_SET(ofp->fd, &sink_fds);
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = timeout % 1000 * 1000;
+	if (select(max_fd + 1, &source_fds, &sink_fds, NULL, timeout == -1 ? NULL : &tv) < 0)
+		err(3, "select");
+
+	selection_clear();
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		ifp->ready = ifp->wanted && FD_ISSET(ifp->fd, &source_fds);
+		source_select(ifp);
+	}
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		ofp->ready = ofp->wanted && FD_ISSET(ofp->fd, &sink_fds);
+		sink_select(ofp);
+	}
 }
+#endif
 
 static void
 show_state(enum state state)
@@ -948,6 +3458,67 @@ parse_size(const char *progname, const char *opt)
 	return 0;
 }
 
+/*
+ * Parse and validate a byte range of the form N, N-, -M, or N-M
+ * (as in cut -c), setting the variables key_begin and key_end.
+ */
+static void
+parse_key_range(const char *s)
+{
+	unsigned long begin = 1, end = 0;
+	const char *p = s;
+	char *e;
+
+	if (isdigit((unsigned char)*p)) {
+		end = begin = strtoul(p, &e, 10);
+		p = e;
+	}
+	if (*p == '-') {
+		end = 0;
+		if (isdigit((unsigned char)*++p)) {
+			end = strtoul(p, &e, 10);
+			p = e;
+		}
+	}
+	if (p == s || *p != '\0' || begin == 0 || (end && end < begin))
+		errx(1, "Illegal key byte range [%s]", s);
+	key_begin = begin - 1;
+	key_end = end;
+}
+
+/*
+ * Parse and record an output's policy specified as
+ * output:policy[:size] (e.g. 2:drop:64k).
+ */
+static void
+parse_policy(const char *progname, char *s)
+{
+	struct output_policy *op;
+	char *p, *policy;
+
+	if ((output_policies = realloc(output_policies,
+	    (output_policies_n + 1) * sizeof(struct output_policy))) == NULL)
+		err(1, NULL);
+	op = &output_policies[output_policies_n++];
+	op->output = strtol(s, &p, 10) - 1;
+	if (op->output < 0 || *p != ':')
+		errx(1, "Illegal output policy [%s]", s);
+	policy = p + 1;
+	if ((p = strchr(policy, ':')) != NULL)
+		*p++ = '\0';
+	op->cap = p ? parse_size(progname, p) : 0;
+	if (strcmp(policy, "block") == 0) {
+		if (op->cap)
+			errx(1, "The block output policy cannot have a size");
+		op->policy = sp_block;
+	} else if (strcmp(policy, "spill") == 0)
+		op->policy = sp_spill;
+	else if (strcmp(policy, "drop") == 0)
+		op->policy = sp_drop;
+	else
+		errx(1, "Illegal output policy [%s]", s);
+}
+
 /*
  * Parse and validate a comma-separated list of integers setting the
  * variables permute_dest and permute_n.
@@ -1015,7 +3586,95 @@ memory_stats(struct source_info *ifiles)
 			ifp->bp->buffers_allocated, ifp->bp->buffers_freed, ifp->bp->max_buffers_allocated);
 		fprintf(stderr, "Page out: %d In: %d Pages freed: %d\n",
 			ifp->bp->buffers_paged_out, ifp->bp->buffers_paged_in, ifp->bp->pages_freed);
+		fprintf(stderr, "Buffers reused: %d\n", ifp->bp->buffers_reused);
+		if (ifp->bp->map_fd != -1)
+			fprintf(stderr, "Mapped from file: %ld bytes\n", (long)ifp->bp->map_size);
+		if (opt_compress)
+			fprintf(stderr, "Compressed: %d (%lu to %lu bytes) Decompressed: %d\n",
+				ifp->bp->buffers_compressed, ifp->bp->compressed_in,
+				ifp->bp->compressed_out, ifp->bp->buffers_decompressed);
+	}
+}
+
+/* Output the specified string as a JSON string literal */
+static void
+json_string(FILE *f, const char *s)
+{
+	putc('"', f);
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < ' ')
+			fprintf(f, "\\u%04x", (unsigned char)*s);
+		else
+			putc(*s, f);
+	putc('"', f);
+}
+
+/*
+ * Write the sources' and sinks' statistics as a JSON object
+ * to the statistics file, if it is time to do so or if forced.
+ * The file is replaced atomically, so that it can be read anytime.
+ */
+static void
+stats_write(struct source_info *ifiles, struct sink_info *ofiles, bool force)
+{
+	static struct timespec start, next;
+	static char *tmp_path;
+	struct timespec now;
+	struct source_info *ifp;
+	struct sink_info *ofp;
+	struct buffer_pool *bp;
+	FILE *f;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (tmp_path == NULL) {
+		start = next = now;
+		if (asprintf(&tmp_path, "%s.tmp", stats_path) == -1)
+			err(1, NULL);
+	}
+	if (!force && time_diff(&next, &now) > 0)
+		return;
+	next.tv_sec = now.tv_sec + STATS_INTERVAL_MS / 1000;
+	next.tv_nsec = now.tv_nsec;
+
+	if ((f = fopen(tmp_path, "w")) == NULL)
+		err(1, "Unable to create statistics file %s", tmp_path);
+	fprintf(f, "{\n  \"time\": %.3f,\n  \"memory_limit\": %lu,\n  \"sources\": [",
+		time_diff(&now, &start), max_mem);
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		bp = ifp->bp;
+		fprintf(f, "%s\n    {\"name\": ", ifp == ifiles ? "" : ",");
+		json_string(f, fp_name(ifp));
+		fprintf(f, ", \"bytes_read\": %lld, \"eof\": %s, "
+			"\"memory\": %lu, \"buffers_allocated\": %d, \"buffers_freed\": %d, "
+			"\"max_buffers_allocated\": %d, \"buffers_paged_out\": %d, "
+			"\"buffers_paged_in\": %d, \"compressed_bytes\": %lu, "
+			"\"stall_time\": %.3f}",
+			(long long)ifp->bytes_read, ifp->reached_eof ? "true" : "false",
+			(unsigned long)(bp->buffers_allocated - bp->buffers_freed) * buffer_size +
+			bp->compressed_bytes, bp->buffers_allocated, bp->buffers_freed,
+			bp->max_buffers_allocated, bp->buffers_paged_out,
+			bp->buffers_paged_in, bp->compressed_bytes,
+			stall_time(&ifp->stall, &now));
 	}
+	fprintf(f, "\n  ],\n  \"sinks\": [");
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		fprintf(f, "%s\n    {\"name\": ", ofp == ofiles ? "" : ",");
+		json_string(f, fp_name(ofp));
+		fprintf(f, ", \"bytes_written\": %lld, \"lag\": %lld, \"active\": %s, "
+			"\"dropped\": %lld, \"stall_time\": %.3f}",
+			(long long)ofp->bytes_written,
+			(long long)(sink_data_end(ofp) - ofp->pos_written +
+			ofp->stash_len - ofp->stash_written),
+			ofp->active ? "true" : "false", (long long)ofp->dropped,
+			stall_time(&ofp->stall, &now));
+	}
+	fprintf(f, "\n  ]\n}\n");
+	if (fclose(f) == EOF)
+		err(1, "Error writing statistics file %s", tmp_path);
+	if (rename(tmp_path, stats_path) == -1)
+		err(1, "Unable to rename %s to %s", tmp_path, stats_path);
 }
 
 /*
@@ -1201,10 +3860,13 @@ main(int argc, char *argv[])
 	int ch;
 	const char *progname = argv[0];
 	enum state state = read_ob;
+	int timeout;
 	bool opt_memory_stats = false;
 	bool opt_append = false;
+	bool opt_key_range = false;
+	bool eof_visited = false;	/* True once all sinks were checked at the end of input */
 
-	while ((ch = getopt(argc, argv, "ab:fIi:Mm:o:p:S:sTt:")) != -1) {
+	while ((ch = getopt(argc, argv, "ab:Cc:d:FfHIi:k:l:Mm:O:o:Pp:R:rS:sT:t:UVwZz")) != -1) {
 		switch (ch) {
 		case 'a':
 			opt_append = true;
@@ -1212,9 +3874,27 @@ main(int argc, char *argv[])
 		case 'b':
 			buffer_size = (int)parse_size(progname, optarg);
 			break;
+		case 'C':
+			opt_compress = true;
+			break;
+		case 'c':
+			parse_key_range(optarg);
+			opt_partition = opt_scatter = opt_key_range = true;
+			break;
+		case 'd':
+			if (strlen(optarg) != 1)
+				usage(progname);
+			key_delim = *optarg;
+			break;
+		case 'F':
+			opt_mmap_spill = true;
+			/* FALLTHROUGH */
 		case 'f':
 			use_tmp_file = true;
 			break;
+		case 'H':
+			opt_huge_pages = true;
+			break;
 		case 'I':
 			state = read_ib;
 			break;
@@ -1229,12 +3909,24 @@ main(int argc, char *argv[])
 			*iend = ifp;
 			iend = &ifp->next;
 			break;
+		case 'k':
+			if ((key_field = atoi(optarg)) <= 0)
+				errx(1, "Illegal key field number [%s]", optarg);
+			opt_partition = opt_scatter = true;
+			break;
+		case 'l':
+			if ((block_len = parse_size(progname, optarg)) == 0)
+				usage(progname);
+			break;
 		case 'm':
 			max_mem = parse_size(progname, optarg);
 			break;
 		case 'M':	/* Provide memory use statistics on termination */
 			opt_memory_stats = true;
 			break;
+		case 'O':
+			parse_policy(progname, optarg);
+			break;
 		case 'o':	/* Specify output file */
 			ofp = new_sink_info(optarg);
 			if ((ofp->fd = open(optarg,
@@ -1247,9 +3939,22 @@ main(int argc, char *argv[])
 			*oend = ofp;
 			oend = &ofp->next;
 			break;
+		case 'P':
+			opt_threads = true;
+			break;
 		case 'p':
 			parse_permute(optarg);
 			break;
+		case 'R':
+			if ((ordered_chunk = atoi(optarg)) <= 0)
+				errx(1, "Illegal number of records per chunk [%s]", optarg);
+			break;
+		case 'r':
+			opt_ring = true;
+			break;
+		case 'S':
+			stats_path = optarg;
+			break;
 		case 's':
 			opt_scatter = true;
 			break;
@@ -1262,6 +3967,22 @@ main(int argc, char *argv[])
 				usage(progname);
 			rt = *optarg;
 			break;
+		case 'U':
+			opt_uring = true;
+			use_tmp_file = true;
+			break;
+		case 'V':
+			opt_vmsplice = true;
+			break;
+		case 'w':
+			opt_weighted = opt_scatter = true;
+			break;
+		case 'Z':
+			opt_map = true;
+			break;
+		case 'z':
+			opt_zero_copy = true;
+			break;
 		case '?':
 		default:
 			usage(progname);
@@ -1274,7 +3995,7 @@ main(int argc, char *argv[])
 		usage(progname);
 
 	/* dgsh */
-	int j = 0;
+	int i, j = 0;
 	int noutputfds;
 	int *outputfds;
 	int ninputfds;
@@ -1357,9 +4078,53 @@ main(int argc, char *argv[])
 	if (opt_scatter && ifiles && ifiles->next)
 		errx(1, "Scattering not supported with more than one input file");
 
+	if (key_field && opt_key_range)
+		errx(1, "A key can be specified either as a field or as a byte range");
+
+	if (opt_partition && opt_weighted)
+		errx(1, "Partitioning and weighted scattering cannot be used together");
+
+	if (ordered_chunk && (opt_partition || opt_weighted))
+		errx(1, "Ordered chunks cannot be partitioned or weighted");
+
 	if (opt_scatter && permute_n)
 		errx(1, "Scattering and permutation cannot be used together");
 
+	if (opt_mmap_spill && buffer_size % sysconf(_SC_PAGESIZE))
+		errx(1, "Buffer size %d is not a multiple of the page size %ld", buffer_size, sysconf(_SC_PAGESIZE));
+
+	if (opt_huge_pages && (opt_mmap_spill || opt_ring))
+		errx(1, "Huge pages can only be used for allocated buffers");
+
+	if (opt_huge_pages && buffer_size % sysconf(_SC_PAGESIZE))
+		errx(1, "Buffer size %d is not a multiple of the page size %ld", buffer_size, sysconf(_SC_PAGESIZE));
+
+	if (opt_compress && (opt_mmap_spill || opt_uring || opt_ring))
+		errx(1, "Compression can only be used with in-memory buffers or a -f temporary file");
+
+	if (opt_uring && opt_mmap_spill)
+		errx(1, "Asynchronous I/O and a memory-mapped temporary file cannot be used together");
+
+	if (opt_ring && use_tmp_file)
+		errx(1, "A ring buffer and a temporary file cannot be used together");
+
+	if (opt_map && (use_tmp_file || opt_mmap_spill || opt_compress || opt_ring || opt_threads))
+		errx(1, "Input files can only be mapped when buffering data in memory");
+
+	if (stats_path && opt_threads)
+		errx(1, "Statistics are not available with threads");
+
+	if (output_policies_n && (opt_scatter || ordered_chunk || opt_threads ||
+	    opt_zero_copy || opt_vmsplice))
+		errx(1, "Output policies can only be used when copying data through buffers");
+
+	if (opt_threads && (opt_scatter || permute_n || ordered_chunk || (ifiles && ifiles->next)))
+		errx(1, "Threads can only be used for copying a single input to the outputs");
+
+	if (opt_threads && (use_tmp_file || opt_mmap_spill || opt_compress || opt_uring ||
+	    opt_ring || opt_zero_copy || opt_vmsplice))
+		errx(1, "Threads can only be used with in-memory buffers");
+
 	if (ofiles == NULL) {
 		/* Output to stdout */
 		ofp = new_sink_info("standard output");
@@ -1380,65 +4145,106 @@ main(int argc, char *argv[])
 		ifiles = ifp;
 	}
 
+	if (opt_ring)
+		for (ifp = ifiles; ifp; ifp = ifp->next)
+			rings_pending++;
+
+	/* Apply the output policies. */
+	for (j = 0; j < output_policies_n; j++) {
+		for (ofp = ofiles, i = 0; ofp && i < output_policies[j].output; ofp = ofp->next)
+			i++;
+		if (ofp == NULL)
+			errx(1, "Unspecified output %d", output_policies[j].output + 1);
+		ofp->policy = output_policies[j].policy;
+		ofp->cap = output_policies[j].cap ? output_policies[j].cap : (size_t)buffer_size;
+	}
+
+	/* Ordered chunks are scattered from a single input or gathered from many. */
+	if (ordered_chunk && ifiles->next) {
+		if (opt_scatter || permute_n)
+			errx(1, "Ordered gathering cannot be combined with scattering or permutation");
+		if (ofiles->next)
+			errx(1, "Ordered gathering requires a single output");
+		gather_sources = ifiles;
+	} else if (ordered_chunk)
+		opt_scatter = true;
+
+	/* Regular files are written to the sinks from their mapping. */
+	if (opt_map) {
+		struct sigaction sa;
+
+		for (ifp = ifiles; ifp; ifp = ifp->next)
+			map_setup(ifp);
+		map_sources = ifiles;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = map_sigbus;
+		sa.sa_flags = SA_SIGINFO;
+		if (sigaction(SIGBUS, &sa, NULL) == -1)
+			err(1, "sigaction");
+	}
+
 	/* We will handle SIGPIPE explicitly when calling write(2). */
 	signal(SIGPIPE, SIG_IGN);
 
 	front_ifp = ifiles;
 	chain_io_files(ifiles, ofiles, permute_n != 0);
+	/* Read all gathered sources, for their producers may block. */
+	if (gather_sources)
+		for (ifp = ifiles; ifp; ifp = ifp->next)
+			ifp->active = true;
+	/* Read ahead the input following each active chained one. */
+	else if (state == read_ob && !opt_threads)
+		for (ifp = ifiles; ifp; ifp = ifp->next)
+			if (ifp->active && !ifp->chain_last)
+				source_prefetch(ifp);
+
+	if (opt_threads) {
+		threads_copy(ifiles, ofiles, state == read_ib);
+		if (opt_memory_stats)
+			memory_stats(ifiles);
+		return 0;
+	}
+	wait_init(ifiles, ofiles, max_fd);
 
-	/* Copy source to sink without allowing any single file to block us. */
-	for (;;) {
-		fd_set source_fds;
-		fd_set sink_fds;
+	if (opt_zero_copy && !zero_copy_setup(ifiles, ofiles)) {
+		DPRINTF(3, "Zero-copy broadcasting not possible");
+		opt_zero_copy = false;
+	}
 
-		show_state(state);
-		/* Set the fd's we're interested to read/write; close unneeded ones. */
-		FD_ZERO(&source_fds);
-		FD_ZERO(&sink_fds);
-
-		if (!reached_eof)
-			switch (state) {
-			case read_ib:
-				for (ifp = front_ifp; ifp; ifp = ifp->next)
-					if (!ifp->reached_eof)
-						FD_SET(ifp->fd, &source_fds);
-				break;
-			case read_ob:
-				for (ifp = front_ifp; ifp; ifp = ifp->next)
-					if (ifp->active && !ifp->reached_eof)
-						FD_SET(ifp->fd, &source_fds);
-				break;
-			default:
-				break;
-			}
+	if (opt_weighted)
+		rate_setup(ofiles);
 
-		for (ofp = ofiles; ofp; ofp = ofp->next)
-			if (ofp->active) {
-				switch (state) {
-				case read_ib:
-				case read_ob:
-				case drain_ob:
-					DPRINTF(4, "Check active file[%s] pos_written=%ld pos_to_write=%ld",
-						fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write);
-					if (ofp->pos_written < ofp->pos_to_write)
-						FD_SET(ofp->fd, &sink_fds);
-					break;
-				case drain_ib:
-				case write_ob:
-					FD_SET(ofp->fd, &sink_fds);
-					break;
-				}
-			}
+	if (opt_vmsplice && !vmsplice_setup(ifiles, ofiles)) {
+		DPRINTF(3, "Mapping of buffer pages not possible");
+		opt_vmsplice = false;
+	}
 
+	if (!opt_scatter && !gather_sources && !opt_vmsplice && ifiles->next == NULL) {
+		use_sink_heap = true;
+		sink_heap_build(ofiles);
+	}
+
+	/* Copy source to sink without allowing any single file to block us. */
+	for (;;) {
+		show_state(state);
+		/*
+		 * Pages mapped into pipes are released without a notification,
+		 * so poll for their release while waiting for buffer memory.
+		 */
+		timeout = state == drain_ob && opt_vmsplice ? VMSPLICE_POLL_MS : -1;
+		/* Wake up periodically for updating the statistics. */
+		if (stats_path && timeout == -1)
+			timeout = STATS_INTERVAL_MS;
 
 		/* Block until we can read or write. */
-		show_select_args("Entering select", &source_fds, ifiles, &sink_fds, ofiles, true);
-		if (select(max_fd + 1, &source_fds, &sink_fds, NULL, NULL) < 0)
-			err(3, "select");
-		show_select_args("Select returned", &source_fds, ifiles, &sink_fds, ofiles, false);
+		show_wait_args("Entering wait", ifiles, ofiles, state, false, timeout == -1);
+		wait_for_io(ifiles, ofiles, max_fd, state, timeout);
+		show_wait_args("Wait returned", ifiles, ofiles, state, true, false);
+		if (stats_path)
+			stats_write(ifiles, ofiles, false);
 
 		/* Write to all file descriptors that accept writes. */
-		if (sink_write(ifiles, &sink_fds, ofiles) > 0) {
+		if (sink_write(ifiles, ofiles) > 0) {
 			/*
 			 * If we wrote something, we made progress on the
 			 * downstream end.  Loop without reading to avoid
@@ -1446,29 +4252,39 @@ main(int argc, char *argv[])
 			 */
 			if (state == drain_ob)
 				state = write_ob;
-			continue;
+			/* Terminate if the write retired the heap's last sinks. */
+			if (!use_sink_heap || !reached_eof || sink_heap_n)
+				continue;
 		}
 
 		if (reached_eof) {
 			int active_fds = 0;
 
-			for (ofp = ofiles; ofp; ofp = ofp->next)
-				if (ofp->active) {
-					if (ofp->pos_written < ofp->pos_to_write)
-						active_fds++;
-					else {
-						DPRINTF(3, "Retiring file %s pos_written=pos_to_write=%ld source_pos_read=%ld",
-							fp_name(ofp), (long)ofp->pos_written, (long)ofp->ifp->source_pos_read);
-						/* No more data to write; close fd to avoid deadlocks downstream. */
-						if (close(ofp->fd) == -1)
-							err(2, "Error closing %s", fp_name(ofp));
-						ofp->active = false;
+			/*
+			 * Sinks in the heap that complete their writes
+			 * after the end of input are retired by sink_write(),
+			 * so the others need only be visited once.
+			 */
+			if (use_sink_heap && eof_visited)
+				active_fds = sink_heap_n;
+			else
+				for (ofp = ofiles; ofp; ofp = ofp->next)
+					if (ofp->active) {
+						/* Unpartitioned records may still be routed to the sink. */
+						if (ofp->pos_written < sink_data_end(ofp) || ofp->stash_len ||
+						    (opt_partition && partition_pos < ofp->ifp->source_pos_read) ||
+						    (ordered_chunk && opt_scatter && ordered_pos < ofp->ifp->source_pos_read))
+							active_fds++;
+						else
+							sink_retire(ofp);
 					}
-				}
+			eof_visited = true;
 			if (active_fds == 0) {
 				/* If no read possible, and no writes pending, terminate. */
 				if (opt_memory_stats)
 					memory_stats(ifiles);
+				if (stats_path)
+					stats_write(ifiles, ofiles, true);
 				return 0;
 			}
 		}
@@ -1482,8 +4298,8 @@ main(int argc, char *argv[])
 			/* Read, if possible; set global reached_eof if all have reached it */
 			reached_eof = true;
 			for (ifp = front_ifp; ifp; ifp = ifp->next) {
-				if (FD_ISSET(ifp->fd, &source_fds))
-					switch (source_read(ifp)) {
+				if (ifp->selected)
+					switch (opt_zero_copy ? zero_copy_read(ifp, ofiles) : source_read(ifp)) {
 					case read_eof:
 						ifp->reached_eof = true;
 						break;
@@ -1504,20 +4320,29 @@ main(int argc, char *argv[])
 			/* Read, from possible sources; set global reached_eof if all have reached it */
 			reached_eof = true;
 			for (ifp = front_ifp; ifp; ifp = ifp->next) {
-				if (!ifp->active)
+				if (!ifp->active && !ifp->prefetch)
 					continue;
-				if (FD_ISSET(ifp->fd, &source_fds))
-					switch (source_read(ifp)) {
+				if (ifp->selected)
+					switch (opt_zero_copy ? zero_copy_read(ifp, ofiles) : source_read(ifp)) {
 					case read_eof:
 						ifp->reached_eof = true;
+						if (!ifp->active)
+							break;
 						ifp->active = false;
 						if (!ifp->chain_last)
-							ifp->next->active = true;
+							source_activate(ifp->next);
 						break;
 					case read_again:
 						break;
-					case read_oom:	/* Allow buffers to empty. */
-						state = drain_ob;
+					case read_oom:
+						/*
+						 * A source read ahead of its chain or of
+						 * an ordered gather waits until reached.
+						 */
+						if (!ifp->active || (gather_sources && ifp != ofiles->ifp))
+							ifp->full = true;
+						else	/* Allow buffers to empty. */
+							state = drain_ob;
 						break;
 					case read_ok:
 						state = write_ob;
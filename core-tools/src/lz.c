@@ -0,0 +1,203 @@
+/*
+ * Copyright 2026 agent
+ *
+ * Fast LZ77 block compression in the LZ4 block format.
+ * Sequences consist of a token holding the literal and match lengths,
+ * the literal bytes, and a 16-bit backward offset of the match.
+ * Matches are found through a hash table of four-byte sequences.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_LOG	12		/* Entries in the match finder table */
+#define MIN_MATCH	4		/* Shortest match length */
+#define LAST_LITERALS	5		/* Trailing bytes that are always literals */
+#define MF_LIMIT	12		/* No match starts within these final bytes */
+#define MAX_OFFSET	65535		/* Farthest match distance */
+#define SKIP_TRIGGER	6		/* Speed up after 2^this unmatched bytes */
+
+static uint32_t
+read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned
+hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Return the space needed for a length field's extension bytes */
+static size_t
+ext_size(size_t len)
+{
+	return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+/* Write the extension bytes of a length field that exceeds 14 */
+static unsigned char *
+put_ext(unsigned char *op, size_t len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/*
+ * Emit a sequence of the literals [anchor, anchor + lit) followed,
+ * when offset is non-zero, by a match of mlen bytes.
+ * Return the new output position, or NULL if it would exceed oend.
+ */
+static unsigned char *
+put_sequence(unsigned char *op, unsigned char *oend,
+		const unsigned char *anchor, size_t lit,
+		size_t offset, size_t mlen)
+{
+	unsigned char *token;
+	size_t need;
+
+	need = 1 + ext_size(lit) + lit;
+	if (offset)
+		need += 2 + ext_size(mlen - MIN_MATCH);
+	if (need > (size_t)(oend - op))
+		return NULL;
+
+	token = op++;
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = put_ext(op, lit);
+	memcpy(op, anchor, lit);
+	op += lit;
+	if (offset) {
+		mlen -= MIN_MATCH;
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		*token |= mlen < 15 ? mlen : 15;
+		if (mlen >= 15)
+			op = put_ext(op, mlen);
+	}
+	return op;
+}
+
+size_t
+lz_compress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const unsigned char *base = src, *ip = base, *anchor = base;
+	const unsigned char *end = base + n;
+	const unsigned char *mflimit = end - MF_LIMIT;
+	const unsigned char *matchlimit = end - LAST_LITERALS;
+	unsigned char *op = dst, *oend = op + cap;
+	uint32_t table[1 << HASH_LOG];
+
+	if (n > MF_LIMIT) {
+		memset(table, 0, sizeof(table));
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			unsigned h = hash(seq);
+			const unsigned char *ref = base + table[h];
+			const unsigned char *p, *r;
+
+			table[h] = ip - base;
+			if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+				/* Move faster over incompressible data */
+				ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+				continue;
+			}
+			/* Extend the match backward and forward */
+			while (ip > anchor && ref > base && ip[-1] == ref[-1])
+				ip--, ref--;
+			for (p = ip + MIN_MATCH, r = ref + MIN_MATCH; p < matchlimit && *p == *r; p++, r++)
+				;
+			if ((op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, p - ip)) == NULL)
+				return 0;
+			anchor = ip = p;
+		}
+	}
+	if ((op = put_sequence(op, oend, anchor, end - anchor, 0, 0)) == NULL)
+		return 0;
+	return op - (unsigned char *)dst;
+}
+
+/* Read the extension bytes of a length field */
+static int
+get_ext(const unsigned char **ipp, const unsigned char *iend, size_t *len)
+{
+	unsigned char b;
+
+	do {
+		if (*ipp >= iend)
+			return -1;
+		b = *(*ipp)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+size_t
+lz_decompress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const unsigned char *ip = src, *iend = ip + n;
+	unsigned char *op = dst, *oend = op + cap;
+	const unsigned char *ref;
+	size_t lit, mlen, offset;
+	unsigned token;
+
+	while (ip < iend) {
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15 && get_ext(&ip, iend, &lit) < 0)
+			return (size_t)-1;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return (size_t)-1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		/* The last sequence consists only of literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return (size_t)-1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst))
+			return (size_t)-1;
+		mlen = token & 15;
+		if (mlen == 15 && get_ext(&ip, iend, &mlen) < 0)
+			return (size_t)-1;
+		mlen += MIN_MATCH;
+		if (mlen > (size_t)(oend - op))
+			return (size_t)-1;
+		ref = op - offset;
+		if (offset >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else
+			/* Overlapping copy replicates the data */
+			while (mlen--)
+				*op++ = *ref++;
+	}
+	return op - (unsigned char *)dst;
+}
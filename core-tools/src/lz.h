@@ -0,0 +1,37 @@
+/*
+ * Copyright 2026 agent
+ *
+ * Fast LZ77 block compression in the LZ4 block format
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/*
+ * Compress the n bytes at src into the cap bytes at dst.
+ * Return the compressed size, or 0 if it would exceed cap.
+ */
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+
+/*
+ * Decompress the n bytes at src into the cap bytes at dst.
+ * Return the decompressed size, or (size_t)-1 if the data are corrupt.
+ */
+size_t lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+#endif /* LZ_H */
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2026 agent
+ *
+ * Vectorized scanning of memory for a record terminator.
+ * SSE2 and AVX2 kernels are selected at runtime on x86 processors;
+ * other processors use a portable scalar implementation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stddef.h>
+
+#include "memscan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_fn)(const char *s, char c, size_t n);
+
+static const char *
+forward_scalar(const char *s, char c, size_t n)
+{
+	for (; n > 0; n--, s++)
+		if (*s == c)
+			return s;
+	return NULL;
+}
+
+static const char *
+backward_scalar(const char *s, char c, size_t n)
+{
+	while (n > 0)
+		if (s[--n] == c)
+			return s + n;
+	return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+static const char *
+forward_sse2(const char *s, char c, size_t n)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+	const char *p = s;
+
+	for (; n >= 16; n -= 16, p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	return forward_scalar(p, c, n);
+}
+
+static const char *
+backward_sse2(const char *s, char c, size_t n)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+
+	for (; n >= 16; n -= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + n - 16));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+
+		if (mask)
+			return s + n - 16 + (31 - __builtin_clz(mask));
+	}
+	return backward_scalar(s, c, n);
+}
+
+__attribute__((target("avx2")))
+static const char *
+forward_avx2(const char *s, char c, size_t n)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+	const char *p = s;
+
+	for (; n >= 32; n -= 32, p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	return forward_sse2(p, c, n);
+}
+
+__attribute__((target("avx2")))
+static const char *
+backward_avx2(const char *s, char c, size_t n)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+
+	for (; n >= 32; n -= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+
+		if (mask)
+			return s + n - 32 + (31 - __builtin_clz(mask));
+	}
+	return backward_sse2(s, c, n);
+}
+#endif
+
+static const char *select_forward(const char *s, char c, size_t n);
+static const char *select_backward(const char *s, char c, size_t n);
+
+/* The kernels in use; set on the first call */
+static scan_fn forward = select_forward;
+static scan_fn backward = select_backward;
+
+/* Set the kernels to the best ones supported by the processor */
+static void
+select_kernels(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		forward = forward_avx2;
+		backward = backward_avx2;
+	} else {
+		forward = forward_sse2;
+		backward = backward_sse2;
+	}
+#else
+	forward = forward_scalar;
+	backward = backward_scalar;
+#endif
+}
+
+static const char *
+select_forward(const char *s, char c, size_t n)
+{
+	select_kernels();
+	return forward(s, c, n);
+}
+
+static const char *
+select_backward(const char *s, char c, size_t n)
+{
+	select_kernels();
+	return backward(s, c, n);
+}
+
+const char *
+memscan_forward(const char *s, char c, size_t n)
+{
+	return forward(s, c, n);
+}
+
+const char *
+memscan_backward(const char *s, char c, size_t n)
+{
+	return backward(s, c, n);
+}
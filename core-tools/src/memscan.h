@@ -0,0 +1,37 @@
+/*
+ * Copyright 2026 agent
+ *
+ * Vectorized scanning of memory for a record terminator
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef MEMSCAN_H
+#define MEMSCAN_H
+
+#include <stddef.h>
+
+/*
+ * Return a pointer to the first occurrence of c in the n bytes
+ * starting at s, or NULL if c does not appear there (cf. memchr(3)).
+ */
+const char *memscan_forward(const char *s, char c, size_t n);
+
+/*
+ * Return a pointer to the last occurrence of c in the n bytes
+ * starting at s, or NULL if c does not appear there (cf. memrchr(3)).
+ */
+const char *memscan_backward(const char *s, char c, size_t n);
+
+#endif /* MEMSCAN_H */
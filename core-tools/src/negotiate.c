@@ -20,24 +20,19 @@
  *
  */
 
-#ifdef __linux__
-#  ifndef IOV_MAX		/* IOV_MAX LINUX */
-#    define IOV_MAX 1024
-#  endif
-#elif __APPLE__
-#include <limits.h>		/* IOV_MAX APPLE */
-#endif
-
 #include <assert.h>		/* assert() */
 #include <errno.h>		/* ENOBUFS */
 #include <err.h>		/* err() */
-#include <limits.h>		/* IOV_MAX */
+#include <fcntl.h>		/* fcntl() */
+#include <limits.h>		/* INT_MAX */
 #include <stdbool.h>		/* bool, true, false */
 #include <stdio.h>		/* fprintf() in DPRINTF() */
 #include <stdlib.h>		/* getenv(), errno, atexit() */
 #include <string.h>		/* memcpy() */
 #include <sysexits.h>		/* EX_PROTOCOL, EX_OK */
 #include <sys/socket.h>		/* sendmsg(), recvmsg() */
+#include <sys/stat.h>		/* fstat() */
+#include <sys/uio.h>		/* writev() */
 #include <unistd.h>		/* getpid(), getpagesize(),
 				 * STDIN_FILENO, STDOUT_FILENO,
 				 * STDERR_FILENO, alarm()
@@ -133,8 +128,8 @@ struct dgsh_node_pipe_fds {
  * Message block will be passed around process address spaces.
  * Message block contains a number of scalar fields and two pointers
  * to an array of dgsh nodes and edges respectively.
- * To pass the message block along with nodes and edges, three writes
- * in this order take place.
+ * To pass the message block along with nodes and edges, it is
+ * encoded into the compact wire format described at WIRE_VERSION.
  */
 
 /* The message block implicitly used by many functions */
@@ -153,6 +148,10 @@ int dgsh_debug_level = 0;
 
 static void get_environment_vars();
 static int dgsh_exit(int state, int flags);
+static int setup_file_descriptors(int *n_input_fds, int *n_output_fds,
+		int **input_fds, int **output_fds);
+STATIC enum op_result solution_cache_get(void);
+STATIC void solution_cache_put(void);
 
 /* Force the inclusion of the ELF note section */
 extern int dgsh_force_include;
@@ -1233,6 +1232,10 @@ solve_graph(void)
 	 * assign a node's available edges to adjacent nodes differently
 	 */
 
+	/* A run of the same graph may have already found its solution. */
+	if (solution_cache_get() == OP_SUCCESS)
+		goto solved;
+
 	/**
 	 * Try to match each node's I/O resources with constraints
 	 * expressed by incoming and outgoing edges.
@@ -1272,7 +1275,9 @@ solve_graph(void)
 	 */
 	if ((exit_state = prepare_solution()) == OP_ERROR)
 		goto exit;
+	solution_cache_put();
 
+solved:
 	if ((exit_state = calculate_conc_fds()) == OP_ERROR)
 		goto exit;
 
@@ -1311,14 +1316,17 @@ establish_io_connections(int **input_fds, int *n_input_fds, int **output_fds,
 		 * take the place of stdin.
 		 */
 		int fd_to_dup = self_pipe_fds.input_fds[0];
-		if (close(STDIN_FILENO) == -1)
-			err(1, "Close stdin failed");
-		if ((self_pipe_fds.input_fds[0] = dup(fd_to_dup)) == -1)
-			err(1, "dup failed with errno %d", errno);
-		DPRINTF(4, "%s(): closed STDIN, dup %d returned %d",
-				__func__,fd_to_dup, self_pipe_fds.input_fds[0]);
-		assert(self_pipe_fds.input_fds[0] == STDIN_FILENO);
-		close(fd_to_dup);
+		/* A launcher-provided descriptor may already be there. */
+		if (fd_to_dup != STDIN_FILENO) {
+			if (close(STDIN_FILENO) == -1)
+				err(1, "Close stdin failed");
+			if ((self_pipe_fds.input_fds[0] = dup(fd_to_dup)) == -1)
+				err(1, "dup failed with errno %d", errno);
+			DPRINTF(4, "%s(): closed STDIN, dup %d returned %d",
+					__func__,fd_to_dup, self_pipe_fds.input_fds[0]);
+			assert(self_pipe_fds.input_fds[0] == STDIN_FILENO);
+			close(fd_to_dup);
+		}
 
 		if (n_input_fds) {
 			*n_input_fds = self_pipe_fds.n_input_fds;
@@ -1339,14 +1347,17 @@ establish_io_connections(int **input_fds, int *n_input_fds, int **output_fds,
 		 * take the place of stdin.
 		 */
 		int fd_to_dup = self_pipe_fds.output_fds[0];
-		if (close(STDOUT_FILENO) == -1)
-			err(1, "Close stdout failed");
-		if ((self_pipe_fds.output_fds[0] = dup(fd_to_dup)) == -1)
-			err(1, "dup failed with errno %d", errno);
-		DPRINTF(4, "%s(): closed STDOUT, dup %d returned %d",
-				__func__,fd_to_dup,self_pipe_fds.output_fds[0]);
-		assert(self_pipe_fds.output_fds[0] == STDOUT_FILENO);
-		close(fd_to_dup);
+		/* A launcher-provided descriptor may already be there. */
+		if (fd_to_dup != STDOUT_FILENO) {
+			if (close(STDOUT_FILENO) == -1)
+				err(1, "Close stdout failed");
+			if ((self_pipe_fds.output_fds[0] = dup(fd_to_dup)) == -1)
+				err(1, "dup failed with errno %d", errno);
+			DPRINTF(4, "%s(): closed STDOUT, dup %d returned %d",
+					__func__,fd_to_dup,self_pipe_fds.output_fds[0]);
+			assert(self_pipe_fds.output_fds[0] == STDOUT_FILENO);
+			close(fd_to_dup);
+		}
 
 		if (n_output_fds) {
 			*n_output_fds = self_pipe_fds.n_output_fds;
@@ -1385,46 +1396,47 @@ write_output_fds(int output_socket, int *output_fds, int flags)
 	DPRINTF(4, "%s(): for node at index %d with %d outgoing edges.", __func__,
 				self_node.index, this_nc->n_edges_outgoing);
 	assert(this_nc->node_index == self_node.index);
-	int i;
+	int i, k;
 	int total_edge_instances = 0;
+	int *read_sides = NULL;
 	enum op_result re = OP_SUCCESS;
 
 	/**
-	 * Create a pipe for each instance of each outgoing edge connection.
-	 * Inject the pipe read side in the cont.
-	 * Send each pipe fd as a message to a socket descriptor,
-	 * that is write_fd, that has been
-	 * set up by the shell to support the dgsh negotiation phase.
+	 * Due to channel constraint flexibility,
+	 * each edge can have more than one instances.
 	 */
-	for (i = 0; i < this_nc->n_edges_outgoing; i++) {
-		int k;
-		/**
-		 * Due to channel constraint flexibility,
-		 * each edge can have more than one instances.
-		 */
-		for (k = 0; k < this_nc->edges_outgoing[i].instances; k++) {
-			int fd[2];
-			/* Create pipe, inject the read side to the msg control
-			 * data and close the read side to let the recipient
-			 * process handle it.
-			 */
-			if (pipe(fd) == -1) {
-				perror("pipe open failed");
-				dgsh_exit(-1, flags);
-			}
-			DPRINTF(4, "%s(): created pipe pair %d - %d. Transmitting fd %d through sendmsg().", __func__, fd[0], fd[1], fd[0]);
-
-			write_fd(output_socket, fd[0]);
-			close(fd[0]);
+	for (i = 0; i < this_nc->n_edges_outgoing; i++)
+		total_edge_instances += this_nc->edges_outgoing[i].instances;
+	if (total_edge_instances > 0 && (read_sides = (int *)malloc(
+				sizeof(int) * total_edge_instances)) == NULL) {
+		DPRINTF(4, "ERROR: Memory allocation of %d fds failed.",
+				total_edge_instances);
+		re = OP_ERROR;
+	}
 
-			output_fds[total_edge_instances] = fd[1];
-			total_edge_instances++;
+	/**
+	 * Create a pipe for each instance of each outgoing edge connection.
+	 * Send all the pipes' read sides in one batch
+	 * to a socket descriptor, that is write_fd, that has been
+	 * set up by the shell to support the dgsh negotiation phase,
+	 * and close them to let the recipient process handle them.
+	 */
+	for (k = 0; k < total_edge_instances && re == OP_SUCCESS; k++) {
+		int fd[2];
+		if (pipe(fd) == -1) {
+			perror("pipe open failed");
+			dgsh_exit(-1, flags);
 		}
-		/* XXX */
-		if (re == OP_ERROR)
-			break;
-	}
-	if (re == OP_ERROR) {
+		DPRINTF(4, "%s(): created pipe pair %d - %d. Transmitting fd %d through sendmsg().", __func__, fd[0], fd[1], fd[0]);
+		read_sides[k] = fd[0];
+		output_fds[k] = fd[1];
+	}
+	if (re == OP_SUCCESS) {
+		write_fd_array(output_socket, read_sides, total_edge_instances);
+		for (k = 0; k < total_edge_instances; k++)
+			close(read_sides[k]);
+		free(read_sides);
+	} else {
 		DPRINTF(4, "%s(): ERROR. Aborting.", __func__);
 		free_graph_solution(chosen_mb->n_nodes - 1);
 		free(self_pipe_fds.output_fds);
@@ -1432,180 +1444,330 @@ write_output_fds(int output_socket, int *output_fds, int flags)
 	return re;
 }
 
-static int
-write_piece (int write_fd, void *datastruct, int struct_size)
-{
-	int retries = 0, wsize;
-retry:
-	DPRINTF(4, "Try write struct of size: %d", struct_size);
-	wsize = write(write_fd, datastruct, struct_size);
-	if (wsize == -1 && errno == ENOBUFS && retries < 3) {	// sleep for 10ms
-		nanosleep((const struct timespec[]){{0, 10000000L}}, NULL);
-		retries++;
-		goto retry;
+/*
+ * Wire format of the message block.
+ * A message consists of a header, holding the format's version byte
+ * and the length of the following body as a 32-bit big-endian integer,
+ * and the body.
+ * The body's integers are unsigned LEB128 varints; signed ones are
+ * first zigzag-encoded, so that small negative values, such as -1,
+ * also take a single byte.
+ * The body holds in order:
+ * - the message block's scalar fields;
+ * - a table of the distinct tool names: their number, followed by
+ *   each name's length and bytes;
+ * - the nodes, each referring to its name by its table index;
+ * - the concentrators, each followed by its process ids;
+ * - in the negotiation state, the edges;
+ * - in the run state, the solution's node connections, each followed
+ *   by its incoming and outgoing edges.
+ */
+#define WIRE_VERSION 2
+#define WIRE_HEADER_SIZE 5
+
+/* Largest accepted message body; guards against corrupted headers */
+#define WIRE_MAX_BODY (64 * 1024 * 1024)
+
+/* Memory for encoding or decoding a message body */
+struct wire_buffer {
+	unsigned char *p;	/* Body data */
+	size_t len;		/* Length of the body data */
+	size_t pos;		/* Position of the next byte to decode */
+	size_t size;		/* Allocated size */
+	bool error;		/* Out of memory or malformed body */
+};
+
+/* Buffers reused across messages */
+static struct wire_buffer wire_out, wire_in;
+
+/* Ensure that the buffer can hold n more bytes */
+static bool
+wire_reserve(struct wire_buffer *wb, size_t n)
+{
+	unsigned char *p;
+	size_t size;
+
+	if (wb->len + n <= wb->size)
+		return true;
+	for (size = wb->size ? wb->size : 1024; size < wb->len + n; size *= 2)
+		;
+	if ((p = (unsigned char *)realloc(wb->p, size)) == NULL) {
+		DPRINTF(4, "ERROR: Memory allocation of %zu message bytes failed.", size);
+		wb->error = true;
+		return false;
+	}
+	wb->p = p;
+	wb->size = size;
+	return true;
+}
+
+STATIC void
+wire_put_uint(struct wire_buffer *wb, unsigned long v)
+{
+	if (!wire_reserve(wb, 10))
+		return;
+	for (; v >= 0x80; v >>= 7)
+		wb->p[wb->len++] = (v & 0x7f) | 0x80;
+	wb->p[wb->len++] = v;
+}
+
+STATIC void
+wire_put_int(struct wire_buffer *wb, long v)
+{
+	wire_put_uint(wb, v < 0 ? ~((unsigned long)v << 1) : (unsigned long)v << 1);
+}
+
+static void
+wire_put_bytes(struct wire_buffer *wb, const void *p, size_t n)
+{
+	wire_put_uint(wb, n);
+	if (!wire_reserve(wb, n))
+		return;
+	memcpy(wb->p + wb->len, p, n);
+	wb->len += n;
+}
+
+STATIC unsigned long
+wire_get_uint(struct wire_buffer *wb)
+{
+	unsigned long v = 0;
+	unsigned char c;
+	int shift;
+
+	for (shift = 0; shift < 64 && wb->pos < wb->len; shift += 7) {
+		c = wb->p[wb->pos++];
+		v |= (unsigned long)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return v;
 	}
-	return wsize;
+	wb->error = true;
+	return 0;
+}
+
+STATIC long
+wire_get_int(struct wire_buffer *wb)
+{
+	unsigned long v = wire_get_uint(wb);
+
+	return (long)(v >> 1) ^ -(long)(v & 1);
 }
 
+/*
+ * Return the number of elements of an array that follows.
+ * Each element takes at least a byte, so a count exceeding
+ * the remaining bytes signifies a malformed body.
+ */
 static int
-get_struct_size(int struct_type)
-{
-		switch (struct_type) {
-		case 1:
-			return sizeof(struct dgsh_node);
-		case 2:
-			return sizeof(struct dgsh_edge);
-		case 3:
-			return sizeof(struct dgsh_conc);
-		case 4:
-			return sizeof(struct dgsh_node_connections);
-		}
+wire_get_count(struct wire_buffer *wb)
+{
+	unsigned long n = wire_get_uint(wb);
+
+	if (n > wb->len - wb->pos || n > INT_MAX) {
+		wb->error = true;
 		return 0;
+	}
+	return (int)n;
 }
 
-static int
-do_write (int write_fd, void *datastruct, int datastruct_size, int struct_type)
-{
-	int wsize = 0;
-	if (datastruct_size > IOV_MAX) {
-		int all_elements, max_elements, elements = 0, pieces, 
-			prev_elements = 0, size, struct_size, i;
-
-		struct_size = get_struct_size(struct_type);
-		all_elements = datastruct_size / struct_size;
-		max_elements = IOV_MAX / struct_size;
-		pieces = all_elements / max_elements;
-		pieces += (all_elements % max_elements > 0);
-		DPRINTF(4, "struct_type: %d, pieces: %d, all_elements: %d, max_elements: %d",
-			struct_type, pieces, all_elements, max_elements);
-
-		for (i = 0; i < pieces; i++) {
-			if (all_elements - max_elements > 0)
-				elements = max_elements;
-			else if (all_elements > 0)
-				elements = all_elements;
-			all_elements -= elements;
-			size = struct_size * elements;
-			DPRINTF(4, "Round %d: elements: %d, size: %d, prev_elements: %d",
-				i, elements, size, prev_elements);
-
-			if (size > 0) {
-				void *struct_piece = malloc(size);
-				switch (struct_type) {
-				case 1:
-					memcpy(struct_piece,
-						&((struct dgsh_node *)
-						datastruct)[i * prev_elements],
-						size);
-					break;
-				case 2:
-					memcpy(struct_piece,
-						&((struct dgsh_edge *)
-						datastruct)[i * prev_elements],
-						size);
-					break;
-				case 3:
-					memcpy(struct_piece,
-						&((struct dgsh_conc *)
-						datastruct)[i * prev_elements],
-						size);
-					break;
-				case 4:
-					memcpy(struct_piece,
-						&((struct dgsh_node_connections *)
-						datastruct)[i * prev_elements],
-						size);
-				}
-				wsize = write_piece(write_fd, struct_piece,
-							size);
-				free(struct_piece);
-				prev_elements = elements;
-			}
-		}
-	} else
-		wsize = write_piece(write_fd, datastruct, datastruct_size);
+/* Return a pointer to the bytes of a string in the body and set its length */
+static const char *
+wire_get_bytes(struct wire_buffer *wb, size_t *n)
+{
+	const char *p;
 
-	return wsize;
+	*n = wire_get_uint(wb);
+	if (wb->error || *n > wb->len - wb->pos) {
+		wb->error = true;
+		*n = 0;
+		return "";
+	}
+	p = (const char *)wb->p + wb->pos;
+	wb->pos += *n;
+	return p;
 }
 
-static enum op_result
-write_concs(int write_fd)
+static void
+wire_put_edge(struct wire_buffer *wb, const struct dgsh_edge *e)
 {
-	int wsize, i;
-	int n_concs = chosen_mb->n_concs;
-	int conc_size = sizeof(struct dgsh_conc) * n_concs;
+	wire_put_int(wb, e->from);
+	wire_put_int(wb, e->to);
+	wire_put_int(wb, e->instances);
+	wire_put_int(wb, e->from_instances);
+	wire_put_int(wb, e->to_instances);
+}
 
-	if (!chosen_mb->conc_array)
-		return OP_SUCCESS;
+static void
+wire_get_edge(struct wire_buffer *wb, struct dgsh_edge *e)
+{
+	e->from = wire_get_int(wb);
+	e->to = wire_get_int(wb);
+	e->instances = wire_get_int(wb);
+	e->from_instances = wire_get_int(wb);
+	e->to_instances = wire_get_int(wb);
+}
 
-	wsize = do_write(write_fd, chosen_mb->conc_array, conc_size, 3);
-	if (wsize == -1) {
-		DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-		return OP_ERROR;
+/*
+ * Encode the nodes of the specified message block, preceded
+ * by the table of their distinct names.
+ */
+static void
+wire_put_nodes(struct wire_buffer *wb, const struct dgsh_negotiation *mb)
+{
+	int i, j, n_names = 0;
+	int *name_index, *name_node;
+	const struct dgsh_node *n;
+
+	if (mb->n_nodes == 0) {
+		wire_put_uint(wb, 0);
+		return;
+	}
+	/* Name table index of each node; first node of each name */
+	if ((name_index = (int *)malloc(2 * sizeof(int) * mb->n_nodes)) == NULL) {
+		wb->error = true;
+		return;
+	}
+	name_node = name_index + mb->n_nodes;
+	for (i = 0; i < mb->n_nodes; i++) {
+		for (j = 0; j < n_names; j++)
+			if (strcmp(mb->node_array[name_node[j]].name,
+			    mb->node_array[i].name) == 0)
+				break;
+		if (j == n_names)
+			name_node[n_names++] = i;
+		name_index[i] = j;
 	}
-	DPRINTF(4, "%s(): Wrote conc structures of size %d bytes ", __func__, wsize);
 
-	for (i = 0; i < n_concs; i++) {
-		struct dgsh_conc *c = &chosen_mb->conc_array[i];
-		int proc_pids_size = sizeof(int) * c->n_proc_pids;
-		wsize = do_write(write_fd, c->proc_pids, proc_pids_size, 5);
-		if (wsize == -1) {
-			DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-			return OP_ERROR;
-		}
-		DPRINTF(4, "%s(): Wrote %d proc_pids for conc %d at index %d of size %d bytes ",
-				__func__, c->n_proc_pids, c->pid, i, wsize);
+	wire_put_uint(wb, n_names);
+	for (j = 0; j < n_names; j++) {
+		n = &mb->node_array[name_node[j]];
+		wire_put_bytes(wb, n->name, strnlen(n->name, sizeof(n->name) - 1));
 	}
+	for (i = 0; i < mb->n_nodes; i++) {
+		n = &mb->node_array[i];
+		wire_put_int(wb, n->pid);
+		wire_put_int(wb, n->index);
+		wire_put_uint(wb, name_index[i]);
+		wire_put_int(wb, n->requires_channels);
+		wire_put_int(wb, n->provides_channels);
+		wire_put_int(wb, n->dgsh_in);
+		wire_put_int(wb, n->dgsh_out);
+	}
+	free(name_index);
+}
 
-	return OP_SUCCESS;
+static void
+wire_put_concs(struct wire_buffer *wb, const struct dgsh_negotiation *mb)
+{
+	int i, j;
+	const struct dgsh_conc *c;
+
+	for (i = 0; i < mb->n_concs; i++) {
+		c = &mb->conc_array[i];
+		wire_put_int(wb, c->pid);
+		wire_put_int(wb, c->input_fds);
+		wire_put_int(wb, c->output_fds);
+		wire_put_int(wb, c->endpoint_pid);
+		wire_put_uint(wb, c->multiple_inputs);
+		wire_put_uint(wb, c->n_proc_pids);
+		for (j = 0; j < c->n_proc_pids; j++)
+			wire_put_int(wb, c->proc_pids[j]);
+	}
 }
 
-/* Transmit dgsh negotiation graph solution to the next tool on the graph. */
-static enum op_result
-write_graph_solution(int write_fd)
+/* Encode the dgsh negotiation graph solution. */
+static void
+wire_put_graph_solution(struct wire_buffer *wb, const struct dgsh_negotiation *mb)
 {
-	int i;
-	int n_nodes = chosen_mb->n_nodes;
-	int graph_solution_size = sizeof(struct dgsh_node_connections) *
-								n_nodes;
-	struct dgsh_node_connections *graph_solution =
-					chosen_mb->graph_solution;
-	int wsize = -1;
+	int i, j;
+	const struct dgsh_node_connections *nc;
 
-	/* Transmit node connection structures. */
-	wsize = do_write(write_fd, graph_solution, graph_solution_size, 4);
-	if (wsize == -1) {
-		DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-		return OP_ERROR;
+	for (i = 0; i < mb->n_nodes; i++) {
+		nc = &mb->graph_solution[i];
+		wire_put_int(wb, nc->node_index);
+		wire_put_int(wb, nc->n_instances_incoming_free);
+		wire_put_int(wb, nc->n_instances_outgoing_free);
+		wire_put_uint(wb, nc->n_edges_incoming);
+		for (j = 0; j < nc->n_edges_incoming; j++)
+			wire_put_edge(wb, &nc->edges_incoming[j]);
+		wire_put_uint(wb, nc->n_edges_outgoing);
+		for (j = 0; j < nc->n_edges_outgoing; j++)
+			wire_put_edge(wb, &nc->edges_outgoing[j]);
 	}
-	DPRINTF(4, "%s(): Wrote graph solution of size %d bytes ", __func__, wsize);
+}
 
-	/* We haven't invalidated pointers to arrays of node indices. */
+/* Encode the specified message block into the buffer's body. */
+STATIC enum op_result
+wire_put_mb(struct wire_buffer *wb, const struct dgsh_negotiation *mb)
+{
+	int i;
 
-	for (i = 0; i < n_nodes; i++) {
-		struct dgsh_node_connections *nc = &graph_solution[i];
-		int in_edges_size = sizeof(struct dgsh_edge) * nc->n_edges_incoming;
-		int out_edges_size = sizeof(struct dgsh_edge) * nc->n_edges_outgoing;
-		if (nc->n_edges_incoming) {
-			/* Transmit a node's incoming connections. */
-			wsize = do_write(write_fd, nc->edges_incoming,
-							in_edges_size, 2);
-			if (wsize == -1) {
-				DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-				return OP_ERROR;
-			}
-			DPRINTF(4, "%s(): Wrote node's %d %d incoming edges of size %d bytes ", __func__, nc->node_index, nc->n_edges_incoming, wsize);
-		}
+	wb->len = 0;
+	wb->error = false;
+	wire_put_int(wb, mb->version);
+	wire_put_int(wb, mb->initiator_pid);
+	wire_put_uint(wb, mb->state);
+	wire_put_uint(wb, mb->is_error_confirmed);
+	wire_put_int(wb, mb->origin_index);
+	wire_put_int(wb, mb->origin_fd_direction);
+	wire_put_uint(wb, mb->is_origin_conc);
+	wire_put_int(wb, mb->conc_pid);
+	wire_put_uint(wb, mb->n_nodes);
+	wire_put_uint(wb, mb->n_edges);
+	wire_put_uint(wb, mb->conc_array ? mb->n_concs : 0);
+
+	wire_put_nodes(wb, mb);
+	if (mb->conc_array)
+		wire_put_concs(wb, mb);
+	if (mb->state == PS_NEGOTIATION)
+		for (i = 0; i < mb->n_edges; i++)
+			wire_put_edge(wb, &mb->edge_array[i]);
+	else if (mb->state == PS_RUN)
+		wire_put_graph_solution(wb, mb);
+
+	if (wb->error || wb->len > WIRE_MAX_BODY)
+		return OP_ERROR;
+	return OP_SUCCESS;
+}
 
-		if (nc->n_edges_outgoing) {
-			/* Transmit a node's outgoing connections. */
-			wsize = do_write(write_fd, nc->edges_outgoing,
-							out_edges_size, 2);
-			if (wsize == -1) {
-				DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-				return OP_ERROR;
+/*
+ * Write the header and the body of the encoded message
+ * through a single gathering write, unless it is interrupted.
+ */
+static enum op_result
+wire_write(int write_fd, struct wire_buffer *wb)
+{
+	unsigned char header[WIRE_HEADER_SIZE];
+	struct iovec iov[2];
+	int i = 0, retries = 0;
+	ssize_t n;
+
+	header[0] = WIRE_VERSION;
+	header[1] = wb->len >> 24;
+	header[2] = wb->len >> 16;
+	header[3] = wb->len >> 8;
+	header[4] = wb->len;
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = wb->p;
+	iov[1].iov_len = wb->len;
+
+	while (i < 2) {
+		DPRINTF(4, "Try write message of size: %zu", iov[0].iov_len + iov[1].iov_len);
+		if ((n = writev(write_fd, iov + i, 2 - i)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS && retries++ < 3) {	// sleep for 10ms
+				nanosleep((const struct timespec[]){{0, 10000000L}}, NULL);
+				continue;
 			}
-			DPRINTF(4, "%s(): Wrote node's %d %d outgoing edges of size %d bytes ", __func__, nc->node_index, nc->n_edges_outgoing, wsize);
+			DPRINTF(4, "ERROR: write failed: errno: %d", errno);
+			return OP_ERROR;
+		}
+		for (; i < 2 && (size_t)n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if (i < 2) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
 		}
 	}
 	return OP_SUCCESS;
@@ -1637,66 +1799,16 @@ set_dispatcher(void)
 enum op_result
 write_message_block(int write_fd)
 {
-	int wsize = -1;
-	int mb_size = sizeof(struct dgsh_negotiation);
-	int nodes_size = chosen_mb->n_nodes * sizeof(struct dgsh_node);
-	int edges_size = chosen_mb->n_edges * sizeof(struct dgsh_edge);
-	struct dgsh_node *p_nodes = chosen_mb->node_array;
-
 	DPRINTF(3, "%s(): %s (%d)", __func__, programname, self_node.index);
 
 	if (chosen_mb->state == PS_ERROR && errno == 0)
 		errno = EPROTO;
 
-	/**
-	 * Prepare and perform message block transmission.
-	 * Formally invalidate pointers to nodes and edges
-	 * to avoid accidents on the receiver's side.
-	 */
-	chosen_mb->node_array = NULL;
-	DPRINTF(4, "%s(): Write message block.", __func__);
-	wsize = do_write(write_fd, chosen_mb, mb_size, 0);
-	if (wsize == -1) {
-		DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-		return OP_ERROR;
-	}
-	DPRINTF(4, "%s(): Wrote message block of size %d bytes ", __func__, wsize);
-
-	/* Transmit nodes. */
-	if (chosen_mb->n_nodes > 0) {
-		wsize = do_write(write_fd, p_nodes, nodes_size, 1);
-		if (wsize == -1) {
-			DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-			return OP_ERROR;
-		}
-		DPRINTF(4, "%s(): Wrote nodes of size %d bytes ",
-				__func__, wsize);
-	}
-
-	chosen_mb->node_array = p_nodes; // Reinstate pointers to nodes.
-
-	if (write_concs(write_fd) == OP_ERROR)
+	if (wire_put_mb(&wire_out, chosen_mb) == OP_ERROR ||
+	    wire_write(write_fd, &wire_out) == OP_ERROR)
 		return OP_ERROR;
-
-	if (chosen_mb->state == PS_NEGOTIATION) {
-		if (chosen_mb->n_edges > 0) {
-			/* Transmit edges. */
-			struct dgsh_edge *p_edges = chosen_mb->edge_array;
-			chosen_mb->edge_array = NULL;
-			wsize = do_write(write_fd, p_edges, edges_size, 2);
-			if (wsize == -1) {
-				DPRINTF(4, "ERROR: write failed: errno: %d", errno);
-				return OP_ERROR;
-			}
-			DPRINTF(4, "%s(): Wrote edges of size %d bytes ", __func__, wsize);
-
-			chosen_mb->edge_array = p_edges; /* Reinstate edges. */
-		}
-	} else if (chosen_mb->state == PS_RUN) {
-		/* Transmit solution. */
-		if (write_graph_solution(write_fd) == OP_ERROR)
-			return OP_ERROR;
-	}
+	DPRINTF(4, "%s(): Wrote message block of %d nodes and %d edges in %zu bytes.",
+			__func__, chosen_mb->n_nodes, chosen_mb->n_edges, wire_out.len);
 
 	DPRINTF(4, "%s(): Shipped message block or solution to next node in graph from file descriptor: %d.\n", __func__, write_fd);
 	return OP_SUCCESS;
@@ -1937,6 +2049,135 @@ register_node_edge(const char *tool_name, pid_t self_pid, int *n_input_fds,
 	return OP_SUCCESS;
 }
 
+/*
+ * Blocks merged by a concentrator in tree negotiation renumber
+ * the nodes of all but one branch.  Look up our node by pid
+ * so that the edges we add and the solution we read use the
+ * index of the block at hand.
+ */
+static void
+relocate_self_node(void)
+{
+	int i;
+
+	for (i = 0; i < chosen_mb->n_nodes; i++)
+		if (chosen_mb->node_array[i].pid == self_node.pid) {
+			if (self_node.index != i)
+				DPRINTF(4, "%s(): Node moved from %d to %d.",
+						__func__, self_node.index, i);
+			self_node.index = i;
+			self_node_io_side.index = i;
+			return;
+		}
+}
+
+/* Return the index of the node with the specified pid in mb or -1. */
+static int
+find_node(const struct dgsh_negotiation *mb, pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < mb->n_nodes; i++)
+		if (mb->node_array[i].pid == pid)
+			return i;
+	return -1;
+}
+
+/*
+ * Merge into mb the nodes, edges, and concentrators of a block
+ * that travelled a different branch of the dgsh graph.
+ * Nodes are matched by their pid; the ones mb lacks are appended,
+ * and the edges of from are renumbered accordingly.
+ * The origin of mb is set to that of from, an error state of from
+ * is carried over, and from is left unmodified.
+ */
+enum op_result
+merge_message_block(struct dgsh_negotiation *mb,
+		const struct dgsh_negotiation *from)
+{
+	int *map;
+	int i, j;
+	void *p;
+
+	if (from->n_nodes == 0)
+		map = NULL;
+	else if ((map = malloc(sizeof(int) * from->n_nodes)) == NULL)
+		return OP_ERROR;
+
+	for (i = 0; i < from->n_nodes; i++) {
+		if ((map[i] = find_node(mb, from->node_array[i].pid)) != -1)
+			continue;
+		p = realloc(mb->node_array,
+				sizeof(struct dgsh_node) * (mb->n_nodes + 1));
+		if (p == NULL)
+			goto error;
+		mb->node_array = (struct dgsh_node *)p;
+		mb->node_array[mb->n_nodes] = from->node_array[i];
+		mb->node_array[mb->n_nodes].index = mb->n_nodes;
+		map[i] = mb->n_nodes++;
+	}
+
+	for (i = 0; i < from->n_edges; i++) {
+		struct dgsh_edge e = from->edge_array[i];
+
+		if (e.from < 0 || e.from >= from->n_nodes ||
+		    e.to < 0 || e.to >= from->n_nodes)
+			goto error;
+		e.from = map[e.from];
+		e.to = map[e.to];
+		for (j = 0; j < mb->n_edges; j++)
+			if ((mb->edge_array[j].from == e.from &&
+			     mb->edge_array[j].to == e.to) ||
+			    (mb->edge_array[j].from == e.to &&
+			     mb->edge_array[j].to == e.from))
+				break;
+		if (j < mb->n_edges)
+			continue;
+		p = realloc(mb->edge_array,
+				sizeof(struct dgsh_edge) * (mb->n_edges + 1));
+		if (p == NULL)
+			goto error;
+		mb->edge_array = (struct dgsh_edge *)p;
+		mb->edge_array[mb->n_edges++] = e;
+	}
+
+	for (i = 0; i < from->n_concs; i++) {
+		struct dgsh_conc c = from->conc_array[i];
+
+		if (find_conc(mb, c.pid))
+			continue;
+		p = realloc(mb->conc_array,
+				sizeof(struct dgsh_conc) * (mb->n_concs + 1));
+		if (p == NULL)
+			goto error;
+		mb->conc_array = (struct dgsh_conc *)p;
+		c.proc_pids = (int *)malloc(sizeof(int) * c.n_proc_pids);
+		if (c.proc_pids == NULL)
+			goto error;
+		memcpy(c.proc_pids, from->conc_array[i].proc_pids,
+				sizeof(int) * c.n_proc_pids);
+		mb->conc_array[mb->n_concs++] = c;
+	}
+
+	if (from->origin_index >= 0 && from->origin_index < from->n_nodes)
+		mb->origin_index = map[from->origin_index];
+	else
+		mb->origin_index = -1;
+	mb->origin_fd_direction = from->origin_fd_direction;
+	if (from->state == PS_ERROR) {
+		mb->state = PS_ERROR;
+		mb->is_error_confirmed |= from->is_error_confirmed;
+	}
+	DPRINTF(4, "%s(): Merged block now has %d nodes, %d edges, %d concs.",
+			__func__, mb->n_nodes, mb->n_edges, mb->n_concs);
+	free(map);
+	return OP_SUCCESS;
+
+error:
+	free(map);
+	return OP_ERROR;
+}
+
 /**
  * Check if the arrived message block preexists our chosen one
  * and substitute the chosen if so.
@@ -1960,6 +2201,7 @@ analyse_read(struct dgsh_negotiation *fresh_mb,
 		if (chosen_mb == NULL)
 			construct_message_block(tool_name, pid);
 
+	relocate_self_node();
 	if (init_error)
 		chosen_mb->state = PS_ERROR;
 
@@ -1979,102 +2221,6 @@ analyse_read(struct dgsh_negotiation *fresh_mb,
 	return OP_SUCCESS;
 }
 
-static enum op_result
-check_read(int bytes_read, int buf_size, int expected_read_size) {
-	if (bytes_read != expected_read_size) {
-		DPRINTF(4, "%s(): ERROR: Read %d bytes of message block, expected to read %d.\n",
-			__func__, bytes_read, expected_read_size);
-		return OP_ERROR;
-	}
-	if (bytes_read > buf_size) {
-		DPRINTF(4, "%s(): ERROR: Read %d bytes of message block, but buffer can hold up to %d.",
-				__func__, bytes_read, buf_size);
-		return OP_ERROR;
-	}
-	return OP_SUCCESS;
-}
-
-static enum op_result
-alloc_copy_proc_pids(struct dgsh_conc *c, char *buf, int bytes_read,
-		int buf_size)
-{
-	int expected_read_size = sizeof(int) * c->n_proc_pids;
-	if (check_read(bytes_read, buf_size, expected_read_size) == OP_ERROR)
-		return OP_ERROR;
-	c->proc_pids = (int *)malloc(bytes_read);
-	memcpy(c->proc_pids, buf, bytes_read);
-	return OP_SUCCESS;
-}
-
-static enum op_result
-alloc_copy_concs(struct dgsh_negotiation *mb, char *buf, int bytes_read,
-		int buf_size)
-{
-	int expected_read_size = sizeof(struct dgsh_conc) * mb->n_concs;
-	if (check_read(bytes_read, buf_size, expected_read_size) == OP_ERROR)
-		return OP_ERROR;
-	mb->conc_array = (struct dgsh_conc *)malloc(bytes_read);
-	memcpy(mb->conc_array, buf, bytes_read);
-	return OP_SUCCESS;
-}
-
-/* Allocate memory for graph solution and copy from buffer. */
-static enum op_result
-alloc_copy_graph_solution(struct dgsh_negotiation *mb, char *buf, int bytes_read,
-								int buf_size)
-{
-	int expected_read_size = sizeof(struct dgsh_node_connections) *
-								mb->n_nodes;
-	if (check_read(bytes_read, buf_size, expected_read_size) == OP_ERROR)
-		return OP_ERROR;
-	mb->graph_solution = (struct dgsh_node_connections *)malloc(bytes_read);
-	memcpy(mb->graph_solution, buf, bytes_read);
-	return OP_SUCCESS;
-}
-
-/* Allocate memory for message_block edges and copy from buffer. */
-static enum op_result
-alloc_copy_edges(struct dgsh_negotiation *mb, char *buf, int bytes_read,
-								int buf_size)
-{
-	int expected_read_size = sizeof(struct dgsh_edge) * mb->n_edges;
-	if (check_read(bytes_read, buf_size, expected_read_size) == OP_ERROR)
-		return OP_ERROR;
-	mb->edge_array = (struct dgsh_edge *)malloc(bytes_read);
-	memcpy(mb->edge_array, buf, bytes_read);
-	return OP_SUCCESS;
-}
-
-/* Allocate memory for message_block nodes and copy from buffer. */
-static enum op_result
-alloc_copy_nodes(struct dgsh_negotiation *mb, char *buf, int bytes_read,
-								int buf_size)
-{
-	int expected_read_size = sizeof(struct dgsh_node) * mb->n_nodes;
-	if (check_read(bytes_read, buf_size, expected_read_size) == OP_ERROR)
-		return OP_ERROR;
-	mb->node_array = (struct dgsh_node *)malloc(bytes_read);
-	memcpy(mb->node_array, buf, bytes_read);
-	DPRINTF(4, "%s(): Node array recovered.", __func__);
-	return OP_SUCCESS;
-}
-
-/* Allocate memory for core message_block and copy from buffer. */
-static enum op_result
-alloc_copy_mb(struct dgsh_negotiation **mb, char *buf, int bytes_read,
-							int buf_size)
-{
-	int expected_read_size = sizeof(struct dgsh_negotiation);
-	if (check_read(bytes_read, buf_size, expected_read_size) == OP_ERROR)
-		return OP_ERROR;
-	*mb = (struct dgsh_negotiation *)malloc(bytes_read);
-	memcpy(*mb, buf, bytes_read);
-	(*mb)->node_array = NULL;
-	(*mb)->edge_array = NULL;
-	(*mb)->graph_solution = NULL;
-	return OP_SUCCESS;
-}
-
 /**
  * The actual call to read in the message block.
  * If the call does not succeed or does not signal retry we have
@@ -2092,71 +2238,6 @@ call_read(int fd, char *buf, int buf_size, int *bytes_read, int *error_code)
 	return OP_SUCCESS;
 }
 
-/**
- * Try to read a chunk of data from either side (stdin or stdout).
- * This function is agnostic as to what it is reading.
- * Its job is to manage a read operation.
- */
-static enum op_result
-read_chunk(int read_fd, char *buf, int buf_size, int *bytes_read,
-						int struct_type)
-{
-	int error_code;
-	DPRINTF(4, "%s(): buf_size: %d, IOV_MAX: %d",
-			__func__, buf_size, IOV_MAX);
-
-	if (buf_size > IOV_MAX) {
-		int buf_size_piece, pieces, i, size_copied = 0, rsize = 0,
-			struct_size, all_elements, max_elements, elements = 0;
-
-		struct_size = get_struct_size(struct_type);
-		all_elements = buf_size / struct_size;
-		max_elements = IOV_MAX / struct_size;
-		pieces = all_elements / max_elements;
-		pieces += (all_elements % max_elements > 0);
-		DPRINTF(4, "struct_type: %d, pieces: %d, all_elements: %d, max_elements: %d",
-			struct_type, pieces, all_elements, max_elements);
-		
-		for (i = 0; i < pieces; i++) {
-			void *buf_piece;
-			if (all_elements - max_elements > 0)
-				elements = max_elements;
-			else if (all_elements > 0)
-				elements = all_elements;
-			all_elements -= elements;
-			buf_size_piece = struct_size * elements;
-			DPRINTF(4, "Round %d: elements: %d, size: %d",
-				i, elements, buf_size_piece);
-
-			if (buf_size_piece > 0) {
-				buf_piece = malloc(buf_size_piece);
-				call_read(read_fd, buf_piece, buf_size_piece,
-					bytes_read, &error_code);
-				if (*bytes_read == -1) {
-					free(buf_piece);
-					return OP_ERROR;
-				}
-				rsize += *bytes_read;
-				memcpy(buf + size_copied, buf_piece,
-							buf_size_piece);
-				size_copied += buf_size_piece;
-				free(buf_piece);
-			}
-		}
-		*bytes_read = rsize;
-	} else
-		call_read(read_fd, buf, buf_size, bytes_read, &error_code);
-
-	if (*bytes_read == -1) {  /* Read failed. */
-	 	DPRINTF(4, "ERROR: Reading from fd %d failed with error code %d.",
-			read_fd, error_code);
-		return error_code;
-	} else  /* Read succeeded. */
-		DPRINTF(4, "Read succeeded: %d bytes read from %d.\n",
-		*bytes_read, read_fd);
-	return OP_SUCCESS;
-}
-
 /* Allocate memory for file descriptors. */
 static enum op_result
 alloc_fds(int **fds, int n_fds)
@@ -2274,69 +2355,112 @@ get_provided_fds_n(struct dgsh_negotiation *mb, pid_t pid)
 }
 
 /*
- * Write the file descriptor fd_to_write to
+ * Write the n_fds file descriptors in fds to
  * the socket file descriptor output_socket.
+ * The descriptors travel in as few messages as the kernel allows,
+ * each carrying as data a byte with the number of its descriptors.
  */
 void
-write_fd(int output_socket, int fd_to_write)
+write_fd_array(int output_socket, const int *fds, int n_fds)
 {
 	struct msghdr    msg;
 	struct cmsghdr  *cmsg;
-	unsigned char    buf[CMSG_SPACE(sizeof(int))];
-	struct iovec io = { .iov_base = " ", .iov_len = 1 };
+	union fdbatch    u;
+	unsigned char    count;
+	struct iovec io = { .iov_base = &count, .iov_len = 1 };
+	int n;
+
+	for (; n_fds > 0; fds += n, n_fds -= n) {
+		n = n_fds < FD_BATCH_MAX ? n_fds : FD_BATCH_MAX;
+		count = n;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = &io;
-	msg.msg_iovlen = 1;
-	msg.msg_control = buf;
-	msg.msg_controllen = sizeof(buf);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &io;
+		msg.msg_iovlen = 1;
+		msg.msg_control = u.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
-	*(int *)CMSG_DATA(cmsg) = fd_to_write;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
 
-	if (sendmsg(output_socket, &msg, 0) == -1)
-		err(1, "sendmsg on fd %d", output_socket);
+		if (sendmsg(output_socket, &msg, 0) == -1)
+			err(1, "sendmsg of %d fds on fd %d", n, output_socket);
+	}
 }
 
 /*
- * Read a file descriptor from socket input_socket and return it.
+ * Write the file descriptor fd_to_write to
+ * the socket file descriptor output_socket.
  */
-int
-read_fd(int input_socket)
+void
+write_fd(int output_socket, int fd_to_write)
+{
+	write_fd_array(output_socket, &fd_to_write, 1);
+}
+
+/*
+ * Read n_fds file descriptors from socket input_socket into fds.
+ */
+void
+read_fd_array(int input_socket, int *fds, int n_fds)
 {
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
-	unsigned char buf[CMSG_SPACE(sizeof(int))];
-	char m_buffer[2];
-	struct iovec io = { .iov_base = m_buffer, .iov_len = sizeof(m_buffer) };
-
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_control = buf;
-	msg.msg_controllen = sizeof(buf);
-	msg.msg_iov = &io;
-	msg.msg_iovlen = 1;
+	union fdbatch u;
+	unsigned char count;
+	struct iovec io = { .iov_base = &count, .iov_len = 1 };
+	int n, received;
+
+	for (; n_fds > 0; fds += received, n_fds -= received) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof(u.buf);
+		msg.msg_iov = &io;
+		msg.msg_iovlen = 1;
 
 again:
-	if (recvmsg(input_socket, &msg, 0) == -1) {
-		if (errno == EAGAIN) {
-			sleep(1);
-			goto again;
+		if ((n = recvmsg(input_socket, &msg, 0)) == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				if (errno == EAGAIN)
+					sleep(1);
+				goto again;
+			}
+			err(1, "recvmsg on fd %d", input_socket);
 		}
-		err(1, "recvmsg on fd %d", input_socket);
-	}
-	if ((msg.msg_flags & MSG_TRUNC) || (msg.msg_flags & MSG_CTRUNC))
-		errx(1, "control message truncated on fd %d", input_socket);
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
-	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		if (cmsg->cmsg_len == CMSG_LEN(sizeof(int)) &&
-		    cmsg->cmsg_level == SOL_SOCKET &&
-		    cmsg->cmsg_type == SCM_RIGHTS)
-			return *(int *)CMSG_DATA(cmsg);
+		if (n == 0)
+			errx(1, "end of file while reading %d fds from fd %d",
+					n_fds, input_socket);
+		if ((msg.msg_flags & MSG_TRUNC) || (msg.msg_flags & MSG_CTRUNC))
+			errx(1, "control message truncated on fd %d", input_socket);
+		received = 0;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg))
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_RIGHTS) {
+				received = (cmsg->cmsg_len - CMSG_LEN(0)) /
+					sizeof(int);
+				break;
+			}
+		if (received == 0 || received != count || received > n_fds)
+			errx(1, "received %d fds, framed as %d, expecting %d, from fd %d",
+					received, count, n_fds, input_socket);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * received);
 	}
-	errx(1, "unable to read file descriptor from fd %d", input_socket);
+}
+
+/*
+ * Read a file descriptor from socket input_socket and return it.
+ */
+int
+read_fd(int input_socket)
+{
+	int fd;
+
+	read_fd_array(input_socket, &fd, 1);
+	return fd;
 }
 
 /* Read file descriptors piping input from another tool in the dgsh graph. */
@@ -2354,131 +2478,238 @@ read_input_fds(int input_socket, int *input_fds)
 	assert(this_nc->node_index == self_node.index);
 	int i;
 	int total_edge_instances = 0;
-	enum op_result re = OP_SUCCESS;
 
 	DPRINTF(4, "%s(): %d incoming edges to inspect of node %d.", __func__,
 			this_nc->n_edges_incoming, self_node.index);
-	for (i = 0; i < this_nc->n_edges_incoming; i++) {
-		int k;
-		/**
-		 * Due to channel constraint flexibility,
-		 * each edge can have more than one instances.
-		 */
-		for (k = 0; k < this_nc->edges_incoming[i].instances; k++) {
-			input_fds[total_edge_instances] = read_fd(input_socket);
-			DPRINTF(4, "%s: Node %d received file descriptor %d.",
-					__func__, this_nc->node_index,
-					input_fds[total_edge_instances]);
-			total_edge_instances++;
+	/**
+	 * Due to channel constraint flexibility,
+	 * each edge can have more than one instances.
+	 */
+	for (i = 0; i < this_nc->n_edges_incoming; i++)
+		total_edge_instances += this_nc->edges_incoming[i].instances;
+	read_fd_array(input_socket, input_fds, total_edge_instances);
+	for (i = 0; i < total_edge_instances; i++)
+		DPRINTF(4, "%s: Node %d received file descriptor %d.",
+				__func__, this_nc->node_index, input_fds[i]);
+	return OP_SUCCESS;
+}
+
+/*
+ * Read exactly the specified number of bytes, which a stream
+ * socket may deliver in more than one part.
+ */
+static enum op_result
+read_full(int read_fd, void *buf, size_t size)
+{
+	int bytes_read, error_code;
+	size_t done = 0;
+
+	while (done < size) {
+		if (call_read(read_fd, (char *)buf + done, size - done,
+		    &bytes_read, &error_code) == OP_ERROR) {
+			if (error_code == -EINTR)
+				continue;
+			DPRINTF(4, "ERROR: Reading from fd %d failed with error code %d.",
+				read_fd, error_code);
+			return OP_ERROR;
 		}
-		/* XXX */
-		if (re == OP_ERROR)
-			break;
+		if (bytes_read == 0) {
+			DPRINTF(4, "ERROR: Read %zu bytes of %zu from fd %d before EOF.",
+				done, size, read_fd);
+			return OP_ERROR;
+		}
+		done += bytes_read;
 	}
-	if (re == OP_ERROR) {
-		free_graph_solution(chosen_mb->n_nodes - 1);
-		free(input_fds);
+	return OP_SUCCESS;
+}
+
+/* Decode the nodes, preceded by the table of their distinct names. */
+static void
+wire_get_nodes(struct wire_buffer *wb, struct dgsh_negotiation *mb)
+{
+	int i, n_names = wire_get_count(wb);
+	size_t *name_len;
+	const char **name;
+	struct dgsh_node *n;
+	unsigned long j;
+
+	/* The names are referred to in place in the body. */
+	if ((name = (const char **)malloc(n_names * (sizeof(*name) + sizeof(*name_len)) + 1)) == NULL) {
+		wb->error = true;
+		return;
 	}
-	return re;
+	name_len = (size_t *)(name + n_names);
+	for (j = 0; j < (unsigned long)n_names; j++)
+		name[j] = wire_get_bytes(wb, &name_len[j]);
+
+	if (mb->n_nodes > 0 && (mb->node_array = (struct dgsh_node *)malloc(
+	    sizeof(struct dgsh_node) * mb->n_nodes)) == NULL)
+		wb->error = true;
+	for (i = 0; i < mb->n_nodes && !wb->error; i++) {
+		n = &mb->node_array[i];
+		n->pid = wire_get_int(wb);
+		n->index = wire_get_int(wb);
+		j = wire_get_uint(wb);
+		if (j >= (unsigned long)n_names || name_len[j] >= sizeof(n->name)) {
+			wb->error = true;
+			break;
+		}
+		memcpy(n->name, name[j], name_len[j]);
+		n->name[name_len[j]] = '\0';
+		n->requires_channels = wire_get_int(wb);
+		n->provides_channels = wire_get_int(wb);
+		n->dgsh_in = wire_get_int(wb);
+		n->dgsh_out = wire_get_int(wb);
+	}
+	free(name);
+	DPRINTF(4, "%s(): Node array recovered.", __func__);
 }
 
-static enum op_result
-read_concs(int read_fd, struct dgsh_negotiation *fresh_mb)
+static void
+wire_get_concs(struct wire_buffer *wb, struct dgsh_negotiation *mb)
 {
-	int bytes_read;
-	size_t buf_size = sizeof(struct dgsh_conc) * fresh_mb->n_concs;
-	char *buf = (char *)malloc(buf_size);
-	enum op_result error_code = OP_SUCCESS;
+	int i, j;
+	struct dgsh_conc *c;
 
-	if (!fresh_mb->conc_array)
-		return error_code;
+	if ((mb->conc_array = (struct dgsh_conc *)calloc(mb->n_concs,
+	    sizeof(struct dgsh_conc))) == NULL) {
+		wb->error = true;
+		return;
+	}
+	for (i = 0; i < mb->n_concs && !wb->error; i++) {
+		c = &mb->conc_array[i];
+		c->pid = wire_get_int(wb);
+		c->input_fds = wire_get_int(wb);
+		c->output_fds = wire_get_int(wb);
+		c->endpoint_pid = wire_get_int(wb);
+		c->multiple_inputs = wire_get_uint(wb);
+		c->n_proc_pids = wire_get_count(wb);
+		if ((c->proc_pids = (int *)malloc(sizeof(int) * c->n_proc_pids)) == NULL) {
+			wb->error = true;
+			break;
+		}
+		for (j = 0; j < c->n_proc_pids; j++)
+			c->proc_pids[j] = wire_get_int(wb);
+		DPRINTF(4, "%s(): Read %d proc_pids for conc %d at index %d",
+				__func__, c->n_proc_pids, c->pid, i);
+	}
+}
 
-	if ((error_code = read_chunk(read_fd, buf, buf_size, &bytes_read, 3))
-			!= OP_SUCCESS)
-		return error_code;
-	error_code = alloc_copy_concs(fresh_mb, buf, bytes_read, buf_size);
-	free(buf);
+/* Decode the edges of a node's connections of the specified type. */
+static void
+wire_get_connections(struct wire_buffer *wb, struct dgsh_edge **edges,
+		int *n_edges, int type, int node_index)
+{
+	int j;
 
-	int i, n_concs = fresh_mb->n_concs;
-	for (i = 0; i < n_concs; i++) {
-		struct dgsh_conc *c = &fresh_mb->conc_array[i];
-		size_t buf_size = sizeof(int) * c->n_proc_pids;
-		buf = (char *)malloc(buf_size);
-		if ((error_code = read_chunk(read_fd, buf, buf_size,
-						&bytes_read, 5)) != OP_SUCCESS)
-			return error_code;
-		error_code = alloc_copy_proc_pids(c, buf, bytes_read, buf_size);
-		free(buf);
-		DPRINTF(4, "%s(): Read %d proc_pids for conc %d at index %d of size %d bytes ",
-				__func__, c->n_proc_pids, c->pid, i, bytes_read);
+	*n_edges = wire_get_count(wb);
+	if (*n_edges == 0 || wb->error)
+		return;
+	if (alloc_node_connections(edges, *n_edges, type, node_index) == OP_ERROR) {
+		wb->error = true;
+		return;
 	}
+	for (j = 0; j < *n_edges; j++)
+		wire_get_edge(wb, &(*edges)[j]);
+}
+
+/* Decode the solution to the dgsh negotiation graph. */
+static void
+wire_get_graph_solution(struct wire_buffer *wb, struct dgsh_negotiation *mb)
+{
+	int i;
+	struct dgsh_node_connections *nc;
 
-	return error_code;
+	if ((mb->graph_solution = (struct dgsh_node_connections *)calloc(
+	    mb->n_nodes, sizeof(struct dgsh_node_connections))) == NULL) {
+		wb->error = true;
+		return;
+	}
+	for (i = 0; i < mb->n_nodes && !wb->error; i++) {
+		nc = &mb->graph_solution[i];
+		nc->node_index = wire_get_int(wb);
+		nc->n_instances_incoming_free = wire_get_int(wb);
+		nc->n_instances_outgoing_free = wire_get_int(wb);
+		wire_get_connections(wb, &nc->edges_incoming,
+				&nc->n_edges_incoming, 0, i);
+		wire_get_connections(wb, &nc->edges_outgoing,
+				&nc->n_edges_outgoing, 1, i);
+		DPRINTF(4, "Node %d with %d incoming edges and %d outgoing edges.",
+				nc->node_index, nc->n_edges_incoming, nc->n_edges_outgoing);
+	}
 }
 
-/* Try read solution to the dgsh negotiation graph. */
-static enum op_result
-read_graph_solution(int read_fd, struct dgsh_negotiation *fresh_mb)
+/*
+ * Release the arrays of a message block whose decoding failed,
+ * leaving a consistent, empty, block.
+ */
+static void
+wire_discard(struct dgsh_negotiation *mb)
 {
 	int i;
-	int bytes_read = 0;
-	int n_nodes = fresh_mb->n_nodes;
-	size_t buf_size = sizeof(struct dgsh_node_connections) * n_nodes;
-	char *buf = (char *)malloc(buf_size);
-	enum op_result error_code = OP_SUCCESS;
-
-	/* Read node connection structures of the solution. */
-	if ((error_code = read_chunk(read_fd, buf, buf_size, &bytes_read, 4))
-			!= OP_SUCCESS)
-		return error_code;
-	if ((error_code = alloc_copy_graph_solution(fresh_mb, buf, bytes_read,
-					buf_size)) == OP_ERROR)
-		return error_code;
-	free(buf);
 
-	struct dgsh_node_connections *graph_solution =
-					fresh_mb->graph_solution;
-	for (i = 0; i < n_nodes; i++) {
-		struct dgsh_node_connections *nc = &graph_solution[i];
-		DPRINTF(4, "Node %d with %d incoming edges at %lx and %d outgoing edges at %lx.", nc->node_index, nc->n_edges_incoming, (long)nc->edges_incoming, nc->n_edges_outgoing, (long)nc->edges_outgoing);
-		int in_edges_size = sizeof(struct dgsh_edge) * nc->n_edges_incoming;
-		int out_edges_size = sizeof(struct dgsh_edge) * nc->n_edges_outgoing;
-
-		/* Read a node's incoming connections. */
-		if (nc->n_edges_incoming > 0) {
-			buf = (char *)malloc(in_edges_size);
-			if ((error_code = read_chunk(read_fd, buf, in_edges_size,
-				&bytes_read, 2)) != OP_SUCCESS)
-				return error_code;
-			if (in_edges_size != bytes_read) {
-				DPRINTF(4, "%s(): ERROR: Expected %d bytes, got %d.", __func__,
-						in_edges_size, bytes_read);
-				return OP_ERROR;
-			}
-			if (alloc_node_connections(&nc->edges_incoming,
-				nc->n_edges_incoming, 0, i) == OP_ERROR)
-				return OP_ERROR;
-			memcpy(nc->edges_incoming, buf, in_edges_size);
-			free(buf);
+	if (mb->graph_solution) {
+		for (i = 0; i < mb->n_nodes; i++) {
+			free(mb->graph_solution[i].edges_incoming);
+			free(mb->graph_solution[i].edges_outgoing);
 		}
+		free(mb->graph_solution);
+	}
+	if (mb->conc_array)
+		free_conc_array(mb);
+	free(mb->node_array);
+	free(mb->edge_array);
+	mb->graph_solution = NULL;
+	mb->conc_array = NULL;
+	mb->node_array = NULL;
+	mb->edge_array = NULL;
+	mb->n_nodes = mb->n_edges = mb->n_concs = 0;
+}
 
-		/* Read a node's outgoing connections. */
-		if (nc->n_edges_outgoing) {
-			buf = (char *)malloc(out_edges_size);
-			if ((error_code = read_chunk(read_fd, buf, out_edges_size,
-				&bytes_read, 2)) != OP_SUCCESS)
-				return error_code;
-			if (out_edges_size != bytes_read) {
-				DPRINTF(4, "%s(): ERROR: Expected %d bytes, got %d.", __func__,
-						out_edges_size, bytes_read);
-				return OP_ERROR;
-			}
-			if (alloc_node_connections(&nc->edges_outgoing,
-				nc->n_edges_outgoing, 1, i) == OP_ERROR)
-				return OP_ERROR;
-			memcpy(nc->edges_outgoing, buf, out_edges_size);
-			free(buf);
-		}
+/* Decode the buffer's body into the specified message block. */
+STATIC enum op_result
+wire_get_mb(struct wire_buffer *wb, struct dgsh_negotiation *mb)
+{
+	int i;
+
+	wb->pos = 0;
+	wb->error = false;
+	mb->node_array = NULL;
+	mb->edge_array = NULL;
+	mb->graph_solution = NULL;
+	mb->conc_array = NULL;
+
+	mb->version = wire_get_int(wb);
+	mb->initiator_pid = wire_get_int(wb);
+	mb->state = wire_get_uint(wb);
+	mb->is_error_confirmed = wire_get_uint(wb);
+	mb->origin_index = wire_get_int(wb);
+	mb->origin_fd_direction = wire_get_int(wb);
+	mb->is_origin_conc = wire_get_uint(wb);
+	mb->conc_pid = wire_get_int(wb);
+	mb->n_nodes = wire_get_count(wb);
+	/* Edges are only transmitted while negotiating. */
+	mb->n_edges = wire_get_uint(wb);
+	mb->n_concs = wire_get_count(wb);
+
+	wire_get_nodes(wb, mb);
+	if (mb->n_concs > 0 && !wb->error)
+		wire_get_concs(wb, mb);
+	if (mb->state == PS_NEGOTIATION && mb->n_edges > 0 && !wb->error) {
+		if ((unsigned)mb->n_edges > wb->len - wb->pos ||
+		    (mb->edge_array = (struct dgsh_edge *)malloc(
+		    sizeof(struct dgsh_edge) * mb->n_edges)) == NULL)
+			wb->error = true;
+		for (i = 0; i < mb->n_edges && !wb->error; i++)
+			wire_get_edge(wb, &mb->edge_array[i]);
+	} else if (mb->state == PS_RUN && !wb->error)
+		wire_get_graph_solution(wb, mb);
+
+	if (wb->error || wb->pos != wb->len) {
+		DPRINTF(4, "%s(): ERROR: Malformed message block at byte %zu of %zu.",
+				__func__, wb->pos, wb->len);
+		wire_discard(mb);
+		return OP_ERROR;
 	}
 	return OP_SUCCESS;
 }
@@ -2497,66 +2728,455 @@ read_graph_solution(int read_fd, struct dgsh_negotiation *fresh_mb)
 enum op_result
 read_message_block(int read_fd, struct dgsh_negotiation **fresh_mb)
 {
-	size_t buf_size = sizeof(struct dgsh_negotiation);
-	char *buf = (char *)malloc(buf_size);
-	int bytes_read = 0;
-	enum op_result error_code = 0;
+	unsigned char header[WIRE_HEADER_SIZE];
+	struct wire_buffer *wb = &wire_in;
+	size_t len;
 
 	DPRINTF(3, "%s(): %s (%d)", __func__, programname, self_node.index);
 
-	memset(buf, 0, buf_size);
-
-	/* Try read core message block: struct negotiation state fields. */
-	if ((error_code = read_chunk(read_fd, buf, buf_size, &bytes_read, 0))
-			!= OP_SUCCESS)
-		return error_code;
-	if (alloc_copy_mb(fresh_mb, buf, bytes_read, buf_size) == OP_ERROR)
+	if (read_full(read_fd, header, sizeof(header)) == OP_ERROR)
+		return OP_ERROR;
+	if (header[0] != WIRE_VERSION) {
+		DPRINTF(4, "%s(): ERROR: Message block format version %d; expected %d.",
+				__func__, header[0], WIRE_VERSION);
 		return OP_ERROR;
-	free(buf);
-
-	if ((*fresh_mb)->n_nodes > 0) {
-		buf_size = sizeof(struct dgsh_node) * (*fresh_mb)->n_nodes;
-		buf = (char *)malloc(buf_size);
-		if ((error_code = read_chunk(read_fd, buf, buf_size,
-					&bytes_read, 1)) != OP_SUCCESS)
-			return error_code;
-		if (alloc_copy_nodes(*fresh_mb, buf, bytes_read, buf_size)
-								== OP_ERROR)
-			return OP_ERROR;
-		free(buf);
 	}
-
-	if (read_concs(read_fd, *fresh_mb) == OP_ERROR)
+	len = (size_t)header[1] << 24 | header[2] << 16 | header[3] << 8 | header[4];
+	if (len > WIRE_MAX_BODY) {
+		DPRINTF(4, "%s(): ERROR: Message block of %zu bytes.", __func__, len);
+		return OP_ERROR;
+	}
+	wb->len = 0;
+	if (!wire_reserve(wb, len) || read_full(read_fd, wb->p, len) == OP_ERROR)
 		return OP_ERROR;
+	wb->len = len;
 
-	if ((*fresh_mb)->state == PS_NEGOTIATION) {
-		if ((*fresh_mb)->n_edges > 0) {
-			DPRINTF(4, "%s(): Read %d negotiation graph edges.",
-					__func__, (*fresh_mb)->n_edges);
-			buf_size = sizeof(struct dgsh_edge) * (*fresh_mb)->n_edges;
-			buf = (char *)malloc(buf_size);
-			if ((error_code = read_chunk(read_fd, buf, buf_size,
-			     &bytes_read, 2)) != OP_SUCCESS)
-				return error_code;
-			if (alloc_copy_edges(*fresh_mb, buf, bytes_read,
-			    buf_size) == OP_ERROR)
-				return OP_ERROR;
-			free(buf);
-		}
-	} else if ((*fresh_mb)->state == PS_RUN) {
-		/**
-		 * Try read solution.
-		 * fresh_mb should be an updated version of the chosen_mb
-		 * or even the same structure because this is the phase
-		 * where we share the solution across the dgsh graph.
-                 */
-		if (read_graph_solution(read_fd, *fresh_mb) == OP_ERROR)
-			return OP_ERROR;
+	if ((*fresh_mb = (struct dgsh_negotiation *)malloc(
+	    sizeof(struct dgsh_negotiation))) == NULL) {
+		DPRINTF(4, "ERROR: Memory allocation of message block failed.");
+		return OP_ERROR;
 	}
+	if (wire_get_mb(wb, *fresh_mb) == OP_ERROR)
+		return OP_ERROR;
 	DPRINTF(4, "%s(): Read message block or solution from node %d sent from file descriptor: %s.\n", __func__, (*fresh_mb)->origin_index, ((*fresh_mb)->origin_fd_direction) ? "stdout" : "stdin");
 	return OP_SUCCESS;
 }
 
+/*
+ * Persistent cache of graph solutions.
+ * When DGSH_SOLUTION_CACHE names a directory, the initiator stores
+ * there each solution it calculates, in a file named after a hash of
+ * the graph's canonical description: the tools' names and I/O
+ * requirements, followed by the edges.
+ * The order in which the negotiation gathers the tools varies
+ * between runs, so the description lists them in a canonical order,
+ * sorted by their names, requirements, and those of their neighbours,
+ * and the edges refer to the tools by their canonical rank.
+ * Process ids take no part in the description, so that a later run of
+ * the same graph can reuse the solution and skip the constraint
+ * matching.
+ * A file holds the wire format's version, the full description,
+ * which guards against hash collisions, and the solution's
+ * node connections, numbered by the canonical ranks.
+ */
+
+/* Hashes of the nodes' neighbours, for ordering otherwise equal nodes */
+static unsigned long long *node_neighbours;
+
+/* Return the FNV-1a hash of a node's name and I/O requirements. */
+static unsigned long long
+node_hash(const struct dgsh_node *n)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	size_t i, len = strnlen(n->name, sizeof(n->name) - 1);
+	int v[4] = {n->requires_channels, n->provides_channels,
+		n->dgsh_in, n->dgsh_out};
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)n->name[i];
+		hash *= 0x100000001b3ULL;
+	}
+	for (i = 0; i < 4; i++) {
+		hash ^= (unsigned)v[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* Compare two values for qsort(3) */
+#define CMP(a, b) ((a) < (b) ? -1 : (a) > (b))
+
+/* Order two node indices by the nodes' names, requirements, and neighbours. */
+static int
+node_canonical_cmp(const void *a, const void *b)
+{
+	int i = *(const int *)a, j = *(const int *)b;
+	const struct dgsh_node *m = &chosen_mb->node_array[i];
+	const struct dgsh_node *n = &chosen_mb->node_array[j];
+	int r;
+
+	if ((r = strncmp(m->name, n->name, sizeof(m->name))) != 0)
+		return r;
+	if (m->requires_channels != n->requires_channels)
+		return CMP(m->requires_channels, n->requires_channels);
+	if (m->provides_channels != n->provides_channels)
+		return CMP(m->provides_channels, n->provides_channels);
+	if (m->dgsh_in != n->dgsh_in)
+		return CMP(m->dgsh_in, n->dgsh_in);
+	if (m->dgsh_out != n->dgsh_out)
+		return CMP(m->dgsh_out, n->dgsh_out);
+	if (node_neighbours[i] != node_neighbours[j])
+		return CMP(node_neighbours[i], node_neighbours[j]);
+	/* Indistinguishable nodes keep their gathered order. */
+	return CMP(i, j);
+}
+
+/* Order two edges by their origin and destination. */
+static int
+edge_canonical_cmp(const void *a, const void *b)
+{
+	const struct dgsh_edge *e = (const struct dgsh_edge *)a;
+	const struct dgsh_edge *f = (const struct dgsh_edge *)b;
+
+	if (e->from != f->from)
+		return CMP(e->from, f->from);
+	return CMP(e->to, f->to);
+}
+
+/* Return the position of the specified edge in the graph's edge array. */
+static int
+edge_position(const struct dgsh_edge *e)
+{
+	int i;
+
+	for (i = 0; i < chosen_mb->n_edges; i++)
+		if (chosen_mb->edge_array[i].from == e->from &&
+		    chosen_mb->edge_array[i].to == e->to)
+			return i;
+	return -1;
+}
+
+/* Order two edges by their position in the graph's edge array. */
+static int
+edge_gathered_cmp(const void *a, const void *b)
+{
+	return CMP(edge_position((const struct dgsh_edge *)a),
+		edge_position((const struct dgsh_edge *)b));
+}
+
+/*
+ * Return a dynamically allocated array with the rank of each node
+ * in the graph's canonical order, or NULL if memory is exhausted.
+ */
+static int *
+solution_cache_rank(void)
+{
+	int i, n_nodes = chosen_mb->n_nodes;
+	int *order, *rank;
+	const struct dgsh_edge *e;
+
+	order = (int *)malloc(n_nodes * sizeof(int));
+	rank = (int *)malloc(n_nodes * sizeof(int));
+	node_neighbours = (unsigned long long *)calloc(n_nodes,
+			sizeof(unsigned long long));
+	if (order == NULL || rank == NULL || node_neighbours == NULL) {
+		free(rank);
+		rank = NULL;
+		goto exit;
+	}
+	/* Sums do not depend on the edges' order. */
+	for (i = 0; i < chosen_mb->n_edges; i++) {
+		e = &chosen_mb->edge_array[i];
+		node_neighbours[e->from] +=
+			node_hash(&chosen_mb->node_array[e->to]) * 0x100000001b3ULL;
+		node_neighbours[e->to] +=
+			node_hash(&chosen_mb->node_array[e->from]);
+	}
+	for (i = 0; i < n_nodes; i++)
+		order[i] = i;
+	qsort(order, n_nodes, sizeof(int), node_canonical_cmp);
+	for (i = 0; i < n_nodes; i++)
+		rank[order[i]] = i;
+exit:
+	free(order);
+	free(node_neighbours);
+	node_neighbours = NULL;
+	return rank;
+}
+
+/*
+ * Return a dynamically allocated copy of the node connections,
+ * with node i placed at position map[i], its edges' nodes renumbered
+ * through map, and each node's edges ordered through cmp.
+ * Return NULL if memory is exhausted.
+ */
+static struct dgsh_node_connections *
+solution_renumber(const struct dgsh_node_connections *gs, const int *map,
+		int (*cmp)(const void *, const void *))
+{
+	struct dgsh_node_connections *rs, *nc;
+	struct dgsh_edge **edges;
+	int i, j, k, n;
+
+	if ((rs = (struct dgsh_node_connections *)calloc(chosen_mb->n_nodes,
+	    sizeof(struct dgsh_node_connections))) == NULL)
+		return NULL;
+	for (i = 0; i < chosen_mb->n_nodes; i++) {
+		nc = &rs[map[i]];
+		*nc = gs[i];
+		nc->node_index = map[i];
+		nc->edges_incoming = nc->edges_outgoing = NULL;
+		for (k = 0; k < 2; k++) {
+			edges = k ? &nc->edges_outgoing : &nc->edges_incoming;
+			n = k ? nc->n_edges_outgoing : nc->n_edges_incoming;
+			if (n == 0)
+				continue;
+			if ((*edges = (struct dgsh_edge *)malloc(n *
+			    sizeof(struct dgsh_edge))) == NULL)
+				goto error;
+			memcpy(*edges, k ? gs[i].edges_outgoing :
+					gs[i].edges_incoming,
+					n * sizeof(struct dgsh_edge));
+			for (j = 0; j < n; j++) {
+				(*edges)[j].from = map[(*edges)[j].from];
+				(*edges)[j].to = map[(*edges)[j].to];
+			}
+			qsort(*edges, n, sizeof(struct dgsh_edge), cmp);
+		}
+	}
+	return rs;
+error:
+	for (i = 0; i < chosen_mb->n_nodes; i++) {
+		free(rs[i].edges_incoming);
+		free(rs[i].edges_outgoing);
+	}
+	free(rs);
+	return NULL;
+}
+
+/* Encode into the buffer the canonical description of the negotiated graph. */
+static void
+solution_cache_key(struct wire_buffer *wb)
+{
+	int i, *rank, *order;
+	const struct dgsh_node *n;
+	struct dgsh_edge *edges;
+
+	rank = solution_cache_rank();
+	order = (int *)malloc(chosen_mb->n_nodes * sizeof(int));
+	edges = (struct dgsh_edge *)malloc(chosen_mb->n_edges *
+			sizeof(struct dgsh_edge));
+	if (rank == NULL || order == NULL ||
+	    (edges == NULL && chosen_mb->n_edges)) {
+		wb->error = true;
+		goto exit;
+	}
+	for (i = 0; i < chosen_mb->n_nodes; i++)
+		order[rank[i]] = i;
+
+	wire_put_uint(wb, chosen_mb->n_nodes);
+	for (i = 0; i < chosen_mb->n_nodes; i++) {
+		n = &chosen_mb->node_array[order[i]];
+		wire_put_bytes(wb, n->name, strnlen(n->name, sizeof(n->name) - 1));
+		wire_put_int(wb, n->requires_channels);
+		wire_put_int(wb, n->provides_channels);
+		wire_put_int(wb, n->dgsh_in);
+		wire_put_int(wb, n->dgsh_out);
+	}
+	for (i = 0; i < chosen_mb->n_edges; i++) {
+		edges[i].from = rank[chosen_mb->edge_array[i].from];
+		edges[i].to = rank[chosen_mb->edge_array[i].to];
+	}
+	qsort(edges, chosen_mb->n_edges, sizeof(struct dgsh_edge),
+			edge_canonical_cmp);
+	wire_put_uint(wb, chosen_mb->n_edges);
+	for (i = 0; i < chosen_mb->n_edges; i++) {
+		wire_put_int(wb, edges[i].from);
+		wire_put_int(wb, edges[i].to);
+	}
+exit:
+	free(rank);
+	free(order);
+	free(edges);
+}
+
+/*
+ * Encode into key the graph's description and return the dynamically
+ * allocated path of its cache file, or NULL if caching is disabled.
+ */
+static char *
+solution_cache_path(struct wire_buffer *key)
+{
+	const char *dir = getenv("DGSH_SOLUTION_CACHE");
+	unsigned long long hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	size_t i, len;
+	char *path;
+
+	if (dir == NULL || *dir == '\0')
+		return NULL;
+	solution_cache_key(key);
+	if (key->error)
+		return NULL;
+	for (i = 0; i < key->len; i++) {
+		hash ^= key->p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	len = strlen(dir) + 18;
+	if ((path = (char *)malloc(len)) == NULL)
+		return NULL;
+	snprintf(path, len, "%s/%016llx", dir, hash);
+	return path;
+}
+
+/*
+ * Set the graph's solution from the cache.
+ * Return OP_SUCCESS if a solution was found and OP_NOOP otherwise.
+ */
+STATIC enum op_result
+solution_cache_get(void)
+{
+	struct wire_buffer key = {0}, wb = {0};
+	enum op_result re = OP_NOOP;
+	struct dgsh_node_connections *gs = NULL;
+	const char *stored;
+	struct stat sb;
+	char *path;
+	size_t n;
+	int i, j, fd = -1;
+	int *rank = NULL, *order = NULL;
+
+	if ((path = solution_cache_path(&key)) == NULL)
+		goto exit;
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &sb) == -1 ||
+	    sb.st_size < 1 || sb.st_size > WIRE_MAX_BODY ||
+	    !wire_reserve(&wb, sb.st_size) ||
+	    read_full(fd, wb.p, sb.st_size) == OP_ERROR) {
+		DPRINTF(4, "%s(): No cached solution in %s.", __func__, path);
+		goto exit;
+	}
+	wb.len = sb.st_size;
+	if (wb.p[wb.pos++] != WIRE_VERSION)
+		goto exit;
+	stored = wire_get_bytes(&wb, &n);
+	if (wb.error || n != key.len || memcmp(stored, key.p, n) != 0) {
+		DPRINTF(4, "%s(): Cached solution in %s is for another graph.",
+				__func__, path);
+		goto exit;
+	}
+	wire_get_graph_solution(&wb, chosen_mb);
+	for (i = 0; i < chosen_mb->n_nodes && !wb.error; i++) {
+		const struct dgsh_node_connections *nc =
+			&chosen_mb->graph_solution[i];
+		unsigned n_nodes = chosen_mb->n_nodes;
+
+		if (nc->node_index != i)
+			wb.error = true;
+		/* Edges must refer to the graph's nodes. */
+		for (j = 0; j < nc->n_edges_incoming; j++)
+			if ((unsigned)nc->edges_incoming[j].from >= n_nodes ||
+			    (unsigned)nc->edges_incoming[j].to >= n_nodes)
+				wb.error = true;
+		for (j = 0; j < nc->n_edges_outgoing; j++)
+			if ((unsigned)nc->edges_outgoing[j].from >= n_nodes ||
+			    (unsigned)nc->edges_outgoing[j].to >= n_nodes)
+				wb.error = true;
+	}
+	/* Renumber the canonically ordered nodes as they were gathered. */
+	if (!wb.error && wb.pos == wb.len &&
+	    (rank = solution_cache_rank()) != NULL &&
+	    (order = (int *)malloc(chosen_mb->n_nodes * sizeof(int))) != NULL) {
+		for (i = 0; i < chosen_mb->n_nodes; i++)
+			order[rank[i]] = i;
+		gs = solution_renumber(chosen_mb->graph_solution, order,
+				edge_gathered_cmp);
+	}
+	if (gs == NULL) {
+		DPRINTF(4, "%s(): ERROR: Malformed cached solution in %s.",
+				__func__, path);
+		if (chosen_mb->graph_solution)
+			free_graph_solution(chosen_mb->n_nodes - 1);
+		goto exit;
+	}
+	free_graph_solution(chosen_mb->n_nodes - 1);
+	chosen_mb->graph_solution = gs;
+	DPRINTF(2, "%s(): Using cached solution %s.", __func__, path);
+	re = OP_SUCCESS;
+exit:
+	if (fd != -1)
+		close(fd);
+	free(path);
+	free(key.p);
+	free(wb.p);
+	free(rank);
+	free(order);
+	return re;
+}
+
+/*
+ * Store the graph's solution in the cache.
+ * The file is replaced atomically, so that concurrent runs of
+ * the same graph never read a partial solution.
+ * Failures are not fatal; they only forgo caching.
+ */
+STATIC void
+solution_cache_put(void)
+{
+	struct wire_buffer key = {0}, wb = {0};
+	struct dgsh_negotiation canonical;
+	struct dgsh_node_connections *gs;
+	char *path, *tmp_path = NULL;
+	ssize_t written;
+	size_t done = 0;
+	int fd, *rank = NULL;
+
+	if ((path = solution_cache_path(&key)) == NULL)
+		goto exit;
+	if (!wire_reserve(&wb, 1) || (rank = solution_cache_rank()) == NULL)
+		goto exit;
+	wb.p[wb.len++] = WIRE_VERSION;
+	wire_put_bytes(&wb, key.p, key.len);
+	/* Store the solution with the nodes in their canonical order. */
+	canonical = *chosen_mb;
+	if ((canonical.graph_solution = solution_renumber(chosen_mb->graph_solution,
+	    rank, edge_canonical_cmp)) == NULL)
+		goto exit;
+	wire_put_graph_solution(&wb, &canonical);
+	gs = chosen_mb->graph_solution;
+	chosen_mb->graph_solution = canonical.graph_solution;
+	free_graph_solution(chosen_mb->n_nodes - 1);
+	chosen_mb->graph_solution = gs;
+	if (wb.error || (tmp_path = (char *)malloc(strlen(path) + 8)) == NULL)
+		goto exit;
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp_path)) == -1) {
+		DPRINTF(4, "%s(): Unable to create %s: %s.", __func__,
+				tmp_path, strerror(errno));
+		goto exit;
+	}
+	while (done < wb.len) {
+		if ((written = write(fd, wb.p + done, wb.len - done)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		done += written;
+	}
+	if (close(fd) == -1 || done < wb.len ||
+	    rename(tmp_path, path) == -1) {
+		DPRINTF(4, "%s(): Unable to store solution in %s: %s.",
+				__func__, path, strerror(errno));
+		unlink(tmp_path);
+		goto exit;
+	}
+	DPRINTF(2, "%s(): Stored solution in %s.", __func__, path);
+exit:
+	free(tmp_path);
+	free(path);
+	free(key.p);
+	free(wb.p);
+	free(rank);
+}
+
 /* Construct a message block to use as a vehicle for the negotiation phase. */
 enum op_result
 construct_message_block(const char *tool_name, pid_t self_pid)
@@ -2618,6 +3238,128 @@ get_environment_vars()
 	get_env_var("DGSH_OUT", &self_node.dgsh_out);
 }
 
+/*
+ * Parse the comma-separated list of file descriptors in string s
+ * into a newly allocated array.  An empty string yields no
+ * descriptors.  All descriptors must be open.
+ */
+STATIC enum op_result
+parse_fd_list(const char *s, int **fds, int *n_fds)
+{
+	const char *p;
+	char *end;
+	long fd;
+	int n;
+
+	*fds = NULL;
+	*n_fds = 0;
+	if (*s == '\0')
+		return OP_SUCCESS;
+	for (n = 1, p = s; *p; p++)
+		if (*p == ',')
+			n++;
+	if ((*fds = (int *)malloc(sizeof(int) * n)) == NULL)
+		return OP_ERROR;
+	for (p = s; *n_fds < n; p = end + 1) {
+		errno = 0;
+		fd = strtol(p, &end, 10);
+		if (end == p || errno || fd < 0 || fd > INT_MAX ||
+		    (*end != ',' && *end != '\0')) {
+			DPRINTF(4, "%s(): Invalid file descriptor list %s",
+					__func__, s);
+			errno = EINVAL;
+			goto error;
+		}
+		if (fcntl((int)fd, F_GETFD) == -1) {
+			DPRINTF(4, "%s(): File descriptor %ld is not open",
+					__func__, fd);
+			goto error;
+		}
+		(*fds)[(*n_fds)++] = (int)fd;
+	}
+	return OP_SUCCESS;
+
+error:
+	free(*fds);
+	*fds = NULL;
+	*n_fds = 0;
+	return OP_ERROR;
+}
+
+/*
+ * Verify that the n_given channels that the launcher provided
+ * match the channels the tool requires or provides.  A NULL
+ * requirement asks for a single channel and -1 for any number.
+ */
+static enum op_result
+match_channels(int *channels, int n_given)
+{
+	int wanted = channels ? *channels : 1;
+
+	if (wanted == -1 || wanted == n_given)
+		return OP_SUCCESS;
+	DPRINTF(4, "%s(): %d channels given, %d required.",
+			__func__, n_given, wanted);
+	errno = EPROTO;
+	return OP_ERROR;
+}
+
+/*
+ * A launcher that knows the graph of communicating processes can
+ * solve it up front and pass each tool the descriptors of its
+ * pipes in DGSH_INPUT_FDS and DGSH_OUTPUT_FDS, skipping the
+ * negotiation.  An unset variable leaves the corresponding side
+ * on a single stdin or stdout channel.  The variables are removed
+ * from the environment so that the tool's own children do not
+ * inherit them.
+ * Return OP_NOOP if neither variable is set.
+ */
+static enum op_result
+use_provided_fds(int *n_input_fds, int *n_output_fds,
+		int **input_fds, int **output_fds)
+{
+	char *in = getenv("DGSH_INPUT_FDS");
+	char *out = getenv("DGSH_OUTPUT_FDS");
+
+	if (in == NULL && out == NULL)
+		return OP_NOOP;
+	DPRINTF(2, "%s(): Input fds: %s, output fds: %s.", __func__,
+			in ? in : "stdin", out ? out : "stdout");
+
+	self_pipe_fds.input_fds = self_pipe_fds.output_fds = NULL;
+	self_pipe_fds.n_input_fds = self_pipe_fds.n_output_fds = 0;
+	/*
+	 * An unset variable provides exactly one channel, stdin or
+	 * stdout, which a tool that needs none can leave unused.
+	 */
+	if ((in && (parse_fd_list(in, &self_pipe_fds.input_fds,
+				&self_pipe_fds.n_input_fds) == OP_ERROR ||
+		    match_channels(n_input_fds,
+				self_pipe_fds.n_input_fds) == OP_ERROR)) ||
+	    (!in && !(n_input_fds && *n_input_fds == 0) &&
+		    match_channels(n_input_fds, 1) == OP_ERROR) ||
+	    (out && (parse_fd_list(out, &self_pipe_fds.output_fds,
+				&self_pipe_fds.n_output_fds) == OP_ERROR ||
+		    match_channels(n_output_fds,
+				self_pipe_fds.n_output_fds) == OP_ERROR)) ||
+	    (!out && !(n_output_fds && *n_output_fds == 0) &&
+		    match_channels(n_output_fds, 1) == OP_ERROR)) {
+		free(self_pipe_fds.input_fds);
+		free(self_pipe_fds.output_fds);
+		return OP_ERROR;
+	}
+	unsetenv("DGSH_INPUT_FDS");
+	unsetenv("DGSH_OUTPUT_FDS");
+
+	setup_file_descriptors(in ? NULL : n_input_fds,
+			out ? NULL : n_output_fds,
+			in ? NULL : input_fds, out ? NULL : output_fds);
+	return establish_io_connections(in ? input_fds : NULL,
+			in ? n_input_fds : NULL,
+			out ? output_fds : NULL,
+			out ? n_output_fds : NULL);
+}
+
 /**
  * Verify tool's I/O channel requirements are sane.
  * We might need some upper barrier for requirements too,
@@ -2818,6 +3560,19 @@ dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 		return dgsh_exit(-1, flags);
 	}
 
+	/* Solution provided by the launcher */
+	switch (use_provided_fds(n_input_fds, n_output_fds, input_fds,
+				output_fds)) {
+	case OP_NOOP:
+		break;
+	case OP_ERROR:
+		negotiation_completed = 1;
+		return dgsh_exit(-1, flags);
+	default:
+		negotiation_completed = 1;
+		return dgsh_exit(PS_COMPLETE, flags);
+	}
+
 	self_node.dgsh_in = 0;
 	self_node.dgsh_out = 0;
 	get_environment_vars();
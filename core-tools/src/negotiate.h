@@ -42,6 +42,17 @@ union fdmsg {
 	char buf[CMSG_SPACE(sizeof(int))];
 };
 
+/*
+ * Most file descriptors passed in a single message;
+ * the limit Linux places on SCM_RIGHTS (SCM_MAX_FD).
+ */
+#define FD_BATCH_MAX 253
+
+union fdbatch {
+	struct cmsghdr h;
+	char buf[CMSG_SPACE(sizeof(int) * FD_BATCH_MAX)];
+};
+
 /*
  * Results of operations
  * Also negative values signify a failed operation's errno value
@@ -88,6 +99,8 @@ extern int nfd;
 extern int next_fd(int fd, bool *ro);
 extern int read_fd(int input_socket);
 extern void write_fd(int output_socket, int fd_to_write);
+extern void read_fd_array(int input_socket, int *fds, int n_fds);
+extern void write_fd_array(int output_socket, const int *fds, int n_fds);
 #else
 
 #define STATIC static
@@ -164,6 +177,7 @@ struct dgsh_negotiation {
 };
 
 enum op_result solve_graph(void);
+const char *state_name(enum prot_state s);
 enum op_result construct_message_block(const char *tool_name, pid_t pid);
 struct dgsh_conc *find_conc(struct dgsh_negotiation *mb, pid_t pid);
 pid_t get_origin_pid(struct dgsh_negotiation *mb);
@@ -173,8 +187,12 @@ enum op_result read_message_block(int read_fd,
 		struct dgsh_negotiation **fresh_mb);
 enum op_result write_message_block(int write_fd);
 void free_mb(struct dgsh_negotiation *mb);
+enum op_result merge_message_block(struct dgsh_negotiation *mb,
+		const struct dgsh_negotiation *from);
 int read_fd(int input_socket);
 void write_fd(int output_socket, int fd_to_write);
+void read_fd_array(int input_socket, int *fds, int n_fds);
+void write_fd_array(int output_socket, const int *fds, int n_fds);
 /* Alarm mechanism and on_exit handling */
 void set_negotiation_complete();
 void dgsh_alarm_handler(int);
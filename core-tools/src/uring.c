@@ -0,0 +1,221 @@
+/*
+ * Copyright 2026 agent
+ *
+ * Minimal io_uring interface for asynchronous file I/O.
+ * The ring is set up through the raw system calls, so that
+ * no additional library is needed.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+struct uring {
+	int fd;
+	unsigned entries;		/* Maximum requests in flight */
+	unsigned inflight;		/* Requests queued and not reaped */
+	unsigned pending;		/* Requests queued and not submitted */
+	/* Submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+struct uring *
+uring_open(unsigned entries)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+	void *sqes;
+	int fd;
+	const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+		IORING_FEAT_RW_CUR_POS;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = (int)syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		return NULL;
+	/*
+	 * Single mmap and no completion drops are needed (Linux 5.5),
+	 * as are the IORING_OP_READ and IORING_OP_WRITE requests, which
+	 * arrived in Linux 5.6 together with IORING_FEAT_RW_CUR_POS.
+	 */
+	if ((p.features & needed) != needed)
+		goto fail;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+	if ((sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+		goto fail;
+	cq = sq;
+	if ((sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	    IORING_OFF_SQES)) == MAP_FAILED) {
+		munmap(sq, sq_size);
+		goto fail;
+	}
+
+	if ((u = malloc(sizeof(struct uring))) == NULL) {
+		munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+		munmap(sq, sq_size);
+		goto fail;
+	}
+	u->fd = fd;
+	u->entries = p.sq_entries;
+	u->inflight = u->pending = 0;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sqes = sqes;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return u;
+
+fail:
+	close(fd);
+	return NULL;
+}
+
+/* Add a request to the submission queue */
+static bool
+uring_queue(struct uring *u, int opcode, int fd, const void *buf, size_t len,
+		off_t offset, unsigned long long user_data)
+{
+	unsigned tail, index;
+	struct io_uring_sqe *sqe;
+
+	if (u->inflight == u->entries)
+		return false;
+	/* Only we write the tail; the kernel consumes all submitted entries. */
+	tail = *u->sq_tail;
+	index = tail & *u->sq_mask;
+	sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->inflight++;
+	u->pending++;
+	return true;
+}
+
+bool
+uring_read(struct uring *u, int fd, void *buf, size_t len, off_t offset,
+		unsigned long long user_data)
+{
+	return uring_queue(u, IORING_OP_READ, fd, buf, len, offset, user_data);
+}
+
+bool
+uring_write(struct uring *u, int fd, const void *buf, size_t len,
+		off_t offset, unsigned long long user_data)
+{
+	return uring_queue(u, IORING_OP_WRITE, fd, buf, len, offset, user_data);
+}
+
+bool
+uring_reap(struct uring *u, bool wait, unsigned long long *user_data, int *res)
+{
+	unsigned head, flags;
+	struct io_uring_cqe *cqe;
+	int n;
+
+	for (;;) {
+		head = *u->cq_head;
+		if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			*user_data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+			u->inflight--;
+			return true;
+		}
+		if (u->pending == 0 && (!wait || u->inflight == 0))
+			return false;
+		flags = wait ? IORING_ENTER_GETEVENTS : 0;
+		n = uring_enter(u->fd, u->pending, wait ? 1 : 0, flags);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			return false;
+		}
+		u->pending -= n;
+		if (!wait && head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+			return false;
+	}
+}
+
+#else
+
+struct uring *
+uring_open(unsigned entries)
+{
+	return NULL;
+}
+
+bool
+uring_read(struct uring *u, int fd, void *buf, size_t len, off_t offset,
+		unsigned long long user_data)
+{
+	return false;
+}
+
+bool
+uring_write(struct uring *u, int fd, const void *buf, size_t len,
+		off_t offset, unsigned long long user_data)
+{
+	return false;
+}
+
+bool
+uring_reap(struct uring *u, bool wait, unsigned long long *user_data, int *res)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2026 agent
+ *
+ * Minimal io_uring interface for asynchronous file I/O
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct uring;
+
+/*
+ * Create a ring able to hold the specified number of requests in flight.
+ * Return NULL if io_uring is not available.
+ */
+struct uring *uring_open(unsigned entries);
+
+/*
+ * Queue a read or write of len bytes at the file's specified offset.
+ * The request's completion is identified by user_data.
+ * Return false if the maximum number of requests are in flight.
+ */
+bool uring_read(struct uring *u, int fd, void *buf, size_t len, off_t offset,
+		unsigned long long user_data);
+bool uring_write(struct uring *u, int fd, const void *buf, size_t len,
+		off_t offset, unsigned long long user_data);
+
+/*
+ * Submit the queued requests and obtain a completed one, setting
+ * its user_data and result (bytes transferred or -errno).
+ * When wait is set, block until a request completes; otherwise
+ * return false if none has completed.
+ */
+bool uring_reap(struct uring *u, bool wait, unsigned long long *user_data,
+		int *res);
+
+#endif /* URING_H */
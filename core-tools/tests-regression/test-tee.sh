@@ -91,6 +91,14 @@ do
 	cat a b c d | sort -n >words2
 	ensure_same "Line scatter reliable file $flags" words words2
 
+	# Test writing regular input files from their mapping
+	$DGSH_TEE $flags -Z -s -b 128 <words -o a -o b -o c -o d
+	cat a b c d | sort -n >words2
+	ensure_same "Line scatter mapped file $flags" words words2
+	$DGSH_TEE $flags -Z -b 128 -i words -i words >a
+	cat words words >words2
+	ensure_same "Mapped file concatenation $flags" words2 a
+
 	# Test scatter to blocking sinks
 	cat -n $WORDS >words
 	for buffer in 128 1000000
@@ -108,11 +116,163 @@ do
 	cat a b c d | sort -n >words2
 	ensure_same "Line scatter efficient $flags" words words2
 
+	# Test line scatter weighted by the sinks' drain rate
+	$DGSH_TEE $flags -w -b 128 <words -o a -o b -o c -o d
+	cat a b c d | sort -n >words2
+	ensure_same "Line scatter weighted $flags" words words2
+
+	# Test that a slow reader is given less data than a fast one
+	perl -e 'for ($i = 0; $i < 200000; $i++) { print "$i\n" }' >lines
+	rm -f a b
+	mkfifo a b
+	$DGSH_TEE $flags -w -b 4096 <lines -o a -o b &
+	cat a >a.out &
+	perl -e 'while (sysread(STDIN, $b, 4096) > 0) { print $b; select(undef, undef, undef, 0.01) }' <b >b.out &
+	wait
+	cat a.out b.out | sort -n >lines2
+	ensure_same "Weighted scatter slow reader $flags" lines lines2
+	echo -n "Weighted scatter slow reader share $flags "
+	if [ $(wc -c <b.out) -ge $(($(wc -c <a.out) / 4)) ]
+	then
+		echo "Weighted scatter slow reader share $flags: $(wc -c <b.out) bytes to the slow reader, $(wc -c <a.out) to the fast one" 1>&2
+		exit 1
+	fi
+	echo OK
+	rm -f a b a.out b.out lines lines2
+
+	# Test scatter of fixed-length records, ending with a partial one
+	perl -e 'for ($i = 0; $i < 20000; $i++) { printf("%15d\n", $i) } print "tail\n"' >records
+	for buffer in 100 4096
+	do
+		$DGSH_TEE $flags -s -l 16 -b $buffer <records -o a -o b -o c -o d
+		cat a b c d | sort -n >records2
+		sort -n records >records3
+		ensure_same "Fixed-length record scatter $flags -b $buffer" records3 records2
+	done
+	rm records records2 records3
+
+	# Test scatter partitioned by a key field and by a key byte range
+	awk '{printf("k%d\t%d\n", $1 % 37, $1)}' words >records
+	for key in '-k 1' '-k 1 -d k' '-c 1-3'
+	do
+		$DGSH_TEE $flags $key -b 128 <records -o a -o b -o c -o d
+		cat a b c d | sort -n -k 2 >records2
+		sort -n -k 2 records >records3
+		ensure_same "Partitioned scatter $flags $key" records3 records2
+		for i in a b c d
+		do
+			cut -f 1 $i | sort -u
+		done | sort | uniq -d >records2
+		ensure_same "Partitioned scatter keys $flags $key" /dev/null records2
+	done
+
+	# Records for a terminated sink are dropped with a single warning
+	rm -f a b
+	mkfifo a b
+	$DGSH_TEE $flags -k 1 -b 128 <records -o a -o b 2>err &
+	cat a >a.out &
+	head -1 b >/dev/null &
+	wait
+	echo 'dgsh-tee: Dropping records for terminated output b' >records2
+	ensure_same "Partitioned scatter terminated sink $flags" records2 err
+	cut -f 1 a.out | sort -u | while read key
+	do
+		awk -F '\t' -v key="$key" '$1 == key' records
+	done | sort >records2
+	sort a.out >records3
+	ensure_same "Partitioned scatter remaining sink $flags" records2 records3
+	rm -f a b a.out err records records2 records3
+
+	# Test ordered scatter, per-line processing, and ordered gather
+	for chunk in 1 7
+	do
+		$DGSH_TEE $flags -R $chunk -b 128 <words -o a -o b -o c -o d
+		for i in a b c d
+		do
+			sed 's/^/x/' $i >$i.out
+		done
+		$DGSH_TEE $flags -R $chunk -b 128 -i a.out -i b.out -i c.out -i d.out >words2
+		sed 's/^/x/' words >words3
+		ensure_same "Ordered scatter gather $flags -R $chunk" words3 words2
+	done
+	rm a.out b.out c.out d.out
+
+	# Test concurrent ordered processing with chunks larger than memory
+	if [ -z "$flags" ]
+	then
+		rm -f a b a.out b.out
+		mkfifo a b a.out b.out
+		$DGSH_TEE $flags -R 5000 <words -o a -o b &
+		sed 's/^/x/' <a >a.out &
+		sed 's/^/x/' <b >b.out &
+		$DGSH_TEE $flags -R 5000 -m 16k -b 4096 -i a.out -i b.out >words2
+		wait
+		ensure_same "Ordered scatter gather low-memory $flags" words3 words2
+		rm -f a b a.out b.out
+	fi
+	rm words3
+
+	# Test that ordered chunks are not silently lost
+	if [ -z "$flags" ]
+	then
+		rm -f a b
+		mkfifo a b
+		$DGSH_TEE $flags -R 10 -b 128 <words -o a -o b 2>err &
+		cat a >/dev/null &
+		head -1 b >/dev/null
+		if wait %1
+		then
+			echo "Ordered scatter terminated sink $flags: unexpected success" 1>&2
+			exit 1
+		fi
+		wait
+		echo 'dgsh-tee: Output b terminated before writing its ordered chunk' >err2
+		ensure_same "Ordered scatter terminated sink $flags" err2 err
+		rm -f a b err err2
+	fi
+	head -5 words >a.out
+	head -25 words | tail -20 >b.out
+	if $DGSH_TEE $flags -R 10 -i a.out -i b.out >/dev/null 2>err
+	then
+		echo "Ordered gather short input $flags: unexpected success" 1>&2
+		exit 1
+	fi
+	echo 'dgsh-tee: Input b.out has records after an earlier input ended' >err2
+	ensure_same "Ordered gather short input $flags" err2 err
+	rm -f a.out b.out err err2
+
 	# Test with a buffer smaller than line size
 	$DGSH_TEE $flags -s -b 5 <words -o a -o b -o c -o d
 	cat a b c d | sort -n >words2
 	ensure_same "Small buffer $flags" words words2
 
+	# Test scatter of null-terminated records
+	tr '\n' '\0' <words >words0
+	$DGSH_TEE $flags -s -t '' -b 128 <words0 -o a -o b -o c -o d
+	cat a b c d | tr '\0' '\n' | sort -n >words2
+	ensure_same "Null-terminated scatter $flags" words words2
+	rm words0
+
+	# Test line scatter through a small wrapping ring buffer
+	# (Input-side buffering would exhaust its memory)
+	if [ $(uname) = Linux ] && [ -z "$flags" ]
+	then
+		$DGSH_TEE $flags -r -s -b 128 -m 4k <words -o a -o b -o c -o d
+		cat a b c d | sort -n >words2
+		ensure_same "Ring buffer scatter $flags" words words2
+
+		# The inputs share the memory of their rings
+		rm -f a b
+		mkfifo a b
+		cat words >a &
+		cat words >b &
+		$DGSH_TEE $flags -r -b 128 -m 4k -i a -i b >words2
+		wait
+		cat words words >expect
+		ensure_same "Ring buffer concatenation $flags" expect words2
+		rm -f a b expect
+	fi
+
 	# Test with data less than the buffer size
 	head -50 $WORDS | cat -n >words
 	$DGSH_TEE $flags -s -b 1000000 <words -o a -o b -o c -o d
@@ -133,6 +293,12 @@ do
 	ensure_same "Plain distribution $flags" $DGSH_TEE_C b
 	rm a b
 
+	# Test plain distribution through threads
+	$DGSH_TEE $flags -P -b 64 <$DGSH_TEE_C -o a -o b
+	ensure_same "Threaded distribution $flags" $DGSH_TEE_C a
+	ensure_same "Threaded distribution $flags" $DGSH_TEE_C b
+	rm a b
+
 	# Test 2->4 distribution
 	$DGSH_TEE $flags -b 64 -i $WORDS -i $DGSH_TEE_C -o a -o b -o c -o d
 	ensure_same "2->4 distribution $flags" $WORDS a
@@ -154,14 +320,21 @@ do
 	ensure_same "Permutation $flags" a tee/perm.ok
 	rm a
 
+	# Test the final I/O statistics
+	$DGSH_TEE $flags -S stats -b 64 <$DGSH_TEE_C -o a -o b
+	size=$(wc -c <$DGSH_TEE_C)
+	printf 'bytes_read %d\nbytes_written %d\nbytes_written %d\n' $size $size $size >expect
+	sed -n 's/.*"\(bytes_[a-z]*\)": \([0-9]*\).*/\1 \2/p' stats >result
+	ensure_same "Statistics $flags" expect result
+	rm a b stats expect result
+
 	# Test output to stdout
 	$DGSH_TEE $flags -b 64 <$DGSH_TEE_C >a
 	ensure_same "Stdout $flags" $DGSH_TEE_C a
 	rm a
 
 	# Test buffering
-	# When -l is supported add, say, -l 16
-	for flags2 in '' '-m 2k' '-m 2k -f'
+	for flags2 in '' '-l 16' '-m 2k' '-m 2k -f'
 	do
 		test="tee-fastout$flags$flags2"
 		dd bs=1k count=1024 if=/dev/zero 2>/dev/null | $DGSH_TEE -M $flags $flags2 -b 1024 >/dev/null 2>"tee/$test.test"
@@ -187,6 +360,49 @@ do
 	fi
 	rm -f lines try try2 try.out try2.out err
 
+	# Test policies for an output that falls behind
+	perl -e 'for ($i = 0; $i < 500; $i++) { print "$i ", "x" x 500, "\n"}' >lines
+	for policy in spill drop
+	do
+		rm -f try
+		mkfifo try
+		$DGSH_TEE $flags -b 512 -m 4k -O 2:$policy:1k -o try2 -o try <lines &
+		{ read x ; echo $x ; sleep 1 ; cat ; } < try > try.out
+		wait
+		ensure_same "Output policy $policy (fast) $flags" lines try2
+		if [ $policy = spill ]
+		then
+			ensure_same "Output policy $policy (slow) $flags" lines try.out
+		else
+			# Records are dropped whole and kept in order
+			awk '{print length($2)}' try.out | sort -u >lengths
+			echo 500 >expect
+			ensure_same "Output policy $policy (records) $flags" expect lengths
+			sort -n try.out >try2
+			ensure_same "Output policy $policy (order) $flags" try.out try2
+		fi
+	done
+
+	# Test lagging outputs among several, and a terminated one
+	# (Input-side buffering would exhaust its memory)
+	if [ -z "$flags" ]
+	then
+		rm -f try try2 try3 try4
+		mkfifo try try2 try3 try4
+		$DGSH_TEE $flags -b 512 -m 4k -O 3:spill:1k -O 4:drop:1k -o try -o try2 -o try3 -o try4 <lines &
+		cat try >try.out &
+		head -1 try2 >/dev/null &
+		{ read x ; echo $x ; sleep 1 ; cat ; } < try3 > try3.out &
+		{ read x ; echo $x ; sleep 1 ; cat ; } < try4 > try4.out &
+		wait
+		ensure_same "Output policies of several outputs (fast) $flags" lines try.out
+		ensure_same "Output policies of several outputs (spill) $flags" lines try3.out
+		awk '{print length($2)}' try4.out | sort -u >lengths
+		echo 500 >expect
+		ensure_same "Output policies of several outputs (drop) $flags" expect lengths
+	fi
+	rm -f lines try try2 try3 try4 try.out try3.out try4.out lengths expect
+
 	# Test low-memory behavior (file)
 	rm -f try try2
 	mkfifo try try2
@@ -197,6 +413,85 @@ do
 	ensure_same "Low-memory temporary file (try) $flags" lines try.out
 	ensure_same "Low-memory temporary file (try2) $flags" lines try2.out
 	rm -f lines try try2 try.out try2.out err
+
+	# Test low-memory behavior (memory-mapped file)
+	rm -f try try2
+	mkfifo try try2
+	perl -e 'for ($i = 0; $i < 500; $i++) { print "x" x 500, "\n"}' | tee lines | $DGSH_TEE -F $flags -b 4096 -m 16k -o try -o try2 2>err &
+	cat try2 >try2.out &
+	{ read x ; echo $x ; sleep 1 ; cat ; } < try > try.out &
+	wait
+	ensure_same "Low-memory mapped file (try) $flags" lines try.out
+	ensure_same "Low-memory mapped file (try2) $flags" lines try2.out
+	rm -f lines try try2 try.out try2.out err
+
+	# Test low-memory behavior (asynchronous file I/O)
+	rm -f try try2
+	mkfifo try try2
+	perl -e 'for ($i = 0; $i < 500; $i++) { print "x" x 500, "\n"}' | tee lines | $DGSH_TEE -U $flags -b 512 -m 2k -o try -o try2 2>err &
+	cat try2 >try2.out &
+	{ read x ; echo $x ; sleep 1 ; cat ; } < try > try.out &
+	wait
+	ensure_same "Low-memory asynchronous file (try) $flags" lines try.out
+	ensure_same "Low-memory asynchronous file (try2) $flags" lines try2.out
+	rm -f lines try try2 try.out try2.out err
+
+	# Test low-memory behavior (compression)
+	for flags2 in '-C' '-C -f'
+	do
+		rm -f try try2
+		mkfifo try try2
+		perl -e 'for ($i = 0; $i < 500; $i++) { print "x" x 500, "\n"}' | tee lines | $DGSH_TEE $flags2 $flags -b 512 -m 16k -o try -o try2 2>err &
+		cat try2 >try2.out &
+		{ read x ; echo $x ; sleep 1 ; cat ; } < try > try.out &
+		wait
+		ensure_same "Low-memory compressed $flags2 (try) $flags" lines try.out
+		ensure_same "Low-memory compressed $flags2 (try2) $flags" lines try2.out
+		rm -f lines try try2 try.out try2.out err
+	done
+
+	# Test copying between pipes without reading the data
+	# (Input-side buffering would exhaust its memory)
+	if [ -z "$flags" ]
+	then
+		rm -f try try2
+		mkfifo try try2
+		perl -e 'for ($i = 0; $i < 500; $i++) { print "x" x 500, "\n"}' | tee lines | $DGSH_TEE -z $flags -b 4096 -m 16k -o try -o try2 2>err &
+		cat try2 >try2.out &
+		{ read x ; echo $x ; sleep 1 ; cat ; } < try > try.out &
+		wait
+		ensure_same "Zero-copy (try) $flags" lines try.out
+		ensure_same "Zero-copy (try2) $flags" lines try2.out
+		rm -f lines try try2 try.out try2.out err
+	fi
+
+	# Test mapping buffered data into a lagging FIFO
+	# (Input-side buffering would exhaust its memory)
+	if [ -z "$flags" ]
+	then
+		rm -f try try2
+		mkfifo try try2
+		perl -e 'for ($i = 0; $i < 500; $i++) { print "x" x 500, "\n"}' | tee lines | $DGSH_TEE -V $flags -b 4096 -m 16k -o try -o try2 2>err &
+		cat try2 >try2.out &
+		{ read x ; echo $x ; sleep 1 ; cat ; } < try > try.out &
+		wait
+		ensure_same "Mapped pages (try) $flags" lines try.out
+		ensure_same "Mapped pages (try2) $flags" lines try2.out
+		rm -f lines try try2 try.out try2.out err
+
+		# Test truncating a mapped input file while it is being written
+		cat $WORDS $WORDS $WORDS >lines
+		rm -f try
+		mkfifo try
+		$DGSH_TEE -Z $flags -b 4096 <lines -o try 2>err &
+		{ read x ; sleep 2 ; cat >/dev/null ; } < try &
+		sleep 1
+		: >lines
+		wait
+		echo 'dgsh-tee: Input file standard input truncated while being read' >expect
+		ensure_same "Mapped file truncation $flags" expect err
+		rm -f lines try err expect
+	fi
 done
 
 # Test asynchronous reading from multiple input files
@@ -217,4 +512,34 @@ do
 	rm -f a b c d expect
 done
 
+# Test read-ahead of the next chained input
+# Without it the following blocks: a's data follow b's
+rm -f a b d
+mkfifo a b
+{ exec 3>a ; cat $WORDS >b ; echo end >&3 ; } &
+$DGSH_TEE -b 4096 -i a -i b >d
+wait
+{ echo end ; cat $WORDS ; } >expect
+ensure_same "Chained read-ahead" expect d
+rm -f a b d expect
+
+# The read-ahead input is charged against the memory limit,
+# leaving at least half of it to the input being read
+rm -f a b d
+mkfifo a b
+cat $WORDS >a &
+cat $WORDS >b &
+$DGSH_TEE -M -m 64k -b 4096 -i a -i b >d 2>stats
+wait
+cat $WORDS $WORDS >expect
+ensure_same "Chained read-ahead memory" expect d
+echo -n "Chained read-ahead memory limit "
+if ! awk '/^Buffers allocated/ { n++ } n == 2 { exit $8 > 8 }' stats
+then
+	echo "Chained read-ahead memory limit: more than half of the memory read ahead" 1>&2
+	exit 1
+fi
+echo OK
+rm -f a b d expect stats
+
 exit 0
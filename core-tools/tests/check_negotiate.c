@@ -449,36 +449,6 @@ setup_test_point_io_direction(void)
 	setup_self_node_io_side();
 }*/
 
-void
-setup_test_alloc_copy_graph_solution(void)
-{
-	setup_mb(&fresh_mb);
-}
-
-void
-setup_test_alloc_copy_concs(void)
-{
-	setup_mb(&fresh_mb);
-}
-
-void
-setup_test_alloc_copy_edges(void)
-{
-	setup_mb(&fresh_mb);
-}
-
-void
-setup_test_alloc_copy_nodes(void)
-{
-	setup_mb(&fresh_mb);
-}
-
-void
-setup_test_read_chunk(void)
-{
-	setup_self_node_io_side();
-}
-
 void
 setup_test_alloc_io_fds(void)
 {
@@ -515,23 +485,6 @@ setup_test_read_input_fds(void)
 	setup_self_node();
 }
 
-void
-setup_test_read_graph_solution(void)
-{
-	setup_mb(&fresh_mb);
-	setup_chosen_mb();
-	setup_self_node_io_side();
-}
-
-void
-setup_test_read_concs(void)
-{
-	setup_mb(&fresh_mb);
-	setup_chosen_mb();
-	setup_concs(chosen_mb);
-	setup_self_node_io_side();
-}
-
 void
 setup_test_write_graph_solution(void)
 {
@@ -828,30 +781,6 @@ retire_test_point_io_direction(void)
 	retire_chosen_mb();
 }*/
 
-void
-retire_test_alloc_copy_graph_solution(void)
-{
-	retire_mb(fresh_mb);
-}
-
-void
-retire_test_alloc_copy_concs(void)
-{
-	retire_mb(fresh_mb);
-}
-
-void
-retire_test_alloc_copy_edges(void)
-{
-	retire_mb(fresh_mb);
-}
-
-void
-retire_test_alloc_copy_nodes(void)
-{
-	retire_mb(fresh_mb);
-}
-
 void
 retire_test_alloc_io_fds(void)
 {
@@ -903,21 +832,6 @@ retire_test_write_message_block(void)
 	retire_chosen_mb();
 }
 
-void
-retire_test_read_graph_solution(void)
-{
-	retire_chosen_mb();
-	retire_mb(fresh_mb);
-}
-
-void
-retire_test_read_concs(void)
-{
-	retire_concs(chosen_mb);
-	retire_chosen_mb();
-	retire_mb(fresh_mb);
-}
-
 void
 retire_test_write_graph_solution(void)
 {
@@ -1129,6 +1043,147 @@ START_TEST(test_solve_graph)
 }
 END_TEST
 
+START_TEST(test_solution_cache)
+{
+	char dir[] = "/tmp/dgsh-cache-XXXXXX";
+	struct wire_buffer key = {0};
+	struct dgsh_node_connections *graph_solution;
+	char *path;
+
+	DPRINTF(4, "%s", __func__);
+	ck_assert(mkdtemp(dir) != NULL);
+	setenv("DGSH_SOLUTION_CACHE", dir, 1);
+
+	/* A miss solves the graph and stores its solution. */
+	ck_assert_int_eq(solution_cache_get(), OP_NOOP);
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	retire_graph_solution(chosen_mb->graph_solution,
+			chosen_mb->n_nodes - 1);
+	chosen_mb->graph_solution = NULL;
+
+	/* A hit restores the solution. */
+	ck_assert_int_eq(solution_cache_get(), OP_SUCCESS);
+	graph_solution = chosen_mb->graph_solution;
+	ck_assert_int_eq(graph_solution[3].node_index, 3);
+	ck_assert_int_eq(graph_solution[3].n_edges_incoming, 2);
+	ck_assert_int_eq(graph_solution[3].n_edges_outgoing, 0);
+	ck_assert_int_eq(graph_solution[3].edges_incoming[0].instances, 1);
+	ck_assert_int_eq(graph_solution[3].edges_incoming[1].instances, 1);
+	ck_assert_int_eq(graph_solution[0].edges_outgoing[0].instances, 1);
+	ck_assert_int_eq(graph_solution[1].edges_outgoing[1].instances, 1);
+	retire_graph_solution(chosen_mb->graph_solution,
+			chosen_mb->n_nodes - 1);
+	chosen_mb->graph_solution = NULL;
+
+	/* Process ids do not take part in the graph's description. */
+	chosen_mb->node_array[0].pid += 1000;
+	ck_assert_int_eq(solution_cache_get(), OP_SUCCESS);
+	retire_graph_solution(chosen_mb->graph_solution,
+			chosen_mb->n_nodes - 1);
+	chosen_mb->graph_solution = NULL;
+
+	/* A corrupted file is ignored. */
+	path = solution_cache_path(&key);
+	ck_assert_int_eq(truncate(path, 20), 0);
+	ck_assert_int_eq(solution_cache_get(), OP_NOOP);
+	ck_assert_int_eq((long int)chosen_mb->graph_solution, 0);
+
+	/* I/O requirements do. */
+	chosen_mb->node_array[3].requires_channels = -1;
+	ck_assert_int_eq(solution_cache_get(), OP_NOOP);
+
+	/* Solving again stores a solution for the changed graph. */
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+
+	unlink(path);
+	free(path);
+	free(key.p);
+	key.p = NULL;
+	key.len = key.size = 0;
+	path = solution_cache_path(&key);
+	ck_assert_int_eq(unlink(path), 0);
+	free(path);
+	free(key.p);
+	ck_assert_int_eq(rmdir(dir), 0);
+	unsetenv("DGSH_SOLUTION_CACHE");
+}
+END_TEST
+
+START_TEST(test_solution_cache_permuted)
+{
+	char dir[] = "/tmp/dgsh-cache-XXXXXX";
+	struct wire_buffer key = {0};
+	struct dgsh_node_connections *cached, *solved;
+	struct dgsh_node nodes[4];
+	struct dgsh_edge edges[5];
+	int perm[4] = {3, 1, 0, 2}, inverse[4];
+	char *path;
+	int i, j;
+
+	DPRINTF(4, "%s", __func__);
+	ck_assert(mkdtemp(dir) != NULL);
+	setenv("DGSH_SOLUTION_CACHE", dir, 1);
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	retire_graph_solution(chosen_mb->graph_solution,
+			chosen_mb->n_nodes - 1);
+	chosen_mb->graph_solution = NULL;
+
+	/* Gather the same graph in a different order. */
+	for (i = 0; i < 4; i++) {
+		nodes[i] = chosen_mb->node_array[perm[i]];
+		nodes[i].index = i;
+		inverse[perm[i]] = i;
+	}
+	for (i = 0; i < 5; i++) {
+		edges[i] = chosen_mb->edge_array[4 - i];
+		edges[i].from = inverse[edges[i].from];
+		edges[i].to = inverse[edges[i].to];
+	}
+	memcpy(chosen_mb->node_array, nodes, sizeof(nodes));
+	memcpy(chosen_mb->edge_array, edges, sizeof(edges));
+
+	/* The cached solution matches the one solved for the new order. */
+	ck_assert_int_eq(solution_cache_get(), OP_SUCCESS);
+	cached = chosen_mb->graph_solution;
+	chosen_mb->graph_solution = NULL;
+	unsetenv("DGSH_SOLUTION_CACHE");
+	ck_assert_int_eq(solve_graph(), OP_SUCCESS);
+	solved = chosen_mb->graph_solution;
+	for (i = 0; i < 4; i++) {
+		ck_assert_int_eq(cached[i].node_index, i);
+		ck_assert_int_eq(cached[i].n_edges_incoming,
+				solved[i].n_edges_incoming);
+		ck_assert_int_eq(cached[i].n_edges_outgoing,
+				solved[i].n_edges_outgoing);
+		ck_assert_int_eq(cached[i].n_instances_incoming_free,
+				solved[i].n_instances_incoming_free);
+		ck_assert_int_eq(cached[i].n_instances_outgoing_free,
+				solved[i].n_instances_outgoing_free);
+		for (j = 0; j < cached[i].n_edges_incoming; j++) {
+			ck_assert_int_eq(cached[i].edges_incoming[j].from,
+					solved[i].edges_incoming[j].from);
+			ck_assert_int_eq(cached[i].edges_incoming[j].instances,
+					solved[i].edges_incoming[j].instances);
+		}
+		for (j = 0; j < cached[i].n_edges_outgoing; j++) {
+			ck_assert_int_eq(cached[i].edges_outgoing[j].to,
+					solved[i].edges_outgoing[j].to);
+			ck_assert_int_eq(cached[i].edges_outgoing[j].instances,
+					solved[i].edges_outgoing[j].instances);
+		}
+	}
+	retire_graph_solution(cached, chosen_mb->n_nodes - 1);
+
+	setenv("DGSH_SOLUTION_CACHE", dir, 1);
+	path = solution_cache_path(&key);
+	ck_assert_int_eq(unlink(path), 0);
+	free(path);
+	free(key.p);
+	ck_assert_int_eq(rmdir(dir), 0);
+	unsetenv("DGSH_SOLUTION_CACHE");
+}
+END_TEST
+
 START_TEST(test_calculate_conc_fds)
 {
 	DPRINTF(4, "%s()", __func__);
@@ -1543,387 +1598,159 @@ START_TEST(test_alloc_node_connections)
 }
 END_TEST
 
-START_TEST(test_write_concs)
+/* Pass chosen_mb through a pipe in the wire format and return the block read. */
+struct dgsh_negotiation *
+wire_round_trip(void)
 {
 	int fd[2];
-	int buf_size = getpagesize();
-	int pid;
-	int i;
-        int n_concs = chosen_mb->n_concs;
-        int concs_size = sizeof(struct dgsh_conc) * n_concs;
-	struct dgsh_conc *conc_array = 
-		(struct dgsh_conc *)malloc(concs_size);
+	struct dgsh_negotiation *mb = NULL;
 
 	if (pipe(fd) == -1) {
 		perror("pipe open failed");
 		exit(1);
 	}
-	DPRINTF(4, "%s()...", __func__);
-	DPRINTF(4, "Opened pipe pair %d - %d.", fd[0], fd[1]);
-
-	pid = fork();
-	if (pid <= 0) {
-		int rsize = -1;
-		DPRINTF(4, "Child speaking with pid %d.", (int)getpid());
-
-		close(fd[1]);
-		DPRINTF(4, "Child reads concs of size %d.",
-					concs_size);
-		rsize = read(fd[0], conc_array, concs_size);
-		if (rsize == -1) {
-			DPRINTF(4, "Write concs failed.");
-			exit(1);
-		}
-
-		DPRINTF(4, "Child: closes fd %d.", fd[0]);
-		close(fd[0]);
-		DPRINTF(4, "Child with pid %d exits.", (int)getpid());
-	} else {
-		DPRINTF(4, "Parent speaking with pid %d.", (int)getpid());
-		ck_assert_int_eq(write_concs(fd[1]), OP_SUCCESS);
-	}
+	ck_assert_int_eq(write_message_block(fd[1]), OP_SUCCESS);
+	ck_assert_int_eq(read_message_block(fd[0], &mb), OP_SUCCESS);
+	close(fd[0]);
+	close(fd[1]);
+	return mb;
 }
-END_TEST
 
-/* Incomplete? */
-START_TEST(test_write_graph_solution)
+void
+retire_round_trip(struct dgsh_negotiation *mb)
 {
-	int fd[2];
-	int buf_size = getpagesize();
-	int pid;
-	int i;
-        int n_nodes = chosen_mb->n_nodes;
-        int graph_solution_size = sizeof(struct dgsh_node_connections) *
-                                                                n_nodes;
-	struct dgsh_node_connections *graph_solution = 
-		(struct dgsh_node_connections *)malloc(graph_solution_size);
-
-	if (pipe(fd) == -1) {
-		perror("pipe open failed");
-		exit(1);
-	}
-	DPRINTF(4, "%s()...", __func__);
-	DPRINTF(4, "Opened pipe pair %d - %d.", fd[0], fd[1]);
-
-	pid = fork();
-	if (pid <= 0) {
-		int rsize = -1;
-		DPRINTF(4, "Child speaking with pid %d.", (int)getpid());
-
-		close(fd[1]);
-		DPRINTF(4, "Child reads graph solution of size %d.",
-					graph_solution_size);
-        	rsize = read(fd[0], graph_solution, graph_solution_size);
-		if (rsize == -1) {
-			DPRINTF(4, "Write graph solution failed.");
-			exit(1);
-		}
-
-		for (i = 0; i < chosen_mb->n_nodes; i++) {
-                	struct dgsh_node_connections *nc = &graph_solution[i];
-                	int in_edges_size = sizeof(struct dgsh_edge) *
-							nc->n_edges_incoming;
-                	int out_edges_size = sizeof(struct dgsh_edge) *
-							nc->n_edges_outgoing;
-                	if ((in_edges_size > buf_size) || 
-						(out_edges_size > buf_size)) {
-                        	DPRINTF(4, "Dgsh negotiation graph solution for node at index %d: incoming connections of size %d or outgoing connections of size %d do not fit to buffer of size %d.\n", nc->node_index, in_edges_size, out_edges_size, buf_size);
-                        	exit(1);
-                	}
-
-			DPRINTF(4, "Child reads incoming edges of node %d in fd %d. Total size: %d", i, fd[1], in_edges_size);
-                	/* Transmit a node's incoming connections. */
-                	rsize = read(fd[0], nc->edges_incoming, in_edges_size);
-			if (rsize == -1) {
-				DPRINTF(4, "Read edges incoming failed.");
-				exit(1);
-			}
-
-			DPRINTF(4, "Child reads outgoing edges of node %d in fd %d. Total size: %d", i, fd[1], out_edges_size);
-                	/* Transmit a node's outgoing connections. */
-                	rsize = read(fd[0], nc->edges_outgoing, out_edges_size);
-			if (rsize == -1) {
-				DPRINTF(4, "Read edges outgoing failed.");
-				exit(1);
-			}
-        	}
-		DPRINTF(4, "Child: closes fd %d.", fd[0]);
-		close(fd[0]);
-		DPRINTF(4, "Child with pid %d exits.", (int)getpid());
-	} else {
-		DPRINTF(4, "Parent speaking with pid %d.", (int)getpid());
-		ck_assert_int_eq(write_graph_solution(fd[1]), OP_SUCCESS);
-	}
+	wire_discard(mb);
+	free(mb);
 }
-END_TEST
 
-/* Incomplete? */
-START_TEST(test_write_message_block)
+START_TEST(test_write_concs)
 {
-	int fd[2];
-	int pid;
-	DPRINTF(4, "%s()", __func__);
-
-	if(pipe(fd) == -1){
-		perror("pipe open failed");
-		exit(1);
-	}
-	DPRINTF(4, "Opened pipe pair %d - %d.", fd[0], fd[1]);	
-
-	pid = fork();
-	if (pid <= 0) {
-		DPRINTF(4, "Child speaking with pid %d.", (int)getpid());
-		struct dgsh_negotiation *test_mb = (struct dgsh_negotiation *)
-				malloc(sizeof(struct dgsh_negotiation));
-        	int mb_struct_size = sizeof(struct dgsh_negotiation);
-                int i = 0;
-		int rsize = -1;
-
-		close(fd[1]);
-		DPRINTF(4, "Child reads message block structure of size %d.",
-					mb_struct_size);
-        	rsize = read(fd[0], test_mb, mb_struct_size);
-		if (rsize == -1) {
-			DPRINTF(4, "Read message block failed.");
-			exit(1);
-		}
-        	int n_nodes = test_mb->n_nodes;
-        	int n_edges = test_mb->n_edges;
-        	int mb_nodes_size = sizeof(struct dgsh_node) * n_nodes;
-		test_mb->node_array = (struct dgsh_node *)malloc(mb_nodes_size);
-        	int mb_edges_size = sizeof(struct dgsh_edge) * n_edges;
-		test_mb->edge_array = (struct dgsh_edge *)malloc(mb_edges_size);
-
-		DPRINTF(4, "Child reads message block node array of size %d.",
-					mb_nodes_size);
-        	rsize = read(fd[0], test_mb->node_array, mb_nodes_size);
-		if (rsize == -1) {
-			DPRINTF(4, "Read node array failed.");
-			exit(1);
-		}
-
-		DPRINTF(4, "Child reads message block edge array of size %d.",
-					mb_edges_size);
-		rsize = read(fd[0], test_mb->edge_array, mb_edges_size);
-		if (rsize == -1) {
-			DPRINTF(4, "Read edge array failed.");
-			exit(1);
-		}
-                for (i = 0; i < test_mb->n_edges; i++) {
-                        struct dgsh_edge *e = &test_mb->edge_array[i];
-                        DPRINTF(4, "Edge from: %d, to: %d", e->from, e->to);
-                }
-
-		DPRINTF(4, "Child: closes fd %d.", fd[0]);
-		close(fd[0]);
-		DPRINTF(4, "Child with pid %d exits.", (int)getpid());
-		retire_mb(test_mb);
-	} else {
-		DPRINTF(4, "Parent speaking with pid %d.", (int)getpid());
-		ck_assert_int_eq(write_message_block(fd[1]), OP_SUCCESS);
+	struct dgsh_negotiation *mb = wire_round_trip();
+	int i, j;
+
+	ck_assert_int_eq(mb->n_concs, chosen_mb->n_concs);
+	for (i = 0; i < mb->n_concs; i++) {
+		struct dgsh_conc *c = &mb->conc_array[i];
+		struct dgsh_conc *e = &chosen_mb->conc_array[i];
+		ck_assert_int_eq(c->pid, e->pid);
+		ck_assert_int_eq(c->input_fds, e->input_fds);
+		ck_assert_int_eq(c->output_fds, e->output_fds);
+		ck_assert_int_eq(c->endpoint_pid, e->endpoint_pid);
+		ck_assert_int_eq(c->multiple_inputs, e->multiple_inputs);
+		ck_assert_int_eq(c->n_proc_pids, e->n_proc_pids);
+		for (j = 0; j < c->n_proc_pids; j++)
+			ck_assert_int_eq(c->proc_pids[j], e->proc_pids[j]);
 	}
+	retire_round_trip(mb);
 }
 END_TEST
 
-/* Incomplete? */
-START_TEST(test_read_message_block)
+START_TEST(test_write_graph_solution)
 {
-	int fd[2];
-	int pid;
-	DPRINTF(4, "%s()", __func__);
-
-	if(pipe(fd) == -1){
-		perror("pipe open failed");
-		exit(1);
-	}
-	DPRINTF(4, "Opened pipe pair %d - %d.", fd[0], fd[1]);
+	struct dgsh_negotiation *mb;
+	int i;
 
-	pid = fork();
-	if (pid <= 0) {
-		DPRINTF(4, "Child speaking with pid %d.", (int)getpid());
-		struct dgsh_negotiation *test_mb;
-		setup_mb(&test_mb);
-        	int n_nodes = test_mb->n_nodes;
-        	int n_edges = test_mb->n_edges;
-        	int mb_struct_size = sizeof(struct dgsh_negotiation);
-        	int mb_nodes_size = sizeof(struct dgsh_node) * n_nodes;
-        	int mb_edges_size = sizeof(struct dgsh_edge) * n_edges;
-                int i = 0;
-		int wsize = -1;
-		struct timespec tm;
-		tm.tv_sec = 0;
-		tm.tv_nsec = 1000000;
-
-		close(fd[0]);
-		DPRINTF(4, "Child writes message block structure of size %d.",
-					mb_struct_size);
-        	wsize = write(fd[1], test_mb, mb_struct_size);
-		if (wsize == -1) {
-			DPRINTF(4, "Write message block structure failed.");
-			exit(1);
-		}
-		/* Sleep for 1 millisecond to write-read orderly.
-		 * Why do we need this?
-		 * Shouldn't the write block by deafult?
-		 */
-		nanosleep(&tm, NULL);
-
-		DPRINTF(4, "Child writes message block node array of size %d.",
-					mb_nodes_size);
-        	wsize = write(fd[1], test_mb->node_array, mb_nodes_size);
-		if (wsize == -1) {
-			DPRINTF(4, "Write message block node array failed.");
-			exit(1);
-		}
-		/* Sleep for 1 millisecond before the next operation. */
-		nanosleep(&tm, NULL);
-
-		DPRINTF(4, "Child writes message block edge array of size %d.",
-					mb_edges_size);
-                for (i = 0; i < test_mb->n_edges; i++) {
-                        struct dgsh_edge *e = &test_mb->edge_array[i];
-                        DPRINTF(4, "Edge from: %d, to: %d", e->from, e->to);
-                }
-		wsize = write(fd[1], test_mb->edge_array, mb_edges_size);
-		if (wsize == -1) {
-			DPRINTF(4, "Write message block edge array failed.");
-			exit(1);
-		}
+	chosen_mb->state = PS_RUN;
+	mb = wire_round_trip();
+	chosen_mb->state = PS_NEGOTIATION;
 
-		DPRINTF(4, "Child: closes fd %d.", fd[1]);
-		close(fd[1]);
-		DPRINTF(4, "Child with pid %d exits.", (int)getpid());
-		retire_mb(test_mb);
-	} else {
-		DPRINTF(4, "Parent speaking with pid %d.", (int)getpid());
-		ck_assert_int_eq(read_message_block(fd[0], &fresh_mb),
-				OP_SUCCESS);
+	ck_assert_int_eq(mb->state, PS_RUN);
+	/* Edges are only transmitted while negotiating. */
+	ck_assert(mb->edge_array == NULL);
+	ck_assert_int_eq(mb->n_nodes, chosen_mb->n_nodes);
+	for (i = 0; i < mb->n_nodes; i++) {
+		struct dgsh_node_connections *nc = &mb->graph_solution[i];
+		struct dgsh_node_connections *e = &chosen_mb->graph_solution[i];
+		ck_assert_int_eq(nc->node_index, e->node_index);
+		ck_assert_int_eq(nc->n_edges_incoming, e->n_edges_incoming);
+		ck_assert_int_eq(nc->n_edges_outgoing, e->n_edges_outgoing);
+		if (nc->n_edges_incoming)
+			ck_assert_int_eq(memcmp(nc->edges_incoming, e->edges_incoming,
+				sizeof(struct dgsh_edge) * nc->n_edges_incoming), 0);
+		if (nc->n_edges_outgoing)
+			ck_assert_int_eq(memcmp(nc->edges_outgoing, e->edges_outgoing,
+				sizeof(struct dgsh_edge) * nc->n_edges_outgoing), 0);
 	}
+	retire_round_trip(mb);
 }
 END_TEST
 
-/* Incomplete? */
-START_TEST(test_read_graph_solution)
+START_TEST(test_write_message_block)
 {
-	int fd[2];
-	int pid;
+	struct dgsh_negotiation *mb;
+	size_t len;
 	int i;
-        int n_nodes = fresh_mb->n_nodes;
-	int buf_size = getpagesize();
-        int graph_solution_size = sizeof(struct dgsh_node_connections) *
-                                                                n_nodes;
-	struct timespec tm;
-	tm.tv_sec = 0;
-	tm.tv_nsec = 1000000;
-	DPRINTF(4, "%s()", __func__);
-
-	if(pipe(fd) == -1){
-		perror("pipe open failed");
-		exit(1);
-	}
-	DPRINTF(4, "Opened pipe pair %d - %d.", fd[0], fd[1]);	
 
-	pid = fork();
-	if (pid <= 0) {
-		int wsize = -1;
-		DPRINTF(4, "Child speaking with pid %d.", (int)getpid());
-		setup_graph_solution();
-		struct dgsh_node_connections *graph_solution =
-			chosen_mb->graph_solution;
-
-		close(fd[0]);
-		DPRINTF(4, "Child writes graph solution of size %d.",
-					graph_solution_size);
-        	wsize = write(fd[1], graph_solution, graph_solution_size);
-		if (wsize == -1) {
-			DPRINTF(4, "Write graph solution failed.");
-			exit(1);
-		}
-		/* Sleep for 1 millisecond before the next operation. */
-		nanosleep(&tm, NULL);
-
-		for (i = 0; i < chosen_mb->n_nodes; i++) {
-                	struct dgsh_node_connections *nc = &graph_solution[i];
-                	int in_edges_size = sizeof(struct dgsh_edge) *
-							nc->n_edges_incoming;
-                	int out_edges_size = sizeof(struct dgsh_edge) *
-							nc->n_edges_outgoing;
-			int wsize = -1;
-			if ((in_edges_size > buf_size) || 
-						(out_edges_size > buf_size)) {
-                        	DPRINTF(4, "Dgsh negotiation graph solution for node at index %d: incoming connections of size %d or outgoing connections of size %d do not fit to buffer of size %d.\n", nc->node_index, in_edges_size, out_edges_size, buf_size);
-                        	exit(1);
-                	}
-
-			DPRINTF(4, "Child writes incoming edges of node %d in fd %d. Total size: %d", i, fd[1], in_edges_size);
-                	/* Transmit a node's incoming connections. */
-                	wsize = write(fd[1], nc->edges_incoming, in_edges_size);
-			if (wsize == -1) {
-				DPRINTF(4, "Write edges incoming failed.");
-				exit(1);
-			}
-			/* Sleep for 1 millisecond before the next operation. */
-			nanosleep(&tm, NULL);
-
-			DPRINTF(4, "Child writes outgoing edges of node %d in fd %d. Total size: %d", i, fd[1], out_edges_size);
-                	/* Transmit a node's outgoing connections. */
-                	wsize = write(fd[1], nc->edges_outgoing, out_edges_size);
-			if (wsize == -1) {
-				DPRINTF(4, "Write edges outgoing failed.");
-				exit(1);
-			}
-			/* Sleep for 1 millisecond before the next operation. */
-			nanosleep(&tm, NULL);
-        	}
-		DPRINTF(4, "Child: closes fd %d.", fd[1]);
-		close(fd[1]);
-		DPRINTF(4, "Child with pid %d exits.", (int)getpid());
-		retire_graph_solution(graph_solution, chosen_mb->n_nodes - 1);
-	} else {
-		DPRINTF(4, "Parent speaking with pid %d.", (int)getpid());
-		ck_assert_int_eq(read_graph_solution(fd[0],
-					fresh_mb), OP_SUCCESS);
+	/* Repeated tool names share their name table entry. */
+	wire_put_mb(&wire_out, chosen_mb);
+	len = wire_out.len;
+	strcpy(chosen_mb->node_array[3].name, "proc0");
+	wire_put_mb(&wire_out, chosen_mb);
+	ck_assert_int_eq(wire_out.len, len - strlen("proc3") - 1);
+
+	mb = wire_round_trip();
+	ck_assert_int_eq(mb->state, PS_NEGOTIATION);
+	ck_assert_int_eq(mb->initiator_pid, chosen_mb->initiator_pid);
+	ck_assert_int_eq(mb->origin_fd_direction, chosen_mb->origin_fd_direction);
+	ck_assert_int_eq(mb->n_concs, 0);
+	ck_assert(mb->conc_array == NULL);
+	ck_assert(mb->graph_solution == NULL);
+	ck_assert_int_eq(mb->n_nodes, chosen_mb->n_nodes);
+	for (i = 0; i < mb->n_nodes; i++) {
+		struct dgsh_node *n = &mb->node_array[i];
+		struct dgsh_node *e = &chosen_mb->node_array[i];
+		ck_assert_int_eq(n->pid, e->pid);
+		ck_assert_int_eq(n->index, e->index);
+		ck_assert_str_eq(n->name, e->name);
+		ck_assert_int_eq(n->requires_channels, e->requires_channels);
+		ck_assert_int_eq(n->provides_channels, e->provides_channels);
+		ck_assert_int_eq(n->dgsh_in, e->dgsh_in);
+		ck_assert_int_eq(n->dgsh_out, e->dgsh_out);
 	}
+	ck_assert_int_eq(mb->n_edges, chosen_mb->n_edges);
+	ck_assert_int_eq(memcmp(mb->edge_array, chosen_mb->edge_array,
+		sizeof(struct dgsh_edge) * mb->n_edges), 0);
+	retire_round_trip(mb);
 }
 END_TEST
 
-START_TEST(test_read_concs)
+START_TEST(test_read_message_block)
 {
 	int fd[2];
-	int pid;
-	int i;
-        int n_concs = fresh_mb->n_concs;
-	int buf_size = getpagesize();
-        int concs_size = sizeof(struct dgsh_conc) * n_concs;
-	DPRINTF(4, "%s()", __func__);
+	unsigned char c;
+	const unsigned char old_version[] = {1, 0, 0, 0, 1, 0};
+	const unsigned char bad_varint[] = {WIRE_VERSION, 0, 0, 0, 2, 0x80, 0x80};
+	const unsigned char truncated[] = {WIRE_VERSION, 0, 0, 0, 9, 0};
 
-	if(pipe(fd) == -1){
+	if (pipe(fd) == -1) {
 		perror("pipe open failed");
 		exit(1);
 	}
-	DPRINTF(4, "Opened pipe pair %d - %d.", fd[0], fd[1]);
-
-	pid = fork();
-	if (pid <= 0) {
-		int wsize = -1;
-		DPRINTF(4, "Child speaking with pid %d.", (int)getpid());
-		setup_graph_solution();
-		struct dgsh_conc *concs =
-			chosen_mb->conc_array;
-
-		close(fd[0]);
-		DPRINTF(4, "Child writes concs of size %d.",
-					concs_size);
-		wsize = write(fd[1], concs, concs_size);
-		if (wsize == -1) {
-			DPRINTF(4, "Write concs failed.");
-			exit(1);
-		}
-	} else {
-		DPRINTF(4, "Parent speaking with pid %d.", (int)getpid());
-		ck_assert_int_eq(read_concs(fd[0],
-					fresh_mb), OP_SUCCESS);
-	}
+	fresh_mb = NULL;
+	ck_assert_int_eq(write(fd[1], old_version, sizeof(old_version)),
+			sizeof(old_version));
+	ck_assert_int_eq(read_message_block(fd[0], &fresh_mb), OP_ERROR);
+	ck_assert(fresh_mb == NULL);
+	/* Skip the rejected body. */
+	ck_assert_int_eq(read(fd[0], &c, 1), 1);
+
+	/* A malformed block is returned empty, for flagging the error. */
+	ck_assert_int_eq(write(fd[1], bad_varint, sizeof(bad_varint)),
+			sizeof(bad_varint));
+	ck_assert_int_eq(read_message_block(fd[0], &fresh_mb), OP_ERROR);
+	ck_assert(fresh_mb != NULL);
+	ck_assert_int_eq(fresh_mb->n_nodes, 0);
+	ck_assert(fresh_mb->node_array == NULL);
+	free(fresh_mb);
+
+	/* The body must be complete. */
+	ck_assert_int_eq(write(fd[1], truncated, sizeof(truncated)),
+			sizeof(truncated));
+	close(fd[1]);
+	fresh_mb = NULL;
+	ck_assert_int_eq(read_message_block(fd[0], &fresh_mb), OP_ERROR);
+	ck_assert(fresh_mb == NULL);
+	close(fd[0]);
 }
 END_TEST
 
@@ -2051,12 +1878,60 @@ START_TEST (test_read_write_fd)
 }
 END_TEST
 
+
+START_TEST (test_read_write_fd_array)
+{
+	int pipefd[2], sockets[2];
+	int n_fds = FD_BATCH_MAX + 7;	/* Two messages */
+	int *fds = (int *)malloc(sizeof(int) * n_fds);
+	struct stat sb, rsb;
+	int i;
+
+	if (pipe(pipefd) == -1)
+		err(1, "pipe");
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1)
+		err(1, "socketpair");
+	for (i = 0; i < n_fds; i++)
+		if ((fds[i] = dup(pipefd[STDIN_FILENO])) == -1)
+			err(1, "dup");
+
+	write_fd_array(sockets[0], fds, n_fds);
+	write_fd(sockets[0], pipefd[STDOUT_FILENO]);
+	for (i = 0; i < n_fds; i++)
+		close(fds[i]);
+
+	read_fd_array(sockets[1], fds, n_fds);
+	fstat(pipefd[STDIN_FILENO], &sb);
+	for (i = 0; i < n_fds; i++) {
+		ck_assert_int_eq(fstat(fds[i], &rsb), 0);
+		ck_assert_int_eq(rsb.st_ino, sb.st_ino);
+		close(fds[i]);
+	}
+	/* Message boundaries are preserved */
+	i = read_fd(sockets[1]);
+	fstat(pipefd[STDOUT_FILENO], &sb);
+	ck_assert_int_eq(fstat(i, &rsb), 0);
+	ck_assert_int_eq(rsb.st_ino, sb.st_ino);
+	close(i);
+
+	/* An empty array takes no message */
+	write_fd_array(sockets[0], fds, 0);
+	read_fd_array(sockets[1], fds, 0);
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(sockets[0]);
+	close(sockets[1]);
+	free(fds);
+}
+END_TEST
 		
 /* Incomplete? */
 START_TEST(test_read_input_fds)
 {
 	int sockets[2];
-	int fd, ping;
+	int fd;
+	unsigned char ping;
 	struct msghdr msg;
 	struct iovec vec[1];
 	union fdmsg cmsg;
@@ -2092,6 +1967,7 @@ START_TEST(test_read_input_fds)
 		DPRINTF(4, "Child closes socket %d.", sockets[1]);
 		close(sockets[1]);
 
+		ping = 1;	/* Number of passed fds */
 		vec[0].iov_base = &ping;
 		vec[0].iov_len = 1;
 
@@ -2147,45 +2023,6 @@ START_TEST(test_read_input_fds)
 }
 END_TEST
 
-/* Incomplete? */
-START_TEST(test_read_chunk)
-{
-	/* Requires setting up of I/O multiplexing (a bash shell extension)
-	 * in order to be able to support bidirectional negotiation.
-	 * Without it we cannot test this function because it tries to read
-	 * repeatedly from stdin and then stdout until it manages.
-         * We cannot feed it; writing to stdin or stdout
-	 * ends up in the unit test file output).
-	 * The good news is that the core of this function is the call to
-	 * call read, which has been successfully tested.
-	 * Then there is variable checking to determine the exit code.
-	 */
-	int fd[2];
-	int wsize = -1;
-	DPRINTF(4, "%s()...", __func__);
-	if(pipe(fd) == -1){
-		perror("pipe open failed");
-		exit(1);
-	}
-
-	/* Broken pipe error if we close the other side. */
-	//close(fd[0]);
-	wsize = write(fd[1], "test-in", 9);
-	if (wsize == -1) {
-		DPRINTF(4, "Write to 'test-in' failed.");
-		exit(1);
-	}
-	char buf[32];
-	int read_fd = -1;
-	int bytes_read = -1;
-	ck_assert_int_eq(read_chunk(fd[0], buf, 32, &bytes_read, 5), OP_SUCCESS);
-	ck_assert_int_eq(bytes_read, 9);
-	
-	close(fd[0]);
-	close(fd[1]);
-}
-END_TEST
-
 START_TEST(test_call_read)
 {
 	int fd[2];
@@ -2214,116 +2051,60 @@ START_TEST(test_call_read)
 }
 END_TEST
 
-START_TEST(test_alloc_copy_mb)
+START_TEST(test_read_full)
 {
-	const int size = sizeof(struct dgsh_negotiation);
-	char buf[512];
-	struct dgsh_negotiation *mb;
-	ck_assert_int_eq(alloc_copy_mb(&mb, buf, 86, 512), OP_ERROR);
-
-	char buf2[32];
-	ck_assert_int_eq(alloc_copy_mb(&mb, buf2, size, 32), OP_ERROR);
-
-	ck_assert_int_eq(alloc_copy_mb(&mb, buf, size, 512), OP_SUCCESS);
-	free(mb);
-}
-END_TEST
-
-START_TEST(test_alloc_copy_proc_pids)
-{
-	struct dgsh_conc c;
-	c.n_proc_pids = 2;
-	const int size = sizeof(int) * c.n_proc_pids;
-	int pids[2] = {101, 103};
-	char buf[512];
-	memcpy(buf, pids, size);
-
-	ck_assert_int_eq(alloc_copy_proc_pids(&c, buf, 86, 512),
-			OP_ERROR);
-
-	char buf2[8];
-	ck_assert_int_eq(alloc_copy_proc_pids(&c, buf2, size, 4),
-			OP_ERROR);
-
-	ck_assert_int_eq(alloc_copy_proc_pids(&c, buf, size, 512),
-			OP_SUCCESS);
-}
-END_TEST
-
-START_TEST(test_alloc_copy_concs)
-{
-	const int n_concs = fresh_mb->n_concs = 1;
-	const int size = sizeof(struct dgsh_conc) * n_concs;
-	struct dgsh_conc c;
-	char buf[512];
-	memcpy(buf, &c, size);
-	ck_assert_int_eq(alloc_copy_concs(fresh_mb, buf, 86, 512),
-			OP_ERROR);
-
-	char buf2[8];
-	ck_assert_int_eq(alloc_copy_concs(fresh_mb, buf2, size, 8),
-			OP_ERROR);
-
-	ck_assert_int_eq(alloc_copy_concs(fresh_mb, buf, size, 512),
-			OP_SUCCESS);
-}
-END_TEST
-
-START_TEST(test_alloc_copy_nodes)
-{
-	const int size = sizeof(struct dgsh_node) * fresh_mb->n_nodes;
-	char buf[512];
-	ck_assert_int_eq(alloc_copy_nodes(fresh_mb, buf, 86, 512), OP_ERROR);
-
-	char buf2[32];
-	ck_assert_int_eq(alloc_copy_nodes(fresh_mb, buf2, size, 32), OP_ERROR);
-
-	free(fresh_mb->node_array);  /* to avoid memory leak */
-	ck_assert_int_eq(alloc_copy_nodes(fresh_mb, buf, size, 512), OP_SUCCESS);
-}
-END_TEST
-
-START_TEST(test_alloc_copy_edges)
-{
-	const int size = sizeof(struct dgsh_edge) * fresh_mb->n_edges;
-	char buf[256];
-	ck_assert_int_eq(alloc_copy_edges(fresh_mb, buf, 86, 256), OP_ERROR);
-
-	char buf2[32];
-	ck_assert_int_eq(alloc_copy_edges(fresh_mb, buf2, size, 32), OP_ERROR);
+	int fd[2];
+	char buf[8];
 
-	free(fresh_mb->edge_array);  /* to avoid memory leak */
-	ck_assert_int_eq(alloc_copy_edges(fresh_mb, buf, size, 256), OP_SUCCESS);
+	if (pipe(fd) == -1) {
+		perror("pipe open failed");
+		exit(1);
+	}
+	/* Data arriving in parts is read in full. */
+	ck_assert_int_eq(write(fd[1], "test", 4), 4);
+	ck_assert_int_eq(write(fd[1], "-in", 4), 4);
+	ck_assert_int_eq(read_full(fd[0], buf, 8), OP_SUCCESS);
+	ck_assert_str_eq(buf, "test-in");
+
+	/* End of file before all data is an error. */
+	ck_assert_int_eq(write(fd[1], "test", 4), 4);
+	close(fd[1]);
+	ck_assert_int_eq(read_full(fd[0], buf, 8), OP_ERROR);
+	close(fd[0]);
 }
 END_TEST
 
-START_TEST(test_alloc_copy_graph_solution)
+START_TEST(test_wire_varint)
 {
-	const int size = sizeof(struct dgsh_node_connections) *
-		fresh_mb->n_nodes;
-	char buf[256];
-	ck_assert_int_eq(alloc_copy_graph_solution(fresh_mb, buf, 86, 256),
-			OP_ERROR);
-
-	char buf2[32];
-	ck_assert_int_eq(alloc_copy_edges(fresh_mb, buf2, size, 32), OP_ERROR);
-
-	/* Free to avoid memory leak.
-	 * About the free() see how graph_solution is malloc'ed
-	 * at alloc_copy_graph_solution.
-	 */
-	free(fresh_mb->graph_solution);
-	ck_assert_int_eq(alloc_copy_graph_solution(fresh_mb, buf, size, 256),
-			OP_SUCCESS);
-	free(fresh_mb->graph_solution); /* Easier to handle here. */
-}
-END_TEST
+	struct wire_buffer wb = {NULL, 0, 0, 0, false};
+	const long values[] = {0, 1, -1, 63, -64, 64, 127, 128, 300,
+		INT_MAX, INT_MIN, LONG_MAX, LONG_MIN};
+	const int n = sizeof(values) / sizeof(values[0]);
+	int i;
 
-START_TEST(test_check_read)
-{
-	ck_assert_int_eq(check_read(512, 1024, 256), OP_ERROR);
-	ck_assert_int_eq(check_read(512, 256, 512), OP_ERROR);
-	ck_assert_int_eq(check_read(512, 1024, 512), OP_SUCCESS);
+	/* Small values, positive or negative, take a single byte. */
+	wire_put_int(&wb, -1);
+	wire_put_int(&wb, 63);
+	wire_put_int(&wb, -64);
+	ck_assert_int_eq(wb.len, 3);
+	wire_put_uint(&wb, 300);
+	ck_assert_int_eq(wb.len, 5);
+	ck_assert_int_eq(wire_get_int(&wb), -1);
+	ck_assert_int_eq(wire_get_int(&wb), 63);
+	ck_assert_int_eq(wire_get_int(&wb), -64);
+	ck_assert_int_eq(wire_get_uint(&wb), 300);
+
+	wb.len = wb.pos = 0;
+	for (i = 0; i < n; i++)
+		wire_put_int(&wb, values[i]);
+	for (i = 0; i < n; i++)
+		ck_assert(wire_get_int(&wb) == values[i]);
+	ck_assert(!wb.error);
+
+	/* Reading past the end is an error. */
+	wire_get_uint(&wb);
+	ck_assert(wb.error);
+	free(wb.p);
 }
 END_TEST
 
@@ -2339,6 +2120,54 @@ END_TEST
 END_TEST
 */
 
+START_TEST(test_merge_message_block)
+{
+	struct dgsh_negotiation *mb, *from;
+
+	setup_mb(&mb);
+	setup_mb(&from);
+	/* A branch that reached node 104 instead of node 103 */
+	from->node_array[3].pid = 104;
+	setup_concs(from);
+
+	ck_assert_int_eq(merge_message_block(mb, from), OP_SUCCESS);
+	ck_assert_int_eq(mb->n_nodes, 5);
+	ck_assert_int_eq(mb->node_array[4].pid, 104);
+	ck_assert_int_eq(mb->node_array[4].index, 4);
+	/* Edges 1 -> 3 and 0 -> 3 of from refer to node 4 */
+	ck_assert_int_eq(mb->n_edges, 7);
+	ck_assert_int_eq(mb->edge_array[5].from, 1);
+	ck_assert_int_eq(mb->edge_array[5].to, 4);
+	ck_assert_int_eq(mb->edge_array[6].from, 0);
+	ck_assert_int_eq(mb->edge_array[6].to, 4);
+	ck_assert_int_eq(mb->n_concs, 2);
+	ck_assert_int_eq(mb->conc_array[1].proc_pids[1], 101);
+	ck_assert_int_eq(mb->origin_index, 2);
+	ck_assert_int_eq(mb->state, PS_NEGOTIATION);
+
+	/* Merging again adds nothing; the origin is renumbered. */
+	from->origin_index = 3;
+	from->state = PS_ERROR;
+	from->is_error_confirmed = false;
+	ck_assert_int_eq(merge_message_block(mb, from), OP_SUCCESS);
+	ck_assert_int_eq(mb->n_nodes, 5);
+	ck_assert_int_eq(mb->n_edges, 7);
+	ck_assert_int_eq(mb->n_concs, 2);
+	ck_assert_int_eq(mb->origin_index, 4);
+	ck_assert_int_eq(mb->state, PS_ERROR);
+	ck_assert_int_eq(mb->is_error_confirmed, false);
+
+	/* Edges must refer to nodes of the block. */
+	from->edge_array[0].to = 4;
+	ck_assert_int_eq(merge_message_block(mb, from), OP_ERROR);
+
+	retire_concs(from);
+	retire_mb(from);
+	retire_concs(mb);
+	retire_mb(mb);
+}
+END_TEST
+
 START_TEST(test_analyse_read)
 {
 	DPRINTF(4, "%s()", __func__);
@@ -2741,6 +2570,38 @@ START_TEST(test_get_env_var)
 END_TEST
 
 
+START_TEST(test_parse_fd_list)
+{
+	int *fds;
+	int n_fds;
+
+	ck_assert_int_eq(parse_fd_list("", &fds, &n_fds), OP_SUCCESS);
+	ck_assert_int_eq(n_fds, 0);
+	ck_assert(fds == NULL);
+
+	ck_assert_int_eq(parse_fd_list("2,0,1", &fds, &n_fds), OP_SUCCESS);
+	ck_assert_int_eq(n_fds, 3);
+	ck_assert_int_eq(fds[0], 2);
+	ck_assert_int_eq(fds[1], 0);
+	ck_assert_int_eq(fds[2], 1);
+	free(fds);
+
+	errno = 0;
+	ck_assert_int_eq(parse_fd_list("0,,1", &fds, &n_fds), OP_ERROR);
+	ck_assert_int_eq(errno, EINVAL);
+	ck_assert_int_eq(parse_fd_list("0,-1", &fds, &n_fds), OP_ERROR);
+	ck_assert_int_eq(parse_fd_list("1x", &fds, &n_fds), OP_ERROR);
+	ck_assert_int_eq(parse_fd_list("0,", &fds, &n_fds), OP_ERROR);
+	ck_assert_int_eq(n_fds, 0);
+	ck_assert(fds == NULL);
+
+	/* Closed descriptor */
+	errno = 0;
+	ck_assert_int_eq(parse_fd_list("0,1000", &fds, &n_fds), OP_ERROR);
+	ck_assert_int_eq(errno, EBADF);
+}
+END_TEST
+
 START_TEST(test_get_environment_vars)
 {
 	DPRINTF(4, "%s()...", __func__);
@@ -2812,6 +2673,58 @@ START_TEST(test_dgsh_negotiate)
 }
 END_TEST
 
+START_TEST(test_dgsh_negotiate_provided_fds)
+{
+	int *input_fds;
+	int n_input_fds = 1;
+	int *output_fds;
+	int n_output_fds = 3;
+	int p[2];
+
+	ck_assert_int_eq(pipe(p), 0);
+	setenv("DGSH_INPUT_FDS", "0", 1);
+
+	/* An unset DGSH_OUTPUT_FDS provides only stdout */
+	errno = 0;
+	ck_assert_int_eq(dgsh_negotiate(0, "test", &n_input_fds,
+				&n_output_fds, &input_fds, &output_fds), -1);
+	ck_assert_int_eq(errno, EPROTO);
+
+	/* A single output channel, or none, is satisfied by stdout */
+	negotiation_completed = 0;
+	n_output_fds = 1;
+	ck_assert_int_eq(dgsh_negotiate(0, "test", &n_input_fds,
+				&n_output_fds, &input_fds, &output_fds), 0);
+	ck_assert_int_eq(n_input_fds, 1);
+	ck_assert_int_eq(input_fds[0], STDIN_FILENO);
+	ck_assert_int_eq(n_output_fds, 1);
+	ck_assert_int_eq(output_fds[0], STDOUT_FILENO);
+	ck_assert(getenv("DGSH_INPUT_FDS") == NULL);
+
+	negotiation_completed = 0;
+	setenv("DGSH_INPUT_FDS", "0", 1);
+	n_output_fds = 0;
+	ck_assert_int_eq(dgsh_negotiate(0, "test", &n_input_fds,
+				&n_output_fds, &input_fds, &output_fds), 0);
+	ck_assert_int_eq(n_output_fds, 0);
+
+	/* Likewise for an unset DGSH_INPUT_FDS */
+	char out[16];
+	snprintf(out, sizeof(out), "%d", p[1]);
+	setenv("DGSH_OUTPUT_FDS", out, 1);
+	negotiation_completed = 0;
+	n_input_fds = 2;
+	n_output_fds = 1;
+	errno = 0;
+	ck_assert_int_eq(dgsh_negotiate(0, "test", &n_input_fds,
+				&n_output_fds, &input_fds, &output_fds), -1);
+	ck_assert_int_eq(errno, EPROTO);
+	unsetenv("DGSH_OUTPUT_FDS");
+	close(p[0]);
+	close(p[1]);
+}
+END_TEST
+
 /* Suite conc */
 START_TEST(test_is_ready)
 {
@@ -2924,6 +2837,7 @@ suite_connect(void)
 	TCase *tc_trw = tcase_create("test read/write fd");
 	tcase_add_checked_fixture(tc_trw, NULL, NULL);
 	tcase_add_test(tc_trw, test_read_write_fd);
+	tcase_add_test(tc_trw, test_read_write_fd_array);
 	suite_add_tcase(s, tc_trw);
 
 	TCase *tc_rif = tcase_create("read input fds");
@@ -2988,18 +2902,6 @@ suite_solve(void)
 	tcase_add_test(tc_wc, test_write_concs);
 	suite_add_tcase(s, tc_wc);
 
-	TCase *tc_rc = tcase_create("read concs");
-	tcase_add_checked_fixture(tc_rc, setup_test_read_concs,
-					  retire_test_read_concs);
-	tcase_add_test(tc_rc, test_read_concs);
-	suite_add_tcase(s, tc_rc);
-
-	TCase *tc_rgs = tcase_create("read graph solution");
-	tcase_add_checked_fixture(tc_rgs, setup_test_read_graph_solution,
-					  retire_test_read_graph_solution);
-	tcase_add_test(tc_rgs, test_read_graph_solution);
-	suite_add_tcase(s, tc_rgs);
-
 	TCase *tc_wgs = tcase_create("write graph solution");
 	tcase_add_checked_fixture(tc_wgs, setup_test_write_graph_solution,
 					  retire_test_write_graph_solution);
@@ -3012,6 +2914,13 @@ suite_solve(void)
 	tcase_add_test(tc_ssg, test_solve_graph);
 	suite_add_tcase(s, tc_ssg);
 
+	TCase *tc_sc = tcase_create("solution cache");
+	tcase_add_checked_fixture(tc_sc, setup_test_solve_graph,
+					  retire_test_solve_graph);
+	tcase_add_test(tc_sc, test_solution_cache);
+	tcase_add_test(tc_sc, test_solution_cache_permuted);
+	suite_add_tcase(s, tc_sc);
+
 	TCase *tc_ccf = tcase_create("calculate conc fds");
 	tcase_add_checked_fixture(tc_ccf, setup_test_calculate_conc_fds,
 					  retire_test_calculate_conc_fds);
@@ -3102,53 +3011,20 @@ suite_broadcast(void)
 	tcase_add_test(tc_trm, test_read_message_block);
 	suite_add_tcase(s, tc_trm);
 
-	TCase *tc_trc = tcase_create("read chunk");
-	tcase_add_checked_fixture(tc_trc, setup_test_read_chunk, NULL);
-	tcase_add_test(tc_trc, test_read_chunk);
-	suite_add_tcase(s, tc_trc);
+	TCase *tc_trf = tcase_create("read full");
+	tcase_add_checked_fixture(tc_trf, NULL, NULL);
+	tcase_add_test(tc_trf, test_read_full);
+	suite_add_tcase(s, tc_trf);
 
 	TCase *tc_clr = tcase_create("call read");
 	tcase_add_checked_fixture(tc_clr, NULL, NULL);
 	tcase_add_test(tc_clr, test_call_read);
 	suite_add_tcase(s, tc_clr);
 
-	TCase *tc_acm = tcase_create("alloc copy message block");
-	tcase_add_checked_fixture(tc_acm, NULL, NULL);
-	tcase_add_test(tc_acm, test_alloc_copy_mb);
-	suite_add_tcase(s, tc_acm);
-
-	TCase *tc_acn = tcase_create("alloc copy nodes");
-	tcase_add_checked_fixture(tc_acn, setup_test_alloc_copy_nodes,
-					  retire_test_alloc_copy_nodes);
-	tcase_add_test(tc_acn, test_alloc_copy_nodes);
-	suite_add_tcase(s, tc_acn);
-
-	TCase *tc_ace = tcase_create("alloc copy edges");
-	tcase_add_checked_fixture(tc_ace, setup_test_alloc_copy_edges,
-					  retire_test_alloc_copy_edges);
-	tcase_add_test(tc_ace, test_alloc_copy_edges);
-	suite_add_tcase(s, tc_ace);
-
-	TCase *tc_acg = tcase_create("alloc copy graph solution");
-	tcase_add_checked_fixture(tc_acg, setup_test_alloc_copy_graph_solution,
-				retire_test_alloc_copy_graph_solution);
-	tcase_add_test(tc_acg, test_alloc_copy_graph_solution);
-	suite_add_tcase(s, tc_acg);
-
-	TCase *tc_acc = tcase_create("alloc copy concs");
-	tcase_add_checked_fixture(tc_acc, setup_test_alloc_copy_concs,
-				retire_test_alloc_copy_concs);
-	tcase_add_test(tc_acc, test_alloc_copy_concs);
-	suite_add_tcase(s, tc_acc);
-
-	TCase *tc_acp = tcase_create("alloc copy proc pids");
-	tcase_add_test(tc_acp, test_alloc_copy_proc_pids);
-	suite_add_tcase(s, tc_acp);
-
-	TCase *tc_cr = tcase_create("check read");
-	tcase_add_checked_fixture(tc_cr, NULL, NULL);
-	tcase_add_test(tc_cr, test_check_read);
-	suite_add_tcase(s, tc_cr);
+	TCase *tc_wv = tcase_create("wire varint");
+	tcase_add_checked_fixture(tc_wv, NULL, NULL);
+	tcase_add_test(tc_wv, test_wire_varint);
+	suite_add_tcase(s, tc_wv);
 /*
 	*TCase *tc_pid = tcase_create("point io direction");
 	tcase_add_checked_fixture(tc_pid, setup_test_point_io_direction,
@@ -3157,6 +3033,11 @@ suite_broadcast(void)
 	suite_add_tcase(s, tc_pid);
 */
 
+	TCase *tc_mmb = tcase_create("merge message block");
+	tcase_add_checked_fixture(tc_mmb, NULL, NULL);
+	tcase_add_test(tc_mmb, test_merge_message_block);
+	suite_add_tcase(s, tc_mmb);
+
 	TCase *tc_ar = tcase_create("analyse read");
 	tcase_add_checked_fixture(tc_ar, setup_test_analyse_read,
 					  retire_test_analyse_read);
@@ -3224,6 +3105,11 @@ suite_broadcast(void)
 	tcase_add_test(tc_gevs, test_get_environment_vars);
 	suite_add_tcase(s, tc_gevs);
 
+	TCase *tc_pfl = tcase_create("parse fd list");
+	tcase_add_checked_fixture(tc_pfl, NULL, NULL);
+	tcase_add_test(tc_pfl, test_parse_fd_list);
+	suite_add_tcase(s, tc_pfl);
+
 	TCase *tc_vi = tcase_create("validate input");
 	tcase_add_checked_fixture(tc_vi, NULL, NULL);
 	tcase_add_test(tc_vi, test_validate_input);
@@ -3237,6 +3123,7 @@ suite_broadcast(void)
 	TCase *tc_sn = tcase_create("dgsh negotiate");
 	tcase_add_checked_fixture(tc_sn, setup, retire);
 	tcase_add_test(tc_sn, test_dgsh_negotiate);
+	tcase_add_test(tc_sn, test_dgsh_negotiate_provided_fds);
 	suite_add_tcase(s, tc_sn);
 
 	return s;